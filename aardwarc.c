@@ -29,11 +29,15 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/endian.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "vdef.h"
 
@@ -43,10 +47,39 @@
 
 #include "aardwarc.h"
 
+static int v_matchproto_(config_f)
+aardwarc_check_level(void *priv, const char *name, const char *arg)
+{
+	struct vsb *err;
+
+	CAST_OBJ_NOTNULL(err, priv, VSB_MAGIC);
+	if (arg == NULL || arg[0] < '0' || arg[0] > '9' || arg[1] != '\0') {
+		VSB_printf(err,
+		    "'compression.level' for %s must be [0...9]\n", name);
+		return (-1);
+	}
+	return (0);
+}
+
+static int v_matchproto_(config_f)
+aardwarc_silo_dir(void *priv, const char *name, const char *arg)
+{
+	struct aardwarc *aa;
+
+	CAST_OBJ_NOTNULL(aa, priv, AARDWARC_MAGIC);
+	(void)arg;
+	aa->silo_dirs = realloc(aa->silo_dirs,
+	    (aa->nsilo_dir + 1L) * sizeof *aa->silo_dirs);
+	AN(aa->silo_dirs);
+	aa->silo_dirs[aa->nsilo_dir++] = name;
+	return (0);
+}
+
 struct aardwarc *
 AardWARC_New(const char *config_file, struct vsb *err)
 {
 	int e;
+	unsigned u;
 	struct aardwarc *aa;
 	const char *p, *p2;
 	uintmax_t um;
@@ -92,17 +125,47 @@ AardWARC_New(const char *config_file, struct vsb *err)
 			aa->id_size = 32;
 		assert(aa->id_size >= 16 && aa->id_size <= 64);
 
-		if (Config_Get(aa->cfg, "silo.directory", &p, NULL)) {
+		if (Config_Iter(aa->cfg, "silo.directory", aa,
+		    aardwarc_silo_dir)) {
 			VSB_printf(err,
 			    "'silo.directory' not found in config.\n");
 			break;
 		}
-		aa->silo_dirname = p;
-		if (aa->silo_dirname[strlen(aa->silo_dirname) - 1] != '/') {
+		for (u = 0; u < aa->nsilo_dir; u++) {
+			p = aa->silo_dirs[u];
+			if (p[strlen(p) - 1] != '/')
+				break;
+		}
+		if (u < aa->nsilo_dir) {
 			VSB_printf(err,
 			    "'silo.directory' must end in '/'\n");
 			break;
 		}
+		/* The index and the _.cache live in the first one */
+		aa->silo_dirname = aa->silo_dirs[0];
+
+		if (!Config_Get(aa->cfg, "silo.staging", &p, NULL)) {
+			aa->staging_dirname = p;
+			if (p[strlen(p) - 1] != '/') {
+				VSB_printf(err,
+				    "'silo.staging' must end in '/'\n");
+				break;
+			}
+		}
+
+		if (Config_Get(aa->cfg, "silo.placement", &p, NULL))
+			p = "round-robin";
+		if (!strcmp(p, "round-robin"))
+			aa->silo_placement = PLACE_ROUNDROBIN;
+		else if (!strcmp(p, "least-full"))
+			aa->silo_placement = PLACE_LEASTFULL;
+		else if (!strcmp(p, "hash"))
+			aa->silo_placement = PLACE_HASH;
+		else {
+			VSB_printf(err, "'silo.placement' must be %s\n",
+			    "round-robin, least-full or hash");
+			break;
+		}
 
 		if (Config_Get(aa->cfg, "silo.max_size", &p, NULL))
 			p = "3.5G";
@@ -148,6 +211,75 @@ AardWARC_New(const char *config_file, struct vsb *err)
 			break;
 		}
 
+		if (!Config_Get(aa->cfg, "cache.directory", &p, NULL)) {
+			aa->objcache_dirname = p;
+			if (p[strlen(p) - 1] != '/') {
+				VSB_printf(err,
+				    "'cache.directory' must end in '/'\n");
+				break;
+			}
+		}
+
+		if (Config_Get(aa->cfg, "cache.max_size", &p, NULL))
+			p = "1G";
+		p2 = VNUM_2bytes(p, &um, 0);
+		if (p2 != NULL) {
+			VSB_printf(err,
+			    "'cache.max_size' size \"%s\":\t%s\n", p, p2);
+			break;
+		}
+		aa->objcache_maxsize = (off_t)um;
+
+		if (Config_Get(aa->cfg, "compression.threads", &p, NULL))
+			p = "1";
+		aa->compression_threads = strtoul(p, NULL, 0);
+		if (aa->compression_threads < 1 ||
+		    aa->compression_threads > 64) {
+			VSB_printf(err,
+			    "'compression.threads' must be [1...64]\n");
+			break;
+		}
+
+		if (Config_Get(aa->cfg, "silo.write_buffers", &p, NULL))
+			p = "4";
+		aa->write_buffers = strtoul(p, NULL, 0);
+		if (aa->write_buffers < 1 || aa->write_buffers > 64) {
+			VSB_printf(err,
+			    "'silo.write_buffers' must be [1...64]\n");
+			break;
+		}
+
+		if (Config_Get(aa->cfg, "silo.preallocate", &p, NULL))
+			p = "none";
+		if (!strcmp(p, "none"))
+			aa->silo_prealloc = PREALLOC_NONE;
+		else if (!strcmp(p, "hold"))
+			aa->silo_prealloc = PREALLOC_HOLD;
+#ifdef FALLOC_FL_KEEP_SIZE
+		else if (!strcmp(p, "silo"))
+			aa->silo_prealloc = PREALLOC_SILO;
+#else
+		else if (!strcmp(p, "silo")) {
+			/* Rather than quietly doing 'hold' */
+			VSB_printf(err, "'silo.preallocate' silo is not"
+			    " supported on this platform\n");
+			break;
+		}
+#endif
+		else {
+			VSB_printf(err,
+			    "'silo.preallocate' must be none, hold or silo\n");
+			break;
+		}
+
+		if (Config_Iter(aa->cfg, "compression.level", err,
+		    aardwarc_check_level) < 0)
+			break;
+
+		aa->commit = Commit_New(aa, err);
+		if (aa->commit == NULL)
+			break;
+
 		aa->cache_first_non_silo = 0;
 		aa->cache_first_space_silo = 0;
 
@@ -161,47 +293,222 @@ AardWARC_New(const char *config_file, struct vsb *err)
 	return (NULL);
 }
 
-void
-AardWARC_ReadCache(struct aardwarc *aa)
+/*
+ * The '_.cache' file
+ * ------------------
+ *
+ * The first eight bytes are the first silo number which does not exist
+ * and the first silo which may have space left, both only hints which
+ * only ever grow.  After that follows the lease table, which tracks
+ * which silo numbers are being written by whom:
+ *
+ *	uint32_t	silo number
+ *	uint32_t	pid
+ *	uint64_t	time(3) of lease
+ *
+ * All access happens under flock(2), so parallel writers can allocate
+ * silo numbers without colliding, and without leaving gaps.  Leases of
+ * processes which no longer exist are reclaimed and their hold files
+ * removed.  However old, a lease held by a live process is left alone,
+ * it may still be writing the silo.  If the pid has been reused, the
+ * lease goes when that process does.
+ */
+
+#define LEASE_SIZE	16
+
+struct cachefile {
+	int			fd;
+	uint8_t			*buf;
+	size_t			len;
+};
+
+static void
+cache_open(const struct aardwarc *aa, struct cachefile *cf, int how)
 {
 	struct vsb *vsb;
-	uint8_t buf[4 * 2];
-	int i;
-	int fd;
+	struct stat st;
+	ssize_t i;
 
+	memset(cf, 0, sizeof *cf);
 	vsb = VSB_new_auto();
 	AN(vsb);
 	VSB_printf(vsb, "%s/_.cache", aa->silo_dirname);
 	AZ(VSB_finish(vsb));
-	fd = open(VSB_data(vsb), O_RDONLY);
-	if (fd >= 0) {
-		i = read(fd, buf, sizeof buf);
-		if (i == sizeof buf) {
-			aa->cache_first_non_silo = be32dec(buf);
-			aa->cache_first_space_silo = be32dec(buf + 4);
-		}
-		AZ(close(fd));
-	}
+	if (how == LOCK_SH)
+		cf->fd = open(VSB_data(vsb), O_RDONLY);
+	else
+		cf->fd = open(VSB_data(vsb), O_RDWR|O_CREAT, 0644);
 	VSB_delete(vsb);
+	if (cf->fd < 0)
+		return;
+	AZ(flock(cf->fd, how));
+	AZ(fstat(cf->fd, &st));
+	cf->len = st.st_size;
+	/* Room for the 8 byte header and one new lease */
+	cf->buf = malloc(cf->len + 8 + LEASE_SIZE);
+	AN(cf->buf);
+	i = pread(cf->fd, cf->buf, cf->len, 0);
+	assert(i == (ssize_t)cf->len);
+	if (cf->len < 8) {
+		memset(cf->buf, 0, 8);
+		cf->len = 8;
+	}
+	/* Ignore any torn lease */
+	cf->len -= (cf->len - 8) % LEASE_SIZE;
+}
+
+static void
+cache_close(const struct aardwarc *aa, struct cachefile *cf, int write)
+{
+	ssize_t i;
+
+	if (cf->fd < 0)
+		return;
+	if (write) {
+		/* The hints only ever grow */
+		if (be32dec(cf->buf) < aa->cache_first_non_silo)
+			be32enc(cf->buf, aa->cache_first_non_silo);
+		if (be32dec(cf->buf + 4) < aa->cache_first_space_silo)
+			be32enc(cf->buf + 4, aa->cache_first_space_silo);
+		i = pwrite(cf->fd, cf->buf, cf->len, 0);
+		assert(i == (ssize_t)cf->len);
+		AZ(ftruncate(cf->fd, cf->len));
+	}
+	AZ(close(cf->fd));
+	free(cf->buf);
+}
+
+static void
+cache_update(struct aardwarc *aa, const struct cachefile *cf)
+{
+	uint32_t u;
+
+	u = be32dec(cf->buf);
+	if (u > aa->cache_first_non_silo)
+		aa->cache_first_non_silo = u;
+	u = be32dec(cf->buf + 4);
+	if (u > aa->cache_first_space_silo)
+		aa->cache_first_space_silo = u;
+}
+
+static void
+cache_del_lease(struct cachefile *cf, size_t o)
+{
+
+	memmove(cf->buf + o, cf->buf + o + LEASE_SIZE,
+	    cf->len - (o + LEASE_SIZE));
+	cf->len -= LEASE_SIZE;
+}
+
+void
+AardWARC_ReadCache(struct aardwarc *aa)
+{
+	struct cachefile cf[1];
+
+	cache_open(aa, cf, LOCK_SH);
+	if (cf->fd >= 0)
+		cache_update(aa, cf);
+	cache_close(aa, cf, 0);
 }
 
 void
 AardWARC_WriteCache(const struct aardwarc *aa)
 {
+	struct cachefile cf[1];
+
+	cache_open(aa, cf, LOCK_EX);
+	cache_close(aa, cf, 1);
+}
+
+/* Get a lease on the lowest free silo number --------------------------*/
+
+uint32_t
+AardWARC_LeaseSilo(struct aardwarc *aa)
+{
+	struct cachefile cf[1];
 	struct vsb *vsb;
-	uint8_t buf[4 * 2];
-	int fd;
+	struct stat st;
+	uint32_t sn, pid;
+	time_t now;
+	size_t o;
+	int i;
 
-	vsb = VSB_new_auto();
-	AN(vsb);
-	VSB_printf(vsb, "%s/_.cache", aa->silo_dirname);
-	AZ(VSB_finish(vsb));
-	be32enc(buf, aa->cache_first_non_silo);
-	be32enc(buf + 4, aa->cache_first_space_silo);
-	fd = open(VSB_data(vsb), O_WRONLY|O_CREAT, 0644);
-	if (fd >= 0) {
-		(void)write(fd, buf, sizeof buf);
-		AZ(close(fd));
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cache_open(aa, cf, LOCK_EX);
+	assert(cf->fd >= 0);
+	cache_update(aa, cf);
+	now = time(NULL);
+
+	/* Reclaim stale leases */
+	for (o = 8; o < cf->len; ) {
+		pid = be32dec(cf->buf + o + 4);
+		if (kill((pid_t)pid, 0) && errno == ESRCH) {
+			vsb = Silo_Filename(aa, be32dec(cf->buf + o), 1);
+			AN(vsb);
+			(void)unlink(VSB_data(vsb));
+			VSB_delete(vsb);
+			cache_del_lease(cf, o);
+		} else
+			o += LEASE_SIZE;
 	}
+
+	for (sn = aa->cache_first_non_silo; ; sn++) {
+		for (o = 8; o < cf->len; o += LEASE_SIZE)
+			if (be32dec(cf->buf + o) == sn)
+				break;
+		if (o < cf->len)
+			continue;
+		vsb = Silo_Filename(aa, sn, 0);
+		AN(vsb);
+		if (!stat(VSB_data(vsb), &st)) {
+			if (sn == aa->cache_first_non_silo)
+				aa->cache_first_non_silo++;
+			VSB_delete(vsb);
+			continue;
+		}
+		VSB_delete(vsb);
+		/* Held by somebody who does not take leases */
+		vsb = Silo_Filename(aa, sn, 1);
+		AN(vsb);
+		i = stat(VSB_data(vsb), &st);
+		VSB_delete(vsb);
+		if (i)
+			break;
+	}
+
+	o = cf->len;
+	be32enc(cf->buf + o, sn);
+	be32enc(cf->buf + o + 4, (uint32_t)getpid());
+	be64enc(cf->buf + o + 8, (uint64_t)now);
+	cf->len += LEASE_SIZE;
+	cache_close(aa, cf, 1);
+	return (sn);
+}
+
+/* Give up a lease, the silo may or may not have been installed --------*/
+
+void
+AardWARC_ReleaseSilo(struct aardwarc *aa, uint32_t silono)
+{
+	struct cachefile cf[1];
+	struct vsb *vsb;
+	struct stat st;
+	size_t o;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cache_open(aa, cf, LOCK_EX);
+	assert(cf->fd >= 0);
+	cache_update(aa, cf);
+	for (o = 8; o < cf->len; o += LEASE_SIZE) {
+		if (be32dec(cf->buf + o) == silono) {
+			cache_del_lease(cf, o);
+			break;
+		}
+	}
+	vsb = Silo_Filename(aa, silono, 0);
+	AN(vsb);
+	if (silono == aa->cache_first_non_silo && !stat(VSB_data(vsb), &st))
+		aa->cache_first_non_silo++;
 	VSB_delete(vsb);
+	cache_close(aa, cf, 1);
 }
@@ -36,6 +36,7 @@ struct rsilo;
 struct wsilo;
 struct header;
 struct segjob;
+struct validator;
 
 /*
  * An instance of an aardwarc store
@@ -52,6 +53,13 @@ struct aardwarc {
 	struct config		*cfg;
 	const char		*prefix;
 	const char		*silo_dirname;
+	const char		*staging_dirname;
+	const char		**silo_dirs;
+	unsigned		nsilo_dir;
+	unsigned		silo_placement;
+#define PLACE_ROUNDROBIN	0
+#define PLACE_LEASTFULL		1
+#define PLACE_HASH		2
 	const char		*silo_basename;
 	off_t			silo_maxsize;
 	const char		*mime_validator;
@@ -59,6 +67,19 @@ struct aardwarc {
 
 	size_t			index_sort_size;
 
+	const char		*objcache_dirname;
+	off_t			objcache_maxsize;
+
+	unsigned		compression_threads;
+	unsigned		write_buffers;
+	unsigned		silo_prealloc;
+#define PREALLOC_NONE		0
+#define PREALLOC_HOLD		1
+#define PREALLOC_SILO		2
+
+	struct commit		*commit;
+	struct silospace	*silospace;	// See wsilo.c
+
 	uint32_t		cache_first_non_silo;
 	uint32_t		cache_first_space_silo;
 };
@@ -70,6 +91,21 @@ typedef int byte_iter_f(void *priv, const void *ptr, ssize_t len);
 struct aardwarc *AardWARC_New(const char *config_file, struct vsb *err);
 void AardWARC_ReadCache(struct aardwarc *aa);
 void AardWARC_WriteCache(const struct aardwarc *aa);
+uint32_t AardWARC_LeaseSilo(struct aardwarc *aa);
+void AardWARC_ReleaseSilo(struct aardwarc *aa, uint32_t silono);
+
+/* commit.c */
+
+typedef int commit_rec_f(void *priv, const uint8_t *rec);
+
+struct commit *Commit_New(const struct aardwarc *, struct vsb *err);
+void Commit_Index(const struct aardwarc *, uint32_t silono, int new,
+    const uint8_t *recs, size_t nrec);
+uint64_t Commit_Done(const struct aardwarc *);
+void Commit_Wait(const struct aardwarc *, uint64_t gen);
+void Commit_Flush(const struct aardwarc *);
+int Commit_Iter(const struct aardwarc *, commit_rec_f *func, void *priv);
+void Commit_Report(const struct aardwarc *, struct vsb *);
 
 /* config.c */
 
@@ -103,15 +139,22 @@ extern const uint8_t Gzip_crnlcrnl[24];
     void Gzip_AddAa(z_stream *);
     #define AA_COMPRESSION Z_BEST_COMPRESSION
     //#define AA_COMPRESSION Z_NO_COMPRESSION
-    void Gzip_InitDeflate(z_stream *zs);
+    z_stream *Gzip_GetDeflate(int level);
+    z_stream *Gzip_GetRawDeflate(int level);
+    z_stream *Gzip_GetInflate(int wbits);
+    void Gzip_Put(z_stream **);
 #endif
+size_t Gzip_AaHeader(void *ptr, size_t len);
+size_t Gzip_Trailer(void *ptr, size_t len, uint32_t crc, uint32_t isize);
 int64_t Gzip_ReadAa(const void *, size_t);
 void Gzip_WriteAa(int, int64_t);
+void Gzip_SetAa(void *, size_t, int64_t);
 
 struct gzip_stitch;
 struct gzip_stitch * gzip_stitch_new(byte_iter_f *func, void *priv);
 int gzip_stitch_feed(void *priv, const void *ptr, ssize_t len);
 int gzip_stitch_fini(struct gzip_stitch *gs);
+int64_t gzip_stitch_len(int64_t gzlen, const uint8_t *tail);
 
 /* header.c */
 
@@ -129,7 +172,7 @@ intmax_t Header_Get_Number(const struct header *, const char *);
 void Header_Set_Id(struct header *, const char *);
 void Header_Set_Date(struct header *);
 void Header_Set_Ref(struct header *, const char *name, const char *ref);
-struct header *Header_Parse(const struct aardwarc *, char *);
+struct header *Header_Parse(const struct aardwarc *, const char *);
 //off_t Header_Get_GZlen(const struct header *);
 const char *Header_Get(const struct header *, const char *name);
 
@@ -143,8 +186,20 @@ char *Digest2Ident(const struct aardwarc *, const char *);
 
 /* index.c */
 
+#define IDX_RECSIZE	32
+#define IDX_KEYLEN	12
+
+/* The leading bytes of a WARC-id, as the index holds them */
+struct idx_key {
+	uint8_t			b[IDX_KEYLEN];
+};
+
 void IDX_Insert(const struct aardwarc *aa, const char *key, uint32_t flags,
     uint32_t silo, uint64_t offset, const char *cont);
+void IDX_Record(const struct aardwarc *aa, uint8_t *rec, const char *key,
+    uint32_t flags, uint32_t silo, uint64_t offset, const char *cont);
+void IDX_Append(const struct aardwarc *aa, const uint8_t *recs, size_t nrec,
+    int sync);
 
 typedef int idx_iter_f(void *priv, const char *key,
     uint32_t flag, uint32_t silo, int64_t offset, const char *cont);
@@ -152,6 +207,15 @@ typedef int idx_iter_f(void *priv, const char *key,
 int IDX_Iter(const struct aardwarc *aa, const char *key_part,
     idx_iter_f *func, void *priv);
 
+typedef int idx_iter_bin_f(void *priv, const struct idx_key *key,
+    uint32_t flag, uint32_t silo, int64_t offset, uint32_t cont);
+
+int IDX_IterBin(const struct aardwarc *aa, const struct idx_key *key_part,
+    unsigned nibbles, idx_iter_bin_f *func, void *priv);
+
+void IDX_Hex(char *dst, const uint8_t *src, size_t len);
+ssize_t IDX_Unhex(uint8_t *dst, size_t len, const char *src);
+
 void IDX_Resort(const struct aardwarc *aa);
 
 const char *IDX_Valid_Id(const struct aardwarc *,
@@ -168,6 +232,20 @@ const char *IDX_Valid_Id(const struct aardwarc *,
 #define IDX_F_FIRSTSEG		(1 << 5)
 #define IDX_F_LASTSEG		(1 << 6)
 
+/* objcache.c */
+
+struct objcache;
+struct objcache *ObjCache_Lookup(struct aardwarc *, const char *id);
+const struct header *ObjCache_Header(const struct objcache *);
+const char *ObjCache_Headers(const struct objcache *);
+off_t ObjCache_Length(const struct objcache *);
+void ObjCache_Iter(const struct objcache *, byte_iter_f *func, void *priv);
+void ObjCache_Close(struct objcache **);
+struct objcache *ObjCache_Create(struct aardwarc *, const char *id,
+    const char *hdrtxt, off_t len);
+byte_iter_f ObjCache_Fill;
+void ObjCache_Commit(struct objcache **);
+
 /* proto.c */
 
 int proto_in(int fd, unsigned *cmd, unsigned *len);
@@ -192,11 +270,14 @@ void proto_dispatch_evs(void);
 struct segjob *SegJob_New(struct aardwarc *, const struct header *,
     const char *);
 void SegJob_Feed(struct segjob *, const void *ptr, ssize_t len);
+void SegJob_Batch(struct segjob *, struct wsilo *);
 char *SegJob_Commit(struct segjob *);
+void SegJob_Abandon(struct segjob **);
 
 /* silo.c */
 struct vsb *Silo_Filename(const struct aardwarc *, unsigned number, int hold);
 int Silo_Iter(const struct aardwarc *, byte_iter_f *func, void *priv);
+int Silo_Extents(const char *fn, off_t *size);
 
 
 /* silo_read.c */
@@ -207,6 +288,8 @@ void Rsilo_NextHeader(struct rsilo *);
 struct header *Rsilo_ReadHeader(struct rsilo *);
 uintmax_t Rsilo_ReadChunk(struct rsilo *, byte_iter_f *, void *);
 int64_t Rsilo_BodyLen(const struct rsilo *);
+void Rsilo_Prefetch(const struct rsilo *);
+void Rsilo_ReadGZTail(const struct rsilo *, uint8_t *tail, size_t len);
 int Rsilo_ReadGZChunk(struct rsilo *, byte_iter_f *, void *);
 off_t Rsilo_Tell(const struct rsilo *);
 void Rsilo_SkipCRNL(struct rsilo *rs);
@@ -214,13 +297,32 @@ void Rsilo_SkipCRNL(struct rsilo *rs);
 /* silo_write.c */
 struct wsilo *Wsilo_New(struct aardwarc *aa, uint32_t silono);
 struct wsilo *Wsilo_Next(struct aardwarc *);
-void Wsilo_GetSpace(const struct wsilo *, void **ptr, ssize_t *len);
+void Wsilo_GetSpace(struct wsilo *, void **ptr, ssize_t *len);
+off_t Wsilo_Left(const struct wsilo *);
 int Wsilo_Store(struct wsilo *, ssize_t len);
 void Wsilo_Finish(struct wsilo *);
 void Wsilo_Header(struct wsilo *, struct header *, int pad);
 void Wsilo_Commit(struct wsilo **, int segd, const char *id, const char *rid);
 void Wsilo_Install(struct wsilo **);
 void Wsilo_Abandon(struct wsilo **);
+struct wsilo *Wsilo_Batch(struct aardwarc *);
+int Wsilo_Batched(const struct wsilo *, const char *id);
+int Wsilo_BatchFits(const struct aardwarc *, off_t len);
+int Wsilo_BatchRoom(const struct wsilo *, off_t len);
+int Wsilo_Have(struct aardwarc *, const struct wsilo *, const char *id);
+struct header *Wsilo_NewHeader(const struct aardwarc *, const char *wt,
+    const char *mt);
+void Wsilo_Print(struct vsb *);
+void Wsilo_Done(const struct aardwarc *, struct vsb *);
+void Wsilo_BatchDone(const struct aardwarc *, struct wsilo **, struct vsb *);
+void Wsilo_Rewind(struct wsilo *);
+void Wsilo_BatchCommit(struct wsilo **);
+
+/* validate.c */
+struct validator *Validator_New(const char *cmd);
+void Validator_Feed(struct validator *, const void *ptr, size_t len);
+int Validator_Finish(struct validator **, struct vsb *err);
+struct vsb *Validator_Verdict(struct validator **);
 
 /* vnum.c */
 const char *VNUM_2bytes(const char *p, uintmax_t *r, uintmax_t rel);
@@ -241,11 +343,15 @@ extern main_f main_dumpindex;
 extern main_f main_filter;
 extern main_f main_get;
 extern main_f main_housekeeping;
+extern main_f main_httpd;
 extern main_f main_info;
+extern main_f main_import_warc;
+extern main_f main_ingest_tar;
 extern main_f main_mksilo;
 extern main_f main_rebuild;
 extern main_f main_reindex;
 extern main_f main_stevedore;
 extern main_f main_store;
+extern main_f main_stored;
 extern main_f main_stow;
 extern main_f main__testbytes;
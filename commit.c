@@ -0,0 +1,419 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Group commit
+ * ------------
+ *
+ * For an object to be safely stored, its bytes must be on stable storage
+ * before the index entries which point to them are, and those must be
+ * too before we tell anybody the object is stored.
+ *
+ * Calling fsync(2) for every object would make storing lots of small
+ * objects painfully slow, so instead the silo writers hand us the silos
+ * they have written to and the index records, and we hold on to the
+ * records until the end of a commit window, where each silo is synced
+ * once, then all the records are appended to the index which is synced
+ * once.
+ *
+ * The window is configured with the 'commit.window' section, where the
+ * name is the milliseconds and the argument the number of commits:
+ *
+ *	commit.window:
+ *		100	1000
+ *
+ * Without it, every commit is synced by itself.
+ *
+ * Records we hold on to are visible to IDX_Iter() through Commit_Iter()
+ * so that a process can still find what it stored itself.  That includes
+ * the records being synced, until they are in the appendix.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+struct commit_silo {
+	uint32_t		silono;
+	int			dir;
+};
+
+struct commit {
+	unsigned		magic;
+#define COMMIT_MAGIC		0x2b6e9d31
+
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+
+	unsigned		window_ms;
+	unsigned		window_count;
+
+	uint8_t			*recs;
+	size_t			nrec;
+	size_t			recspace;
+
+	struct commit_silo	*silos;
+	size_t			nsilo;
+	size_t			silospace;
+
+	/* Being synced, see Commit_Iter() */
+	const uint8_t		*flight;
+	size_t			nflight;
+
+	unsigned		npending;
+	double			t_first;
+	double			t_sum;
+
+	uint64_t		gen;
+	uint64_t		synced;
+	int			syncing;
+
+	/* Statistics */
+	uintmax_t		n_commit;
+	uintmax_t		n_sync;
+	double			lat_sum;
+	double			lat_max;
+};
+
+static double
+commit_now(void)
+{
+	struct timespec ts;
+
+	AZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+struct commit *
+Commit_New(const struct aardwarc *aa, struct vsb *err)
+{
+	struct commit *cm;
+	const char *n, *a;
+
+	ALLOC_OBJ(cm, COMMIT_MAGIC);
+	AN(cm);
+	cm->window_count = 1;
+	if (!Config_Get(aa->cfg, "commit.window", &n, &a)) {
+		cm->window_ms = strtoul(n, NULL, 0);
+		if (a != NULL)
+			cm->window_count = strtoul(a, NULL, 0);
+		if (cm->window_count < 1) {
+			VSB_printf(err,
+			    "'commit.window' count must be at least 1\n");
+			FREE_OBJ(cm);
+			return (NULL);
+		}
+	}
+	AZ(pthread_mutex_init(&cm->mtx, NULL));
+	AZ(pthread_cond_init(&cm->cond, NULL));
+	return (cm);
+}
+
+/* Data has been written to this silo, which may be new ---------------*/
+
+static void
+commit_silo(struct commit *cm, uint32_t silono, int new)
+{
+	size_t u;
+
+	for (u = 0; u < cm->nsilo; u++)
+		if (cm->silos[u].silono == silono)
+			break;
+	if (u == cm->nsilo) {
+		if (cm->nsilo == cm->silospace) {
+			cm->silospace += 16;
+			cm->silos = realloc(cm->silos,
+			    cm->silospace * sizeof *cm->silos);
+			AN(cm->silos);
+		}
+		cm->silos[u].silono = silono;
+		cm->silos[u].dir = 0;
+		cm->nsilo++;
+	}
+	cm->silos[u].dir |= new;
+}
+
+/*
+ * Index records, pointing into silo 'silono', to be written once the
+ * silo is synced.  Both are queued under the same lock, so no sync can
+ * take the records without the silo.
+ */
+
+void
+Commit_Index(const struct aardwarc *aa, uint32_t silono, int new,
+    const uint8_t *recs, size_t nrec)
+{
+	struct commit *cm;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+	AN(recs);
+
+	AZ(pthread_mutex_lock(&cm->mtx));
+	commit_silo(cm, silono, new);
+	if (cm->nrec + nrec > cm->recspace) {
+		cm->recspace = cm->recspace ? cm->recspace * 2 : 64;
+		if (cm->recspace < cm->nrec + nrec)
+			cm->recspace = cm->nrec + nrec;
+		cm->recs = realloc(cm->recs, cm->recspace * IDX_RECSIZE);
+		AN(cm->recs);
+	}
+	memcpy(cm->recs + cm->nrec * IDX_RECSIZE, recs, nrec * IDX_RECSIZE);
+	cm->nrec += nrec;
+	AZ(pthread_mutex_unlock(&cm->mtx));
+}
+
+/* Sync everything pending, called and returns with the lock held ------*/
+
+static void
+commit_sync(const struct aardwarc *aa, struct commit *cm)
+{
+	struct commit_silo *silos;
+	struct vsb *vsb;
+	uint8_t *recs;
+	size_t nrec, nsilo, u;
+	unsigned npending;
+	uint64_t gen;
+	double t_first, t_sum, t;
+	char *p;
+	int fd;
+
+	AZ(cm->syncing);
+	cm->syncing = 1;
+	gen = cm->gen;
+	recs = cm->recs;
+	nrec = cm->nrec;
+	silos = cm->silos;
+	nsilo = cm->nsilo;
+	npending = cm->npending;
+	t_first = cm->t_first;
+	t_sum = cm->t_sum;
+	cm->recs = NULL;
+	cm->nrec = cm->recspace = 0;
+	cm->silos = NULL;
+	cm->nsilo = cm->silospace = 0;
+	cm->npending = 0;
+	cm->t_sum = 0;
+	cm->flight = recs;
+	cm->nflight = nrec;
+	AZ(pthread_mutex_unlock(&cm->mtx));
+
+	for (u = 0; u < nsilo; u++) {
+		vsb = Silo_Filename(aa, silos[u].silono, 0);
+		AN(vsb);
+		fd = open(VSB_data(vsb), O_RDONLY);
+		assert(fd >= 0);
+		AZ(fdatasync(fd));
+		AZ(close(fd));
+		if (silos[u].dir) {
+			/* Make the link(2) stick */
+			p = strrchr(VSB_data(vsb), '/');
+			AN(p);
+			*p = '\0';
+			fd = open(VSB_data(vsb), O_RDONLY);
+			assert(fd >= 0);
+			AZ(fsync(fd));
+			AZ(close(fd));
+		}
+		VSB_delete(vsb);
+	}
+	if (nrec > 0)
+		IDX_Append(aa, recs, nrec, 1);
+	free(silos);
+
+	t = commit_now();
+	AZ(pthread_mutex_lock(&cm->mtx));
+	cm->flight = NULL;
+	cm->nflight = 0;
+	free(recs);
+	cm->syncing = 0;
+	cm->synced = gen;
+	cm->n_sync++;
+	cm->n_commit += npending;
+	cm->lat_sum += npending * t - t_sum;
+	if (npending > 0 && t - t_first > cm->lat_max)
+		cm->lat_max = t - t_first;
+	AZ(pthread_cond_broadcast(&cm->cond));
+}
+
+static int
+commit_due(const struct commit *cm, double now)
+{
+
+	if (cm->npending >= cm->window_count)
+		return (1);
+	if (now - cm->t_first >= cm->window_ms * 1e-3)
+		return (1);
+	return (0);
+}
+
+/*
+ * A commit is complete, sync if the window is due, and return the
+ * generation to Commit_Wait() for, which is zero if it was synced.
+ */
+
+uint64_t
+Commit_Done(const struct aardwarc *aa)
+{
+	struct commit *cm;
+	uint64_t gen;
+	double now;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+
+	now = commit_now();
+	AZ(pthread_mutex_lock(&cm->mtx));
+	if (cm->npending++ == 0)
+		cm->t_first = now;
+	cm->t_sum += now;
+	gen = ++cm->gen;
+	if (!cm->syncing && commit_due(cm, now)) {
+		commit_sync(aa, cm);
+		if (cm->synced >= gen)
+			gen = 0;
+	}
+	AZ(pthread_mutex_unlock(&cm->mtx));
+	return (gen);
+}
+
+/* Wait for a commit to become durable, syncing when the window expires */
+
+void
+Commit_Wait(const struct aardwarc *aa, uint64_t gen)
+{
+	struct commit *cm;
+	struct timespec ts;
+	double t;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+
+	AZ(pthread_mutex_lock(&cm->mtx));
+	while (cm->synced < gen) {
+		if (cm->syncing) {
+			/* Nothing to time out for, commit_sync() wakes us */
+			AZ(pthread_cond_wait(&cm->cond, &cm->mtx));
+			continue;
+		}
+		if (commit_due(cm, commit_now())) {
+			commit_sync(aa, cm);
+			continue;
+		}
+		/* pthread_cond_timedwait() wants CLOCK_REALTIME */
+		AZ(clock_gettime(CLOCK_REALTIME, &ts));
+		t = ts.tv_sec + 1e-9 * ts.tv_nsec;
+		t += cm->window_ms * 1e-3 - (commit_now() - cm->t_first);
+		if (t < 0)
+			t = 0;
+		ts.tv_sec = (time_t)t;
+		ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+		(void)pthread_cond_timedwait(&cm->cond, &cm->mtx, &ts);
+	}
+	AZ(pthread_mutex_unlock(&cm->mtx));
+}
+
+/* Sync whatever is pending now ----------------------------------------*/
+
+void
+Commit_Flush(const struct aardwarc *aa)
+{
+	struct commit *cm;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+
+	AZ(pthread_mutex_lock(&cm->mtx));
+	while (cm->syncing)
+		AZ(pthread_cond_wait(&cm->cond, &cm->mtx));
+	if (cm->nrec > 0 || cm->nsilo > 0 || cm->npending > 0)
+		commit_sync(aa, cm);
+	AZ(pthread_mutex_unlock(&cm->mtx));
+}
+
+/*
+ * Let IDX_Iter() see the records we hold on to.  Records move from here
+ * to the appendix, so this must be called before the index files are
+ * read, and a record may be seen in both places.
+ */
+
+int
+Commit_Iter(const struct aardwarc *aa, commit_rec_f *func, void *priv)
+{
+	struct commit *cm;
+	size_t u;
+	int i = 0;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	if (cm == NULL)
+		return (0);
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+	AN(func);
+
+	AZ(pthread_mutex_lock(&cm->mtx));
+	for (u = 0; i == 0 && u < cm->nflight; u++)
+		i = func(priv, cm->flight + u * IDX_RECSIZE);
+	for (u = 0; i == 0 && u < cm->nrec; u++)
+		i = func(priv, cm->recs + u * IDX_RECSIZE);
+	AZ(pthread_mutex_unlock(&cm->mtx));
+	return (i);
+}
+
+void
+Commit_Report(const struct aardwarc *aa, struct vsb *vsb)
+{
+	const struct commit *cm;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	cm = aa->commit;
+	CHECK_OBJ_NOTNULL(cm, COMMIT_MAGIC);
+	AN(vsb);
+
+	VSB_printf(vsb, "Commits: %ju in %ju syncs", cm->n_commit, cm->n_sync);
+	if (cm->n_commit > 0)
+		VSB_printf(vsb, ", latency avg %.1f ms max %.1f ms",
+		    1e3 * cm->lat_sum / cm->n_commit, 1e3 * cm->lat_max);
+	VSB_printf(vsb, "\n");
+}
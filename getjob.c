@@ -223,6 +223,8 @@ GetJob_New(struct aardwarc *aa, const char *id, struct vsb *vsb)
 			break;
 		nid = gjs->idx_cont;
 	}
+	VTAILQ_FOREACH(gjs, &gj->segs, list)
+		Rsilo_Prefetch(gjs->rs);
 	return (gj);
 }
 
@@ -270,9 +272,20 @@ GetJob_TotalLength(const struct getjob *gj, int gzip)
 	struct getjobseg *gjs;
 	off_t sum = 0;
 	intmax_t im;
+	uint8_t tail[13];
 
 	CHECK_OBJ_NOTNULL(gj, GETJOB_MAGIC);
 
+	if (gzip && gj->nsegs > 1) {
+		/* Must match what gzip_stitch will produce */
+		sum = gzip_stitch_len(0, NULL);
+		VTAILQ_FOREACH(gjs, &gj->segs, list) {
+			Rsilo_ReadGZTail(gjs->rs, tail, sizeof tail);
+			sum += gzip_stitch_len(Rsilo_BodyLen(gjs->rs), tail);
+		}
+		return (sum);
+	}
+
 	// XXX: ... also available in headers in last segment.
 	VTAILQ_FOREACH(gjs, &gj->segs, list) {
 		if (gzip)
@@ -27,6 +27,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -40,6 +41,7 @@
 
 #include "vsb.h"
 #include "vas.h"
+#include "vqueue.h"
 
 #include "aardwarc.h"
 
@@ -120,6 +122,16 @@ Gzip_WriteAa(int fd, int64_t len)
 	assert(i == 8);
 }
 
+void
+Gzip_SetAa(void *p, size_t l, int64_t len)
+{
+
+	assert(len > 0);
+	assert(Gzip_GoodAa(p, l));
+	assert(l >= sizeof gzip_head + 8);
+	le64enc((uint8_t*)p + sizeof gzip_head, (uint64_t)len);
+}
+
 /**********************************************************************
  * Read the length from an Aa field
  */
@@ -144,6 +156,158 @@ const uint8_t Gzip_crnlcrnl[24] = {
 	0x44, 0x15, 0xc2, 0x8b, 0x04, 0x00, 0x00, 0x00
 };
 
+/**********************************************************************
+ * deflateInit2() allocates and clears some 270KB of state, which is
+ * more work than compressing a WARC header, so streams are reset and
+ * reused rather than torn down.
+ *
+ * The pool is shared by all threads, the parallel compression workers
+ * in segjob.c only live for a single block each.
+ */
+
+struct gzip_zs {
+	z_stream		zs[1];		/* Must be first */
+	unsigned		magic;
+#define GZIP_ZS_MAGIC		0x1a7e5c39
+	int			deflate;
+	int			level;
+	int			wbits;
+	VTAILQ_ENTRY(gzip_zs)	list;
+};
+
+#define GZIP_POOL_MAX		64
+
+static pthread_mutex_t gzip_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static VTAILQ_HEAD(,gzip_zs) gzip_pool = VTAILQ_HEAD_INITIALIZER(gzip_pool);
+static unsigned gzip_npool;
+
+static struct gzip_zs *
+gzip_pool_get(int deflate, int level, int wbits)
+{
+	struct gzip_zs *gz;
+
+	AZ(pthread_mutex_lock(&gzip_pool_mtx));
+	VTAILQ_FOREACH(gz, &gzip_pool, list) {
+		CHECK_OBJ_NOTNULL(gz, GZIP_ZS_MAGIC);
+		if (gz->deflate != deflate)
+			continue;
+		/* inflateReset2() can change the window, deflate cannot */
+		if (deflate && (gz->level != level || gz->wbits != wbits))
+			continue;
+		VTAILQ_REMOVE(&gzip_pool, gz, list);
+		gzip_npool--;
+		break;
+	}
+	AZ(pthread_mutex_unlock(&gzip_pool_mtx));
+	return (gz);
+}
+
+static z_stream *
+gzip_get_deflate(int level, int wbits)
+{
+	struct gzip_zs *gz;
+	int i;
+
+	assert(level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION);
+	gz = gzip_pool_get(1, level, wbits);
+	if (gz != NULL)
+		return (gz->zs);
+	ALLOC_OBJ(gz, GZIP_ZS_MAGIC);
+	AN(gz);
+	gz->deflate = 1;
+	gz->level = level;
+	gz->wbits = wbits;
+	i = deflateInit2(
+	    gz->zs,
+	    level,
+	    Z_DEFLATED,
+	    wbits,
+	    8,
+	    Z_DEFAULT_STRATEGY
+	);
+	assert(i == Z_OK);
+	return (gz->zs);
+}
+
+z_stream *
+Gzip_GetDeflate(int level)
+{
+
+	return (gzip_get_deflate(level, 16 + MAX_WBITS));
+}
+
+/*
+ * For raw deflate streams we write the gzip framing ourselves, so that
+ * the deflate data can be produced in pieces, see segjob.c
+ */
+
+z_stream *
+Gzip_GetRawDeflate(int level)
+{
+
+	return (gzip_get_deflate(level, -MAX_WBITS));
+}
+
+z_stream *
+Gzip_GetInflate(int wbits)
+{
+	struct gzip_zs *gz;
+	int i;
+
+	gz = gzip_pool_get(0, 0, wbits);
+	if (gz != NULL) {
+		if (gz->wbits != wbits) {
+			AZ(inflateReset2(gz->zs, wbits));
+			gz->wbits = wbits;
+		}
+		return (gz->zs);
+	}
+	ALLOC_OBJ(gz, GZIP_ZS_MAGIC);
+	AN(gz);
+	gz->wbits = wbits;
+	i = inflateInit2(gz->zs, wbits);
+	assert(i == Z_OK);
+	return (gz->zs);
+}
+
+/* Return a stream to the pool, whatever state it is in */
+
+void
+Gzip_Put(z_stream **zsp)
+{
+	struct gzip_zs *gz;
+
+	AN(zsp);
+	gz = (void*)*zsp;
+	*zsp = NULL;
+	CHECK_OBJ_NOTNULL(gz, GZIP_ZS_MAGIC);
+
+	if (gz->deflate)
+		AZ(deflateReset(gz->zs));
+	else
+		AZ(inflateReset(gz->zs));
+	gz->zs->next_in = NULL;
+	gz->zs->avail_in = 0;
+	gz->zs->next_out = NULL;
+	gz->zs->avail_out = 0;
+
+	AZ(pthread_mutex_lock(&gzip_pool_mtx));
+	if (gzip_npool < GZIP_POOL_MAX) {
+		VTAILQ_INSERT_HEAD(&gzip_pool, gz, list);
+		gzip_npool++;
+		gz = NULL;
+	}
+	AZ(pthread_mutex_unlock(&gzip_pool_mtx));
+
+	if (gz != NULL) {
+		if (gz->deflate)
+			(void)deflateEnd(gz->zs);
+		else
+			(void)inflateEnd(gz->zs);
+		FREE_OBJ(gz);
+	}
+}
+
 /**********************************************************************/
 
 void
@@ -153,7 +317,7 @@ Gzip_Vsb(struct vsb **vsbp, int level)
 	struct vsb *output;
 	char buf[1024];
 	int i;
-	z_stream zs[1];
+	z_stream *zs;
 	char *p;
 
 	AN(vsbp);
@@ -161,16 +325,7 @@ Gzip_Vsb(struct vsb **vsbp, int level)
 	*vsbp = NULL;
 	AN(input);
 
-	memset(zs, 0, sizeof zs);
-	i = deflateInit2(
-	    zs,
-	    level,
-	    Z_DEFLATED,
-	    16 + 15,
-	    8,
-	    Z_DEFAULT_STRATEGY
-	);
-	assert(i == Z_OK);
+	zs = Gzip_GetDeflate(level);
 	Gzip_AddAa(zs);
 
 	zs->avail_in = VSB_len(input);
@@ -185,7 +340,7 @@ Gzip_Vsb(struct vsb **vsbp, int level)
 		VSB_bcat(output, buf, sizeof buf - zs->avail_out);
 	} while (i != Z_STREAM_END);
 	AZ(VSB_finish(output));
-	assert(deflateEnd(zs) == Z_OK);
+	Gzip_Put(&zs);
 	VSB_delete(input);
 	p = VSB_data(output);
 	assert(Gzip_GoodAa(p, VSB_len(output)));
@@ -193,23 +348,27 @@ Gzip_Vsb(struct vsb **vsbp, int level)
 	*vsbp = output;
 }
 
-/**********************************************************************/
+/* Same header as zlib makes with Gzip_AddAa() */
+size_t
+Gzip_AaHeader(void *ptr, size_t len)
+{
 
-void
-Gzip_InitDeflate(z_stream *zs)
+	AN(ptr);
+	assert(len >= sizeof gzip_head + 8);
+	memcpy(ptr, gzip_head, sizeof gzip_head);
+	memset((uint8_t *)ptr + sizeof gzip_head, 0, 8);
+	return (sizeof gzip_head + 8);
+}
+
+size_t
+Gzip_Trailer(void *ptr, size_t len, uint32_t crc, uint32_t isize)
 {
-	int i;
 
-	memset(zs, 0, sizeof *zs);
-	i = deflateInit2(
-	    zs,
-	    AA_COMPRESSION,
-	    Z_DEFLATED,
-	    16 + MAX_WBITS,
-	    8,
-	    Z_DEFAULT_STRATEGY
-	);
-	assert(i == Z_OK);
+	AN(ptr);
+	assert(len >= 8);
+	le32enc(ptr, crc);
+	le32enc((uint8_t *)ptr + 4, isize);
+	return (8);
 }
 
 /**********************************************************************
@@ -245,6 +404,42 @@ static const uint8_t gzip_stitch_head[] = {
 	0x03,			// OS
 };
 
+/*
+ * How many bytes of the 13 byte tail of a gzip member survive stitching:
+ * Either the last three bytes of a Z_FINISH block, or nothing if the
+ * member ended with an empty stored block.
+ */
+
+static ssize_t
+gzip_stitch_tail(const uint8_t *p)
+{
+
+	AN(p);
+	if (p[3] == 0x03 && p[4] == 0x00)
+		return (3);
+	if (p[0] == 0x01 && p[1] == 0x00 && p[2] == 0x00 &&
+	    p[3] == 0xff && p[4] == 0xff)
+		return (0);
+	WRONG("Z_FINISH stop bit not found");
+	NEEDLESS(return (-1));
+}
+
+/*
+ * Length of the output of gzip_stitch for a gzip member of gzlen bytes,
+ * ending in the 13 byte tail.  The gzip header and trailer added by
+ * gzip_stitch_new() and gzip_stitch_fini() is the gzlen == 0 case.
+ */
+
+int64_t
+gzip_stitch_len(int64_t gzlen, const uint8_t *tail)
+{
+
+	if (gzlen == 0)
+		return (sizeof gzip_stitch_head + 13);
+	assert(gzlen > 24 + 13);
+	return (gzlen - (24 + 13) + gzip_stitch_tail(tail));
+}
+
 struct gzip_stitch *
 gzip_stitch_new(byte_iter_f *func, void *priv)
 {
@@ -322,15 +517,11 @@ gzip_stitch_feed(void *priv, const void *ptr, ssize_t len)
 			if (gs->gzlen)
 				continue;
 			p = gs->tailbuf;
-			if (p[3] == 0x03 && p[4] == 0x00) {
-				gs->retval = gs->func(gs->priv, p, 3);
+			skip = gzip_stitch_tail(p);
+			if (skip > 0) {
+				gs->retval = gs->func(gs->priv, p, skip);
 				if (gs->retval)
 					return (gs->retval);
-			} else if (p[0] == 0x01 &&
-			     p[1] == 0x00 && p[2] == 0x00 &&
-			     p[3] == 0xff && p[4] == 0xff) {
-			} else {
-				WRONG("Z_FINISH stop bit not found");
 			}
 			crc = le32dec(p + 5);
 			bytes = le32dec(p + 9);
@@ -43,36 +43,192 @@
 
 #include "aardwarc.h"
 
+/*
+ * Headers are built and torn down by the million in audit and reindex,
+ * so all the strings of a header live in a few arena chunks, the first
+ * of which is allocated along with the header, and the fields are a
+ * flat array kept sorted by name.
+ */
+
+#define HEADER_ARENA		2048
+#define HEADER_NFLD		16
+
 struct hfield {
-	unsigned		magic;
-#define HFIELD_MAGIC		0x10b9767d
-	char			*name;
-	char			*val;
-	VTAILQ_ENTRY(hfield)	list;
+	const char		*name;
+	const char		*val;
+};
+
+struct hchunk {
+	struct hchunk		*next;
+	char			*buf;
+	size_t			len;
+	size_t			used;
 };
 
 struct header {
 	unsigned		magic;
 #define HEADER_MAGIC		0x5bf750ab
 	const struct aardwarc	*aa;
-	VTAILQ_HEAD(, hfield)	hfields;
 	char			*warc_record_id;
+	struct hfield		*fld;
+	unsigned		nfld;
+	unsigned		lfld;
+	struct hchunk		*chunks;
+	struct hfield		fld0[HEADER_NFLD];
 };
 
-struct header *
-Header_New(const struct aardwarc *aa)
+/* Field names we use all the time, sorted for strcmp(3) */
+static const char * const header_names[] = {
+	"Content-Length",
+	"Content-Type",
+	"WARC-Block-Digest",
+	"WARC-Concurrent-To",
+	"WARC-Date",
+	"WARC-Filename",
+	"WARC-IP-Address",
+	"WARC-Payload-Digest",
+	"WARC-Refers-To",
+	"WARC-Segment-Number",
+	"WARC-Segment-Origin-ID",
+	"WARC-Segment-Total-Length",
+	"WARC-Target-URI",
+	"WARC-Type",
+	"WARC-Warcinfo-ID",
+};
+
+static struct header *
+header_new(const struct aardwarc *aa, size_t arena)
 {
 	struct header *hdr;
+	struct hchunk *hc;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
-	ALLOC_OBJ(hdr, HEADER_MAGIC);
+	if (arena < HEADER_ARENA)
+		arena = HEADER_ARENA;
+	hdr = malloc(sizeof *hdr + sizeof *hc + arena);
 	AN(hdr);
-	VTAILQ_INIT(&hdr->hfields);
+	memset(hdr, 0, sizeof *hdr);
+	hdr->magic = HEADER_MAGIC;
 	hdr->aa = aa;
-	hdr->warc_record_id = calloc(1, hdr->aa->id_size + 1L);
-	AN(hdr->warc_record_id);
-	memset(hdr->warc_record_id, '_', hdr->aa->id_size);
-	hdr->warc_record_id[hdr->aa->id_size] = '\0';
+	hdr->fld = hdr->fld0;
+	hdr->lfld = HEADER_NFLD;
+	hc = (void*)(hdr + 1);
+	hc->next = NULL;
+	hc->buf = (char*)(hc + 1);
+	hc->len = arena;
+	hc->used = 0;
+	hdr->chunks = hc;
+	return (hdr);
+}
+
+static char *
+header_alloc(struct header *hd, size_t len)
+{
+	struct hchunk *hc;
+	size_t l;
+	char *p;
+
+	hc = hd->chunks;
+	if (hc->len - hc->used < len) {
+		l = len < HEADER_ARENA ? HEADER_ARENA : len;
+		hc = malloc(sizeof *hc + l);
+		AN(hc);
+		hc->buf = (char*)(hc + 1);
+		hc->len = l;
+		hc->used = 0;
+		hc->next = hd->chunks;
+		hd->chunks = hc;
+	}
+	p = hc->buf + hc->used;
+	hc->used += len;
+	return (p);
+}
+
+static const char *
+header_intern(struct header *hd, const char *name)
+{
+	unsigned lo = 0, hi = sizeof header_names / sizeof header_names[0];
+	unsigned mid;
+	size_t l;
+	char *p;
+	int i;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		i = strcmp(name, header_names[mid]);
+		if (i == 0)
+			return (header_names[mid]);
+		if (i < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	l = strlen(name) + 1;
+	p = header_alloc(hd, l);
+	memcpy(p, name, l);
+	return (p);
+}
+
+/* Where the field is or would go */
+
+static unsigned
+header_find(const struct header *hd, const char *name, int *found)
+{
+	unsigned lo = 0, hi = hd->nfld, mid;
+	int i;
+
+	*found = 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (name == hd->fld[mid].name)
+			i = 0;
+		else
+			i = strcasecmp(name, hd->fld[mid].name);
+		if (i == 0) {
+			*found = 1;
+			return (mid);
+		}
+		if (i < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (lo);
+}
+
+static void
+header_insert(struct header *hd, unsigned idx, const char *name,
+    const char *val)
+{
+
+	assert(idx <= hd->nfld);
+	if (hd->nfld == hd->lfld) {
+		hd->lfld *= 2;
+		if (hd->fld == hd->fld0) {
+			hd->fld = malloc(hd->lfld * sizeof *hd->fld);
+			AN(hd->fld);
+			memcpy(hd->fld, hd->fld0, sizeof hd->fld0);
+		} else {
+			hd->fld = realloc(hd->fld, hd->lfld * sizeof *hd->fld);
+			AN(hd->fld);
+		}
+	}
+	memmove(hd->fld + idx + 1, hd->fld + idx,
+	    (hd->nfld - idx) * sizeof *hd->fld);
+	hd->fld[idx].name = name;
+	hd->fld[idx].val = val;
+	hd->nfld++;
+}
+
+struct header *
+Header_New(const struct aardwarc *aa)
+{
+	struct header *hdr;
+
+	hdr = header_new(aa, 0);
+	hdr->warc_record_id = header_alloc(hdr, aa->id_size + 1L);
+	memset(hdr->warc_record_id, '_', aa->id_size);
+	hdr->warc_record_id[aa->id_size] = '\0';
 	return (hdr);
 }
 
@@ -80,23 +236,22 @@ void
 Header_Destroy(struct header **hdp)
 {
 	struct header *hdr;
-	struct hfield *hf;
+	struct hchunk *hc;
 
 	AN(hdp);
 	hdr = *hdp;
 	*hdp = NULL;
 	CHECK_OBJ_NOTNULL(hdr, HEADER_MAGIC);
 
-	REPLACE(hdr->warc_record_id, NULL);
 	while (1) {
-		hf = VTAILQ_FIRST(&hdr->hfields);
-		if (hf == NULL)
+		hc = hdr->chunks;
+		if (hc == (void*)(hdr + 1))
 			break;
-		REPLACE(hf->name, NULL);
-		REPLACE(hf->val, NULL);
-		VTAILQ_REMOVE(&hdr->hfields, hf, list);
-		FREE_OBJ(hf);
+		hdr->chunks = hc->next;
+		free(hc);
 	}
+	if (hdr->fld != hdr->fld0)
+		free(hdr->fld);
 	FREE_OBJ(hdr);
 }
 
@@ -104,22 +259,25 @@ struct header *
 Header_Clone(const struct header *hd)
 {
 	struct header *hdn;
-	struct hfield *hf, *hfn;
+	const struct hchunk *hc;
+	size_t l = 0;
+	unsigned u;
+	char *p;
 
-	hdn = Header_New(hd->aa);
-	AN(hdn);
+	CHECK_OBJ_NOTNULL(hd, HEADER_MAGIC);
+	for (hc = hd->chunks; hc != NULL; hc = hc->next)
+		l += hc->used;
+	hdn = header_new(hd->aa, l);
 	if (hd->warc_record_id != NULL) {
-		hdn->warc_record_id = strdup(hd->warc_record_id);
-		AN(hdn->warc_record_id);
+		l = strlen(hd->warc_record_id) + 1;
+		hdn->warc_record_id = header_alloc(hdn, l);
+		memcpy(hdn->warc_record_id, hd->warc_record_id, l);
 	}
-	VTAILQ_FOREACH(hf, &hd->hfields, list) {
-		ALLOC_OBJ(hfn, HFIELD_MAGIC);
-		AN(hfn);
-		hfn->name = strdup(hf->name);
-		AN(hfn->name);
-		hfn->val = strdup(hf->val);
-		AN(hfn->val);
-		VTAILQ_INSERT_TAIL(&hdn->hfields, hfn, list);
+	for (u = 0; u < hd->nfld; u++) {
+		l = strlen(hd->fld[u].val) + 1;
+		p = header_alloc(hdn, l);
+		memcpy(p, hd->fld[u].val, l);
+		header_insert(hdn, u, header_intern(hdn, hd->fld[u].name), p);
 	}
 	return (hdn);
 }
@@ -143,30 +301,28 @@ Header_Len(const char *name, const char *val, ...)
 void
 Header_Delete(struct header *hd, const char *name)
 {
-	struct hfield *hf, *hf2;
+	unsigned u;
+	int found;
 
 	CHECK_OBJ_NOTNULL(hd, HEADER_MAGIC);
 	AN(name);
 	assert(strchr(name, ':') == NULL);
 	AN(strcasecmp(name, "WARC-Record-ID"));
 
-	VTAILQ_FOREACH_SAFE(hf, &hd->hfields, list, hf2) {
-		CHECK_OBJ_NOTNULL(hf, HFIELD_MAGIC);
-		if (strcasecmp(name, hf->name))
-			continue;
-		VTAILQ_REMOVE(&hd->hfields, hf, list);
-		REPLACE(hf->name, NULL);
-		REPLACE(hf->val, NULL);
-		free(hf);
-	}
+	u = header_find(hd, name, &found);
+	if (!found)
+		return;
+	hd->nfld--;
+	memmove(hd->fld + u, hd->fld + u + 1, (hd->nfld - u) * sizeof *hd->fld);
 }
 
 void
 Header_Set(struct header *hd, const char *name, const char *val, ...)
 {
-	struct hfield *hf, *hf2;
-	int i;
+	unsigned u;
+	int found, l;
 	va_list ap;
+	char *p;
 
 	CHECK_OBJ_NOTNULL(hd, HEADER_MAGIC);
 	AN(name);
@@ -174,46 +330,35 @@ Header_Set(struct header *hd, const char *name, const char *val, ...)
 	AN(strcasecmp(name, "WARC-Record-ID"));
 	AN(val);
 
-	VTAILQ_FOREACH(hf, &hd->hfields, list)
-		if (!strcasecmp(name, hf->name))
-			break;
-	if (hf == NULL) {
-		ALLOC_OBJ(hf, HFIELD_MAGIC);
-		AN(hf);
-		hf->name = strdup(name);
-		AN(hf->name);
-	} else {
-		VTAILQ_REMOVE(&hd->hfields, hf, list);
-		REPLACE(hf->val, NULL);
-	}
 	va_start(ap, val);
-	(void)vasprintf(&hf->val, val, ap);
+	l = vsnprintf(NULL, 0, val, ap);
 	va_end(ap);
-	AN(hf->val);
-	VTAILQ_FOREACH(hf2, &hd->hfields, list) {
-		CHECK_OBJ_NOTNULL(hf2, HFIELD_MAGIC);
-		i = strcasecmp(name, hf2->name);
-		if (i < 0) {
-			VTAILQ_INSERT_BEFORE(hf2, hf, list);
-			return;
-		}
-		if (i == 0)
-			WRONG("Multiple headers with same name");
-	}
-	VTAILQ_INSERT_TAIL(&hd->hfields, hf, list);
+	assert(l >= 0);
+	p = header_alloc(hd, l + 1L);
+	va_start(ap, val);
+	assert(vsnprintf(p, l + 1L, val, ap) == l);
+	va_end(ap);
+
+	/* A replaced value stays in the arena until the header goes */
+	u = header_find(hd, name, &found);
+	if (found)
+		hd->fld[u].val = p;
+	else
+		header_insert(hd, u, header_intern(hd, name), p);
 }
 
 const char *
 Header_Get(const struct header *hd, const char *name)
 {
-	struct hfield *hf;
+	unsigned u;
+	int found;
 
 	CHECK_OBJ_NOTNULL(hd, HEADER_MAGIC);
 	AN(name);
-	VTAILQ_FOREACH(hf, &hd->hfields, list)
-		if (!strcasecmp(name, hf->name))
-			return (hf->val);
-	return (NULL);
+	u = header_find(hd, name, &found);
+	if (!found)
+		return (NULL);
+	return (hd->fld[u].val);
 }
 
 intmax_t
@@ -240,7 +385,8 @@ struct vsb *
 Header_Serialize(const struct header *hdr, int level)
 {
 	struct vsb *vsb;
-	struct hfield *hf;
+	const struct hfield *hf;
+	unsigned u;
 
 	CHECK_OBJ_NOTNULL(hdr, HEADER_MAGIC);
 	AN(hdr->warc_record_id);
@@ -255,8 +401,8 @@ Header_Serialize(const struct header *hdr, int level)
 	VSB_cat(vsb, hdr->warc_record_id);
 	VSB_cat(vsb, ">\r\n");
 
-	VTAILQ_FOREACH(hf, &hdr->hfields, list) {
-		CHECK_OBJ_NOTNULL(hf, HFIELD_MAGIC);
+	for (u = 0; u < hdr->nfld; u++) {
+		hf = &hdr->fld[u];
 		AN(hf->name);
 		AN(hf->val);
 		VSB_cat(vsb, hf->name);
@@ -292,8 +438,9 @@ Header_Set_Id(struct header *hdr, const char *id)
 	CHECK_OBJ_NOTNULL(hdr, HEADER_MAGIC);
 	for (i = 0; id[i] != '\0'; i++)
 		assert(isgraph(id[i]));
-	REPLACE(hdr->warc_record_id, id);
 	assert(i >= hdr->aa->id_size);
+	hdr->warc_record_id = header_alloc(hdr, hdr->aa->id_size + 1L);
+	memcpy(hdr->warc_record_id, id, hdr->aa->id_size);
 	hdr->warc_record_id[hdr->aa->id_size] = '\0';
 }
 
@@ -329,28 +476,32 @@ Header_Set_Ref(struct header *hdr, const char *name, const char *ref)
 /* Parse one of our own WARC headers ----------------------------------
  *
  * NB: This is *not* a general purpose WARC header parser.
+ *
+ * The text is copied into the arena once, the callers buffers do not
+ * live as long as the header, and the fields point into that copy.
  */
 
-// Flexelint bug:
-//lint -efunc(818, Header_Parse)
-
 struct header *
-Header_Parse(const struct aardwarc *aa, char *p)
+Header_Parse(const struct aardwarc *aa, const char *txt)
 {
 	const char *q10 = "WARC/1.0\r\nWARC-Record-ID: <";
 	const char *q11 = "WARC/1.1\r\nWARC-Record-ID: <";
-	char *q, *r, *s;
+	char *p, *q, *r, *s;
 	struct header *hdr;
+	unsigned u;
+	size_t l;
+	int found;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
-	AN(p);
+	AN(txt);
 
-	ALLOC_OBJ(hdr, HEADER_MAGIC);
-	AN(hdr);
-	VTAILQ_INIT(&hdr->hfields);
-	hdr->aa = aa;
+	assert(!memcmp(txt, q10, strlen(q10)) ||
+	    !memcmp(txt, q11, strlen(q11)));
+	l = strlen(txt) + 1;
+	hdr = header_new(aa, l);
+	p = header_alloc(hdr, l);
+	memcpy(p, txt, l);
 
-	assert(!memcmp(p, q10, strlen(q10)) || !memcmp(p, q11, strlen(q11)));
 	p = strchr(p, '\n');
 	AN(p);
 	for (p++; *p != '\0'; p = q) {
@@ -369,7 +520,12 @@ Header_Parse(const struct aardwarc *aa, char *p)
 		assert(*r == ' ');
 		*r++ = '\0';
 		if (strcmp(p, "WARC-Record-ID")) {
-			Header_Set(hdr, p, "%s", r);
+			/* Our own headers come sorted, but do not insist */
+			u = header_find(hdr, p, &found);
+			if (found)
+				hdr->fld[u].val = r;
+			else
+				header_insert(hdr, u, header_intern(hdr, p), r);
 			continue;
 		}
 		assert(*r == '<');
@@ -380,9 +536,10 @@ Header_Parse(const struct aardwarc *aa, char *p)
 		s[0] = '\0';
 		s = strrchr(r, '/');
 		AN(s);
-		REPLACE(hdr->warc_record_id, s + 1);
-		s[1] = '\0';
-		assert(!strcmp(r, aa->prefix));
+		hdr->warc_record_id = s + 1;
+		l = (size_t)(s + 1 - r);
+		assert(strlen(aa->prefix) == l);
+		AZ(memcmp(r, aa->prefix, l));
 	}
 	return (hdr);
 }
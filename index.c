@@ -150,8 +150,6 @@
 #define SUFF_APPENDIX	"appendix"
 #define SUFF_HOUSEKEEP	"housekeep"
 
-#define KEYSUMM		12
-
 const char *
 IDX_Valid_Id(const struct aardwarc *aa, const char *id, const char **nid)
 {
@@ -190,62 +188,168 @@ idx_filename(const struct aardwarc *aa, const char *suff)
 	return (vsb);
 }
 
-static uint8_t
-idx_hex_digit(const char key)
+/**********************************************************************
+ * Hex conversion of WARC-ids, eight digits at a time in a 64 bit word.
+ *
+ * With 10^9 records in the index, formatting and parsing hex is where
+ * dumpindex and filter would otherwise spend their time.
+ */
+
+#define HEX_ONES	0x0101010101010101ULL
+#define HEX_HIGH	0x8080808080808080ULL
+
+/* High bit set in the bytes of x (all < 0x80) which are in [lo...hi] */
+static uint64_t
+hex_range(uint64_t x, unsigned lo, unsigned hi)
 {
-	if (key >= '0' && key <= '9')
-		return (key - '0');
-	if (key >= 'a' && key <= 'f')
-		return (10 + key - 'a');
-	if (key >= 'A' && key <= 'F')
-		return (10 + key - 'A');
-	WRONG("Non-hexadecimal in record id");
+
+	return ((x + (0x80 - lo) * HEX_ONES) &
+	    ~(x + (0x7f - hi) * HEX_ONES) & HEX_HIGH);
 }
 
-static void
-idx_key_bin(uint8_t *dst, const char *key, int keylen)
+void
+IDX_Hex(char *dst, const uint8_t *src, size_t len)
 {
-	int i;
-	uint8_t j;
+	static const char hexdig[] = "0123456789abcdef";
+	uint64_t v;
+
+	AN(dst);
+	AN(src);
+	for (; len >= 4; len -= 4, src += 4, dst += 8) {
+		v = be32dec(src);
+		/* Spread the eight nibbles into eight bytes */
+		v = ((v & 0xffff0000ULL) << 16) | (v & 0xffffULL);
+		v = ((v & 0x0000ff000000ff00ULL) << 8) |
+		    (v & 0x000000ff000000ffULL);
+		v = ((v & 0x00f000f000f000f0ULL) << 4) |
+		    (v & 0x000f000f000f000fULL);
+		/* Bytes above nine skip ahead to 'a' */
+		v += '0' * HEX_ONES +
+		    (((v + 6 * HEX_ONES) >> 4) & HEX_ONES) * ('a' - '0' - 10);
+		be64enc(dst, v);
+	}
+	for (; len > 0; len--, src++) {
+		*dst++ = hexdig[*src >> 4];
+		*dst++ = hexdig[*src & 0xf];
+	}
+	*dst = '\0';
+}
+
+static int
+hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (10 + c - 'a');
+	if (c >= 'A' && c <= 'F')
+		return (10 + c - 'A');
+	return (-1);
+}
 
-	for (i = 0; i < keylen; i++, dst++) {
-		*dst = 0;
-		if (*key != '\0') {
-			j = idx_hex_digit(*key++);
+/*
+ * Fill len bytes from the hex digits in src, zero padding if src is
+ * shorter.  Returns the number of digits used, -1 on non-hex.
+ */
+
+ssize_t
+IDX_Unhex(uint8_t *dst, size_t len, const char *src)
+{
+	size_t n, i = 0;
+	uint64_t v;
+	int j;
+
+	AN(dst);
+	AN(src);
+	n = strnlen(src, len * 2);
+	memset(dst, 0, len);
+	for (; i + 8 <= n; i += 8, dst += 4) {
+		v = be64dec(src + i);
+		if ((v & HEX_HIGH) || (hex_range(v, '0', '9') |
+		    hex_range(v | 0x20 * HEX_ONES, 'a', 'f')) != HEX_HIGH)
+			break;
+		v = (v & 0x0f0f0f0f0f0f0f0fULL) + ((v >> 6) & HEX_ONES) * 9;
+		/* Gather the eight nibbles into four bytes */
+		v = (v | (v >> 4)) & 0x00ff00ff00ff00ffULL;
+		v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+		v = (v | (v >> 16)) & 0xffffffffULL;
+		be32enc(dst, (uint32_t)v);
+	}
+	for (; i < n; i++) {
+		j = hex_digit(src[i]);
+		if (j < 0)
+			return (-1);
+		if (i & 1)
+			*dst++ |= (uint8_t)j;
+		else
 			*dst |= (uint8_t)(j << 4);
-		}
-		if (*key != '\0') {
-			j = idx_hex_digit(*key++);
-			*dst |= j;
-		}
 	}
+	return ((ssize_t)n);
 }
 
 void
-IDX_Insert(const struct aardwarc *aa, const char *key, uint32_t flags,
-uint32_t silo, uint64_t offset, const char *cont)
+IDX_Record(const struct aardwarc *aa, uint8_t *rec, const char *key,
+    uint32_t flags, uint32_t silo, uint64_t offset, const char *cont)
 {
-	uint8_t rec[32];
-	int fd, i;
-	struct vsb *vsb;
 
 	assert(aa->id_size >= 16);
 
-	memset(rec, 0, sizeof rec);
-	idx_key_bin(rec, key, KEYSUMM);
+	memset(rec, 0, IDX_RECSIZE);
+	assert(IDX_Unhex(rec, IDX_KEYLEN, key) >= 0);
 	be32enc(rec + 12, flags);
 	be32enc(rec + 16, silo);
 	be64enc(rec + 20, offset);
 	if (cont != NULL)
-		idx_key_bin(rec + 28, cont, 4);
+		assert(IDX_Unhex(rec + 28, 4, cont) >= 0);
+}
 
+/*
+ * Append a number of records to the appendix in a single write(2),
+ * so that a batch of objects costs no more than a single one.
+ *
+ * Housekeeping removes the appendix when it merges it, so when syncing
+ * we must also sync the directory if we (re)create it.
+ */
+
+void
+IDX_Append(const struct aardwarc *aa, const uint8_t *recs, size_t nrec,
+    int sync)
+{
+	int fd, new = 0;
+	ssize_t i;
+	struct vsb *vsb;
+
+	AN(recs);
+	assert(nrec > 0);
 	vsb = idx_filename(aa, "appendix");
-	fd = open(VSB_data(vsb), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	fd = open(VSB_data(vsb), O_WRONLY | O_APPEND);
+	if (fd < 0 && errno == ENOENT) {
+		fd = open(VSB_data(vsb), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		new = 1;
+	}
 	assert(fd >= 0);
-	i = write(fd, rec, sizeof rec);
-	assert(i == (int)sizeof rec);
+	i = write(fd, recs, nrec * IDX_RECSIZE);
+	assert(i == (ssize_t)(nrec * IDX_RECSIZE));
+	if (sync)
+		AZ(fdatasync(fd));
 	assert(close(fd) == 0);
 	VSB_delete(vsb);
+	if (sync && new) {
+		fd = open(aa->silo_dirname, O_RDONLY);
+		assert(fd >= 0);
+		AZ(fsync(fd));
+		AZ(close(fd));
+	}
+}
+
+void
+IDX_Insert(const struct aardwarc *aa, const char *key, uint32_t flags,
+uint32_t silo, uint64_t offset, const char *cont)
+{
+	uint8_t rec[IDX_RECSIZE];
+
+	IDX_Record(aa, rec, key, flags, silo, offset, cont);
+	IDX_Append(aa, rec, 1, 0);
 }
 
 /**********************************************************************/
@@ -400,71 +504,90 @@ static const struct idxfiles {
 	{ NULL, 0}
 };
 
+struct idx_iter {
+	struct idx_key	key_p;
+	unsigned	cl;
+	int		sorted;
+	int		past;
+	idx_iter_bin_f	*func;
+	void		*priv;
+};
+
+/* Sets ->past when past the key in a sorted file */
+
+static int v_matchproto_(commit_rec_f)
+idx_iter_rec(void *priv, const uint8_t *rec)
+{
+	struct idx_iter *ii;
+	int64_t off;
+	int j;
+
+	ii = priv;
+	if (ii->cl >= 2) {
+		j = memcmp(rec, ii->key_p.b, ii->cl / 2);
+		if (ii->sorted && j > 0) {
+			ii->past = 1;
+			return (0);
+		}
+		if (j)
+			return (0);
+	}
+	if ((ii->cl & 1) && ((rec[ii->cl / 2] ^ ii->key_p.b[ii->cl / 2]) & 0xf0))
+		return (0);
+
+	off = (int64_t)be64dec(rec + 20);
+	assert(off >= 0);
+	return (ii->func(ii->priv, (const void*)rec, be32dec(rec + 12),
+	    be32dec(rec + 16), off, be32dec(rec + 28)));
+}
+
+/* Match the first 'nibbles' hex digits of key_part */
+
 int
-IDX_Iter(const struct aardwarc *aa, const char *key_part,
-    idx_iter_f *func, void *priv)
+IDX_IterBin(const struct aardwarc *aa, const struct idx_key *key_part,
+    unsigned nibbles, idx_iter_bin_f *func, void *priv)
 {
 	FILE *f;
 	const struct idxfiles *idf;
-	uint8_t key_p[KEYSUMM];
+	struct idx_iter ii[1];
 	uint8_t rec[32];
-	int64_t off;
-	char key[25];
-	char cont[9];
-	int i, j;
+	int i;
 	struct vsb *vsb;
-	int cl;
 
 	AN(func);
 
+	memset(ii, 0, sizeof ii);
+	ii->func = func;
+	ii->priv = priv;
 	if (key_part != NULL) {
-		assert(strspn(key_part, "0123456789abcdefABCDEF") ==
-		   strlen(key_part));
-		idx_key_bin(key_p, key_part, sizeof key_p);
-		cl = strlen(key_part);
-		if (cl > KEYSUMM * 2)
-			cl = KEYSUMM * 2;
-	} else {
-		memset(key_p, 0, sizeof key_p);
-		cl = 0;
+		ii->key_p = *key_part;
+		ii->cl = nibbles;
+		if (ii->cl > IDX_KEYLEN * 2)
+			ii->cl = IDX_KEYLEN * 2;
 	}
 
-	i = -1;
+	/* Not committed yet, before the files, see Commit_Iter() */
+	i = Commit_Iter(aa, idx_iter_rec, ii);
+	if (i != 0)
+		return (i);
+
 	for (idf = idxfiles; idf->suff != NULL; idf++) {
 		vsb = idx_filename(aa, idf->suff);
 		f = fopen(VSB_data(vsb), "r");
+		VSB_delete(vsb);
 		if (f == NULL)
 			continue;
-		VSB_delete(vsb);
 		if (idf->sorted)
-			bucket_seek(key_p, f);
+			bucket_seek(ii->key_p.b, f);
+		ii->sorted = idf->sorted;
+		ii->past = 0;
 		do {
 			i = fread(rec, 1, sizeof rec, f);
 			if (i == 0)
 				break;
 			assert(i == (int)sizeof rec);
-			i = 0;
-
-			if (cl >= 2) {
-				j = memcmp(rec, key_p, cl / 2);
-				if (idf->sorted && j > 0)
-					break;
-				if (j)
-					continue;
-			}
-
-			bprintf(key, "%016jx%08x",
-			    be64dec(rec), be32dec(rec + 8));
-			if (key_part != NULL && strncasecmp(key, key_part, cl))
-				continue;
-
-			bprintf(cont, "%08x", be32dec(rec + 28));
-
-			off = (int64_t)be64dec(rec + 20);
-			assert(off >= 0);
-			i = func(priv, key, be32dec(rec + 12),
-			    be32dec(rec + 16), off, cont);
-		} while (i == 0);
+			i = idx_iter_rec(ii, rec);
+		} while (i == 0 && !ii->past);
 		AZ(fclose(f));
 		if (i)
 			break;
@@ -472,6 +595,49 @@ IDX_Iter(const struct aardwarc *aa, const char *key_part,
 	return (i);
 }
 
+/* The same, with the keys in hex ------------------------------------*/
+
+struct idx_iter_hex {
+	idx_iter_f	*func;
+	void		*priv;
+};
+
+static int v_matchproto_(idx_iter_bin_f)
+idx_iter_hex(void *priv, const struct idx_key *key,
+    uint32_t flag, uint32_t silo, int64_t offset, uint32_t cont)
+{
+	const struct idx_iter_hex *ih;
+	char hkey[IDX_KEYLEN * 2 + 1];
+	char hcont[9];
+	uint8_t c[4];
+
+	ih = priv;
+	IDX_Hex(hkey, key->b, sizeof key->b);
+	be32enc(c, cont);
+	IDX_Hex(hcont, c, sizeof c);
+	return (ih->func(ih->priv, hkey, flag, silo, offset, hcont));
+}
+
+int
+IDX_Iter(const struct aardwarc *aa, const char *key_part,
+    idx_iter_f *func, void *priv)
+{
+	struct idx_iter_hex ih[1];
+	struct idx_key key;
+	ssize_t l;
+
+	AN(func);
+	ih->func = func;
+	ih->priv = priv;
+	if (key_part == NULL)
+		return (IDX_IterBin(aa, NULL, 0, idx_iter_hex, ih));
+	assert(strspn(key_part, "0123456789abcdefABCDEF") ==
+	   strlen(key_part));
+	l = IDX_Unhex(key.b, sizeof key.b, key_part);
+	assert(l >= 0);
+	return (IDX_IterBin(aa, &key, strlen(key_part), idx_iter_hex, ih));
+}
+
 static void
 idx_merge(const struct aardwarc *aa, const uint8_t *ptr, ssize_t len)
 {
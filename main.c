@@ -56,12 +56,16 @@ static const struct mains {
 	MAIN(filter,		0, "Filter list of IDs"),
 	MAIN(get,		0, "Get record"),
 	MAIN(housekeeping,	0, "Do housekeeping"),
+	MAIN(httpd,		0, "HTTP service"),
 	MAIN(info,		1, "Information about the archive"),
+	{ "ingest-tar", main_ingest_tar, 0, "Store members of tar/cpio stream"},
+	{ "import-warc", main_import_warc, 0, "Import foreign WARC files"},
 	MAIN(mksilo,		0, "Build a new silo"),
 	MAIN(rebuild,		0, "Rebuild silos"),
 	MAIN(reindex,		0, "Rebuild index"),
 	MAIN(stevedore,		0, "Act as server"),
 	MAIN(store,		0, "Store data"),
+	MAIN(stored,		0, "Store daemon"),
 	MAIN(stow,		0, "Stow data to remote server"),
 	MAIN(_testbytes,	0, "Bytes for tests"),
 	{ NULL,	NULL, 0, NULL}
@@ -88,6 +92,8 @@ int
 call_main(const char *a0, struct aardwarc *aa, int argc, char **argv)
 {
 	const struct mains *mp;
+	int i;
+
 	for(mp = mains; mp->name != NULL; mp++)
 		if (!strcmp(mp->name, argv[0]))
 			break;
@@ -99,7 +105,9 @@ call_main(const char *a0, struct aardwarc *aa, int argc, char **argv)
 		usage(a0, "This subcommand does not do JSON.");
 		return (2);
 	}
-	return (mp->func(a0, aa, argc, argv));
+	i = mp->func(a0, aa, argc, argv);
+	Commit_Flush(aa);
+	return (i);
 }
 
 int
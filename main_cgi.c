@@ -54,8 +54,9 @@ static int v_matchproto_(byte_iter_f)
 get_iter(void *priv, const void *ptr, ssize_t len)
 {
 
-	(void)priv;
 	assert(len == (ssize_t)fwrite(ptr, 1, len, stdout));
+	if (priv != NULL)
+		(void)ObjCache_Fill(priv, ptr, len);
 	return (0);
 }
 
@@ -65,7 +66,8 @@ main_cgi(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	int ch;
 	const char *a00 = *argv;
 	struct vsb *vsb;
-	struct getjob *gj;
+	struct getjob *gj = NULL;
+	struct objcache *oc = NULL, *fill = NULL;
 	const struct header *hdr;
 	const char *p;
 	const char *id;
@@ -118,34 +120,40 @@ main_cgi(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	if (*id == '/')
 		id++;
 
-	vsb = VSB_new_auto();
-	AN(vsb);
-
-	gj = GetJob_New(aa, id, vsb);
-	if (gj == NULL) {
-		AZ(VSB_finish(vsb));
-		printf("Content-Type: text/html\n");
-		printf("Status: 501 Error\n");
-		printf("\n");
-		printf("<html>");
-		printf("<pre>");
-		printf("%s\n", VSB_data(vsb));
-		printf("</pre>");
-		printf("</html>");
-		exit (0);
+	if (!gzip)
+		oc = ObjCache_Lookup(aa, id);
+
+	if (oc != NULL) {
+		hdr = ObjCache_Header(oc);
+		o = ObjCache_Length(oc);
+	} else {
+		vsb = VSB_new_auto();
+		AN(vsb);
+
+		gj = GetJob_New(aa, id, vsb);
+		if (gj == NULL) {
+			AZ(VSB_finish(vsb));
+			printf("Content-Type: text/html\n");
+			printf("Status: 501 Error\n");
+			printf("\n");
+			printf("<html>");
+			printf("<pre>");
+			printf("%s\n", VSB_data(vsb));
+			printf("</pre>");
+			printf("</html>");
+			exit (0);
+		}
+		VSB_delete(vsb);
+
+		hdr = GetJob_Header(gj, 1);
+		o = GetJob_TotalLength(gj, gzip);
+		if (!gzip) {
+			vsb = GetJob_Headers(gj);
+			AZ(VSB_finish(vsb));
+			fill = ObjCache_Create(aa, id, VSB_data(vsb), o);
+			VSB_delete(vsb);
+		}
 	}
-	VSB_delete(vsb);
-
-	/*
-	 * We cannot do the gzip trick for segmented objects (exactly
-	 * the ones that need it most) because firefox and curl do not
-	 * properly handle concatenated gzip files.
-	 * XXX: we could stich them, doing the CRC editing dance...
-	 */
-	if (GetJob_IsSegmented(gj))
-		gzip = 0;
-
-	hdr = GetJob_Header(gj, 1);
 	AN(hdr);
 
 	ct = Header_Get(hdr, "Content-Type");
@@ -156,13 +164,18 @@ main_cgi(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	if (gzip)
 		printf("Content-Encoding: gzip\n");
 
-	o = GetJob_TotalLength(gj, gzip);
 	printf("Content-Length: %jd\n", (intmax_t)o);
 	printf("Status: 200\n");
 	printf("\n");
 
-	GetJob_Iter(gj, get_iter, NULL, gzip);
-
-	GetJob_Delete(&gj);
+	if (oc != NULL) {
+		ObjCache_Iter(oc, get_iter, NULL);
+		ObjCache_Close(&oc);
+	} else {
+		GetJob_Iter(gj, get_iter, fill, gzip);
+		if (fill != NULL)
+			ObjCache_Commit(&fill);
+		GetJob_Delete(&gj);
+	}
 	return (0);
 }
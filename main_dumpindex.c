@@ -50,16 +50,19 @@ usage_dumpindex(const char *a0, const char *a00, const char *err)
 	fprintf(stderr, "\t\t -t {metadata|resource|warcinfo}\n");
 }
 
-static int v_matchproto_(idx_iter_f)
-dumpindex_iter(void *priv, const char *key,
-    uint32_t flag, uint32_t silo, int64_t offset, const char *cont)
+static int v_matchproto_(idx_iter_bin_f)
+dumpindex_iter(void *priv, const struct idx_key *key,
+    uint32_t flag, uint32_t silo, int64_t offset, uint32_t cont)
 {
 	uint32_t *u;
+	char hkey[IDX_KEYLEN * 2 + 1];
 
 	u = priv;
 	if (*u != 0 && flag != *u)
 		return (0);
-	printf("%s 0x%08x %8u %12jd %s\n", key, flag, silo, offset, cont);
+	IDX_Hex(hkey, key->b, sizeof key->b);
+	printf("%s 0x%08x %8u %12jd %08x\n",
+	    hkey, flag, silo, (intmax_t)offset, cont);
 	return(0);
 }
 
@@ -69,6 +72,7 @@ main_dumpindex(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	int ch;
 	const char *a00 = *argv;
 	uint32_t u = 0;
+	struct idx_key key;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
@@ -99,9 +103,14 @@ main_dumpindex(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	argv += optind;
 
 	if (argc == 0)
-		(void)IDX_Iter(aa, NULL, dumpindex_iter, &u);
-	else
-		for (;argc > 0; argc--, argv++)
-			(void)IDX_Iter(aa, *argv, dumpindex_iter, &u);
+		(void)IDX_IterBin(aa, NULL, 0, dumpindex_iter, &u);
+	for (;argc > 0; argc--, argv++) {
+		if (strspn(*argv, "0123456789abcdefABCDEF") != strlen(*argv)) {
+			fprintf(stderr, "Non-hex id-part: \"%s\"\n", *argv);
+			exit(1);
+		}
+		assert(IDX_Unhex(key.b, sizeof key.b, *argv) >= 0);
+		(void)IDX_IterBin(aa, &key, strlen(*argv), dumpindex_iter, &u);
+	}
 	return (0);
 }
@@ -28,11 +28,16 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "vdef.h"
 
 #include "vas.h"
@@ -40,32 +45,64 @@
 
 #include "aardwarc.h"
 
-struct cand {
-	unsigned		magic;
-#define CAND_MAGIC		0x882a5fd4
-	int			found;
-	char			*id;
-	char			*line;
-	VTAILQ_ENTRY(cand)	list;
-	VTAILQ_ENTRY(cand)	sortlist;
-};
+/*
+ * Candidate lists
+ * ---------------
+ *
+ * The lists we filter can have hundreds of millions of lines, so the
+ * input files are mapped and each candidate is a 24 byte record:
+ *
+ *	12 bytes	binary key, as in the index
+ *	 6 bytes	offset of the line in the input
+ *	 6 bytes	ordinal number of the line
+ *
+ * The records are radix sorted in a buffer of -b bytes, half of it
+ * for the sort.  If the buffer fills up, it is sorted and spilled to
+ * a temporary file as a run, and the runs are mapped back in when the
+ * index is walked.  Found candidates are marked in a bitmap by ordinal
+ * number and the output is produced by reading the inputs again.
+ */
 
-VTAILQ_HEAD(candhead,cand);
+#define CAND_SIZE		24
 
-static struct candhead		candidates =
-    VTAILQ_HEAD_INITIALIZER(candidates);
-static struct candhead		sorted =
-    VTAILQ_HEAD_INITIALIZER(sorted);
-static int			ncand;
-static struct cand		*next_cand;
+struct finput {
+	const char		*ptr;
+	size_t			len;
+	uint64_t		base;
+};
 
-static int			s_flag;
+struct run {
+	const uint8_t		*ptr;
+	uint64_t		n;
+	uint64_t		i;
+	size_t			maplen;
+};
 
 struct filt {
 	unsigned		magic;
 #define FILT_MAGIC		0xc4b794e6
 	struct aardwarc		*aa;
-	char			last[65];
+	int			s_flag;
+
+	struct finput		*inputs;
+	unsigned		ninput;
+	uint64_t		inlen;
+
+	uint8_t			*ent;
+	uint8_t			*tmp;
+	size_t			nent;
+	size_t			lent;
+	uint64_t		ncand;
+
+	struct run		*runs;
+	unsigned		nrun;
+	struct run		**heap;
+	unsigned		nheap;
+
+	uint8_t			*found;
+	uint64_t		nfound;
+	int			started;
+	struct idx_key		last;
 };
 
 static
@@ -78,11 +115,279 @@ usage_filter(const char *a0, const char *a00, const char *err)
 	    "\t%s [global options] %s [options] [id-list-file]...\n",
 	    a0, a00);
 	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-b size Memory for sorting (index.sort_size)\n");
 	fprintf(stderr, "\t-s Check the silo headers\n");
 	fprintf(stderr, "\t-r Report found (rather than missing) objects\n");
 	fprintf(stderr, "\t-v Report precense status on each line of output\n");
 }
 
+static void
+cand_enc48(uint8_t *p, uint64_t u)
+{
+
+	AZ(u >> 48);
+	be16enc(p, (uint16_t)(u >> 32));
+	be32enc(p + 2, (uint32_t)u);
+}
+
+static uint64_t
+cand_dec48(const uint8_t *p)
+{
+
+	return (((uint64_t)be16dec(p) << 32) | be32dec(p + 2));
+}
+
+/* Input files --------------------------------------------------------*/
+
+static void
+filter_map(struct filt *fp, int fd, const char *fn)
+{
+	struct finput *fi;
+	struct stat st;
+	FILE *spool = NULL;
+	char buf[BUFSIZ * 8];
+	ssize_t sz;
+	void *p;
+
+	AZ(fstat(fd, &st));
+	if (!S_ISREG(st.st_mode)) {
+		/* Pipes cannot be mapped, so spool them first */
+		spool = tmpfile();
+		AN(spool);
+		while ((sz = read(fd, buf, sizeof buf)) > 0)
+			assert(fwrite(buf, sz, 1, spool) == 1);
+		if (sz < 0) {
+			fprintf(stderr, "Read error on %s: %s\n",
+			    fn, strerror(errno));
+			exit(1);
+		}
+		AZ(fflush(spool));
+		fd = fileno(spool);
+		AZ(fstat(fd, &st));
+	}
+
+	fp->inputs = realloc(fp->inputs,
+	    (fp->ninput + 1L) * sizeof *fp->inputs);
+	AN(fp->inputs);
+	fi = &fp->inputs[fp->ninput++];
+	memset(fi, 0, sizeof *fi);
+	fi->base = fp->inlen;
+	fi->len = (size_t)st.st_size;
+	fp->inlen += fi->len;
+	if (fi->len > 0) {
+		p = mmap(NULL, fi->len, PROT_READ, MAP_PRIVATE | MAP_NOCORE,
+		    fd, 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "Cannot map %s: %s\n",
+			    fn, strerror(errno));
+			exit(1);
+		}
+		(void)posix_madvise(p, fi->len, POSIX_MADV_SEQUENTIAL);
+		fi->ptr = p;
+	}
+	if (spool != NULL)
+		AZ(fclose(spool));
+}
+
+/*
+ * Step to the next non-empty line, complaining about it if 'check'.
+ * Returns the ID part of the line.
+ */
+
+static const char *
+filter_line(const struct filt *fp, const struct finput *fi, size_t *pos,
+    const char **line, size_t *len, int check)
+{
+	const char *p, *q, *e;
+	size_t l, pl, u;
+
+	e = fi->ptr + fi->len;
+	while (*pos < fi->len) {
+		p = fi->ptr + *pos;
+		q = memchr(p, '\n', e - p);
+		l = q == NULL ? (size_t)(e - p) : (size_t)(q - p);
+		if (check && (q == NULL || l >= BUFSIZ - 1)) {
+			fprintf(stderr, "Over long line \"%.*s...\"\n",
+			    (int)(l < 40 ? l : 40), p);
+			exit(1);
+		}
+		*pos += l + 1;
+		if (l == 0)
+			continue;
+		*line = p;
+		*len = l;
+		pl = strlen(fp->aa->prefix);
+		if (l >= pl && !strncasecmp(p, fp->aa->prefix, pl)) {
+			p += pl;
+			l -= pl;
+		}
+		if (check && l < fp->aa->id_size) {
+			fprintf(stderr, "ID too short: \"%.*s\"\n",
+			    (int)*len, *line);
+			exit(1);
+		}
+		for (u = 0; check && u < fp->aa->id_size; u++) {
+			if (strchr("0123456789abcdefABCDEF", p[u]) != NULL &&
+			    p[u] != '\0')
+				continue;
+			fprintf(stderr, "Non-hex characters in id: \"%.*s\"\n",
+			    (int)*len, *line);
+			exit(1);
+		}
+		return (p);
+	}
+	return (NULL);
+}
+
+/* Sorting and spilling -----------------------------------------------*/
+
+static void
+filter_radix(uint8_t *ent, uint8_t *tmp, size_t n)
+{
+	size_t cnt[256], i, sum, c;
+	uint8_t *src = ent, *dst = tmp, *t;
+	int b;
+
+	for (b = IDX_KEYLEN - 1; b >= 0; b--) {
+		memset(cnt, 0, sizeof cnt);
+		for (i = 0; i < n; i++)
+			cnt[src[i * CAND_SIZE + b]]++;
+		if (cnt[src[b]] == n)
+			continue;	/* Nothing to do for this byte */
+		for (sum = 0, i = 0; i < 256; i++) {
+			c = cnt[i];
+			cnt[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			memcpy(dst + cnt[src[i * CAND_SIZE + b]]++ * CAND_SIZE,
+			    src + i * CAND_SIZE, CAND_SIZE);
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != ent)
+		memcpy(ent, src, n * CAND_SIZE);
+}
+
+static void
+filter_spill(struct filt *fp)
+{
+	struct run *r;
+	FILE *f;
+	void *p;
+
+	if (fp->nent == 0)
+		return;
+	filter_radix(fp->ent, fp->tmp, fp->nent);
+	f = tmpfile();
+	AN(f);
+	if (fwrite(fp->ent, CAND_SIZE, fp->nent, f) != fp->nent ||
+	    fflush(f)) {
+		fprintf(stderr, "Cannot spill candidates: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+	p = mmap(NULL, fp->nent * CAND_SIZE, PROT_READ,
+	    MAP_PRIVATE | MAP_NOCORE, fileno(f), 0);
+	assert(p != MAP_FAILED);
+	AZ(fclose(f));
+
+	fp->runs = realloc(fp->runs, (fp->nrun + 1L) * sizeof *fp->runs);
+	AN(fp->runs);
+	r = &fp->runs[fp->nrun++];
+	r->ptr = p;
+	r->n = fp->nent;
+	r->i = 0;
+	r->maplen = fp->nent * CAND_SIZE;
+	fp->nent = 0;
+}
+
+static void
+filter_read(struct filt *fp, const struct finput *fi)
+{
+	const char *id, *line;
+	char buf[IDX_KEYLEN * 2 + 1];
+	size_t pos = 0, len, l;
+	uint8_t *e;
+
+	while (1) {
+		id = filter_line(fp, fi, &pos, &line, &len, 1);
+		if (id == NULL)
+			break;
+		if (fp->nent == fp->lent)
+			filter_spill(fp);
+		e = fp->ent + fp->nent++ * CAND_SIZE;
+		l = fp->aa->id_size;
+		if (l > sizeof buf - 1)
+			l = sizeof buf - 1;
+		memcpy(buf, id, l);
+		buf[l] = '\0';
+		assert(IDX_Unhex(e, IDX_KEYLEN, buf) >= 0);
+		cand_enc48(e + 12, fi->base + (uint64_t)(line - fi->ptr));
+		cand_enc48(e + 18, fp->ncand++);
+	}
+}
+
+/* Walking the index --------------------------------------------------*/
+
+static int
+filter_heap_cmp(const struct run *r1, const struct run *r2)
+{
+
+	return (memcmp(r1->ptr + r1->i * CAND_SIZE,
+	    r2->ptr + r2->i * CAND_SIZE, IDX_KEYLEN));
+}
+
+static void
+filter_heap_down(struct filt *fp, unsigned u)
+{
+	struct run *r;
+	unsigned c;
+
+	while (1) {
+		c = 2 * u + 1;
+		if (c >= fp->nheap)
+			break;
+		if (c + 1 < fp->nheap &&
+		    filter_heap_cmp(fp->heap[c + 1], fp->heap[c]) < 0)
+			c++;
+		if (filter_heap_cmp(fp->heap[c], fp->heap[u]) >= 0)
+			break;
+		r = fp->heap[c];
+		fp->heap[c] = fp->heap[u];
+		fp->heap[u] = r;
+		u = c;
+	}
+}
+
+static void
+filter_heap_next(struct filt *fp)
+{
+	struct run *r;
+
+	r = fp->heap[0];
+	if (++r->i == r->n)
+		fp->heap[0] = fp->heap[--fp->nheap];
+	filter_heap_down(fp, 0);
+}
+
+static const char *
+filter_id(const struct filt *fp, uint64_t off)
+{
+	const struct finput *fi;
+	const char *line;
+	size_t pos, len;
+	unsigned u;
+
+	for (u = 0; u + 1 < fp->ninput; u++)
+		if (off < fp->inputs[u + 1].base)
+			break;
+	fi = &fp->inputs[u];
+	pos = off - fi->base;
+	return (filter_line(fp, fi, &pos, &line, &len, 0));
+}
+
 static int
 filter_s_check(const struct filt *fp, uint32_t silo, int64_t offset,
     const char *key)
@@ -98,124 +403,144 @@ filter_s_check(const struct filt *fp, uint32_t silo, int64_t offset,
 	AN(hdr);
 	p = Header_Get_Id(hdr);
 	AN(p);
-	if (strcasecmp(p, key))
+	if (strlen(p) != fp->aa->id_size ||
+	    strncasecmp(p, key, fp->aa->id_size))
 		retval = 1;
 	Header_Destroy(&hdr);
 	Rsilo_Close(&rs);
 	return (retval);
 }
 
-static int v_matchproto_(idx_iter_f)
-filter_iter(void *priv, const char *key,
-    uint32_t flag, uint32_t silo, int64_t offset, const char *cont)
+static void
+filter_hit(struct filt *fp, const uint8_t *e, uint32_t silo, int64_t offset)
+{
+	uint64_t n;
+
+	n = cand_dec48(e + 18);
+	if (fp->found[n >> 3] & (1 << (n & 7)))
+		return;
+	if (fp->s_flag &&
+	    filter_s_check(fp, silo, offset, filter_id(fp, cand_dec48(e + 12))))
+		return;
+	fp->found[n >> 3] |= (uint8_t)(1 << (n & 7));
+	fp->nfound++;
+}
+
+/* For keys out of order, in the appendix or not yet committed */
+
+static void
+filter_lookup(struct filt *fp, const struct run *r, const struct idx_key *key,
+    uint32_t silo, int64_t offset)
+{
+	uint64_t lo = 0, hi = r->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (memcmp(r->ptr + mid * CAND_SIZE, key, IDX_KEYLEN) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < r->n; lo++) {
+		if (memcmp(r->ptr + lo * CAND_SIZE, key, IDX_KEYLEN))
+			break;
+		filter_hit(fp, r->ptr + lo * CAND_SIZE, silo, offset);
+	}
+}
+
+static int v_matchproto_(idx_iter_bin_f)
+filter_iter(void *priv, const struct idx_key *key,
+    uint32_t flag, uint32_t silo, int64_t offset, uint32_t cont)
 {
-	struct cand *c;
 	struct filt *fp;
+	const uint8_t *e;
+	unsigned u;
+	int i;
 
 	CAST_OBJ_NOTNULL(fp, priv, FILT_MAGIC);
 	(void)flag;
 	(void)cont;
 
-	if (VTAILQ_EMPTY(&sorted))
+	if (fp->nfound == fp->ncand)
 		return (1);
-	if (next_cand == NULL || strcmp(key, fp->last) < 0)
-		next_cand = VTAILQ_FIRST(&sorted);
-	strlcpy(fp->last, key, sizeof fp->last);
-	while (next_cand != NULL && strcmp(next_cand->id, key) < 0)
-		next_cand = VTAILQ_NEXT(next_cand, sortlist);
-	while (next_cand != NULL &&
-	    !strncmp(key, next_cand->id, strlen(key))) {
-		c = next_cand;
-		next_cand = VTAILQ_NEXT(c, sortlist);
-		if (!s_flag || !filter_s_check(fp, silo, offset, c->id)) {
-			c->found = 1;
-			VTAILQ_REMOVE(&sorted, c, sortlist);
-		}
+	if (fp->started && memcmp(key, &fp->last, sizeof *key) <= 0) {
+		for (u = 0; u < fp->nrun; u++)
+			filter_lookup(fp, &fp->runs[u], key, silo, offset);
+		return (0);
 	}
-	return(0);
-}
-
-static int
-read_file(const struct aardwarc *aa, FILE *fi)
-{
-	char buf[BUFSIZ], *p;
-	struct cand *c1, *c2;
-	int retval = 0;
-	size_t sl;
-
-	while (fgets(buf, sizeof buf, fi) != NULL) {
-		sl = strlen(buf);
-		AN(sl);
-		if (buf[sl - 1] != '\n') {
-			fprintf(stderr, "Over long line \"%.40s...\"\n",
-			    buf);
-			exit(1);
-		}
-		buf[--sl] = '\0';
-		if (sl == 0)
-			continue;
-		ALLOC_OBJ(c1, CAND_MAGIC);
-		AN(c1);
-		REPLACE(c1->line, buf);
-		AN(c1->line);
-		p = buf;
-		if (!strncasecmp(p, aa->prefix, strlen(aa->prefix)))
-			p += strlen(aa->prefix);
-		if (strlen(p) < aa->id_size) {
-			fprintf(stderr, "ID too short: \"%s\"\n", buf);
-			exit(1);
-		}
-		p[aa->id_size] = '\0';
-		if (strspn(p, "0123456789abcdefABCDEF") != strlen(p)) {
-			fprintf(stderr, "Non-hex characters in id: \"%s\"\n",
-			    buf);
-			exit(1);
-		}
-		REPLACE(c1->id, p);
-		AN(c1->id);
-		c2 = VTAILQ_LAST(&candidates, candhead);
-		ncand++;
-		VTAILQ_INSERT_TAIL(&candidates, c1, list);
-		VTAILQ_INSERT_TAIL(&sorted, c1, sortlist);
-		if (c2 != NULL && strcmp(c2->id, c1->id) > 0)
-			retval = 1;
+	fp->started = 1;
+	fp->last = *key;
+	while (fp->nheap > 0) {
+		e = fp->heap[0]->ptr + fp->heap[0]->i * CAND_SIZE;
+		i = memcmp(e, key, IDX_KEYLEN);
+		if (i > 0)
+			break;
+		if (i == 0)
+			filter_hit(fp, e, silo, offset);
+		filter_heap_next(fp);
 	}
-	return (retval);
+	return (0);
 }
 
-static int
-cand_cmp(const void *p1, const void *p2)
+/* Output -------------------------------------------------------------*/
+
+static void
+filter_output(const struct filt *fp, FILE *fo, int r_flag, int v_flag)
 {
-	const struct cand *c1, *c2;
+	const struct finput *fi;
+	const char *line;
+	size_t pos, len;
+	uint64_t n = 0;
+	unsigned u;
+	int found;
 
-	CAST_OBJ_NOTNULL(c1, *(const struct cand * const*)p1, CAND_MAGIC);
-	CAST_OBJ_NOTNULL(c2, *(const struct cand * const*)p2, CAND_MAGIC);
-	return (strcmp(c1->id, c2->id));
+	for (u = 0; u < fp->ninput; u++) {
+		fi = &fp->inputs[u];
+		pos = 0;
+		while (filter_line(fp, fi, &pos, &line, &len, 0) != NULL) {
+			found = (fp->found[n >> 3] >> (n & 7)) & 1;
+			n++;
+			if (v_flag)
+				fprintf(fo, "%d %.*s\n", found, (int)len, line);
+			else if (r_flag == found)
+				fprintf(fo, "%.*s\n", (int)len, line);
+		}
+	}
+	assert(n == fp->ncand);
 }
 
 int v_matchproto_(main_f)
 main_filter(const char *a0, struct aardwarc *aa, int argc, char **argv)
 {
-	int ch;
+	int ch, fd;
 	const char *a00 = *argv;
-	FILE *fi, *fo = stdout;
+	FILE *fo = stdout;
 	const char *ofile = NULL;
+	const char *p;
 	int stdin_done = 0;
-	int needs_sort = 0;
 	int r_flag = 0;
 	int v_flag = 0;
-	struct cand *c;
-	struct cand **cp;
+	uintmax_t budget;
 	struct filt *fp;
+	unsigned u;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
 	ALLOC_OBJ(fp, FILT_MAGIC);
 	AN(fp);
 	fp->aa = aa;
+	budget = (uintmax_t)aa->index_sort_size;
 
-	while ((ch = getopt(argc, argv, "ho:rsv")) != -1) {
+	while ((ch = getopt(argc, argv, "b:ho:rsv")) != -1) {
 		switch (ch) {
+		case 'b':
+			p = VNUM_2bytes(optarg, &budget, 0);
+			if (p != NULL || budget < 4096) {
+				usage_filter(a0, a00,
+				    "Illegal -b argument (>= 4k)");
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage_filter(a0, a00, NULL);
 			exit(1);
@@ -226,7 +551,7 @@ main_filter(const char *a0, struct aardwarc *aa, int argc, char **argv)
 			r_flag = 1 - r_flag;
 			break;
 		case 's':
-			s_flag = 1 - s_flag;
+			fp->s_flag = 1 - fp->s_flag;
 			break;
 		case 'v':
 			v_flag = 1 - v_flag;
@@ -240,7 +565,7 @@ main_filter(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	argv += optind;
 
 	if (argc == 0)
-		needs_sort |= read_file(aa, stdin);
+		filter_map(fp, STDIN_FILENO, "stdin");
 
 	if (ofile != NULL) {
 		fo = fopen(ofile, "w");
@@ -257,44 +582,55 @@ main_filter(const char *a0, struct aardwarc *aa, int argc, char **argv)
 				fprintf(stderr, "STDIN already processed\n");
 				exit(1);
 			}
-			needs_sort |= read_file(aa, stdin);
+			filter_map(fp, STDIN_FILENO, "stdin");
 		} else {
-			fi = fopen(*argv, "r");
-			if (fi == NULL) {
+			fd = open(*argv, O_RDONLY);
+			if (fd < 0) {
 				fprintf(stderr, "Cannot open %s: %s\n",
 				    *argv, strerror(errno));
 				exit(1);
 			}
-			needs_sort |= read_file(aa, fi);
-			AZ(fclose(fi));
+			filter_map(fp, fd, *argv);
+			AZ(close(fd));
 		}
 	}
-	if (needs_sort) {
-		cp = calloc(ncand, sizeof *cp);
-		AN(cp);
-		ch = 0;
-		VTAILQ_FOREACH(c, &candidates, list)
-			cp[ch++] = c;
-		assert(ch == ncand);
-		qsort(cp, ncand, sizeof *cp, cand_cmp);
-		VTAILQ_INIT(&sorted);
-		for(ch = 0; ch < ncand; ch++)
-			VTAILQ_INSERT_TAIL(&sorted, cp[ch], sortlist);
-		free(cp);
-	}
-	(void)IDX_Iter(aa, NULL, filter_iter, fp);
-	while (1) {
-		c = VTAILQ_FIRST(&candidates);
-		if (c == NULL)
-			break;
-		VTAILQ_REMOVE(&candidates, c, list);
-		if (v_flag)
-			fprintf(fo, "%d %s\n", c->found, c->line);
-		else if (r_flag == c->found)
-			fprintf(fo, "%s\n", c->line);
-		REPLACE(c->id, NULL);
-		FREE_OBJ(c);
-	}
+
+	fp->lent = budget / (2 * CAND_SIZE);
+	fp->ent = malloc(fp->lent * CAND_SIZE);
+	AN(fp->ent);
+	fp->tmp = malloc(fp->lent * CAND_SIZE);
+	AN(fp->tmp);
+	for (u = 0; u < fp->ninput; u++)
+		filter_read(fp, &fp->inputs[u]);
+	filter_spill(fp);
+	REPLACE(fp->ent, NULL);
+	REPLACE(fp->tmp, NULL);
+
+	fp->found = calloc((fp->ncand + 7) / 8 + 1, 1);
+	AN(fp->found);
+	fp->heap = calloc(fp->nrun + 1L, sizeof *fp->heap);
+	AN(fp->heap);
+	for (u = 0; u < fp->nrun; u++)
+		fp->heap[fp->nheap++] = &fp->runs[u];
+	for (u = fp->nheap; u-- > 0;)
+		filter_heap_down(fp, u);
+
+	if (fp->ncand > 0)
+		(void)IDX_IterBin(aa, NULL, 0, filter_iter, fp);
+
+	filter_output(fp, fo, r_flag, v_flag);
+
+	for (u = 0; u < fp->nrun; u++)
+		AZ(munmap((void*)(uintptr_t)fp->runs[u].ptr,
+		    fp->runs[u].maplen));
+	for (u = 0; u < fp->ninput; u++)
+		if (fp->inputs[u].len > 0)
+			AZ(munmap((void*)(uintptr_t)fp->inputs[u].ptr,
+			    fp->inputs[u].len));
+	free(fp->runs);
+	free(fp->heap);
+	free(fp->inputs);
+	free(fp->found);
 	FREE_OBJ(fp);
 	return (0);
 }
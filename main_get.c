@@ -64,6 +64,7 @@ struct get {
 	FILE			*dst;
 	FILE			*hdr;
 	int			zip;
+	struct objcache		*oc;
 };
 
 static int v_matchproto_(byte_iter_f)
@@ -75,6 +76,8 @@ get_iter(void *priv, const void *ptr, ssize_t len)
 	assert(len == (ssize_t)fwrite(ptr, 1, len, gp->dst));
 	if (!gp->zip)
 		SHA256_Update(gp->sha256, ptr, len);
+	if (gp->oc != NULL)
+		(void)ObjCache_Fill(gp->oc, ptr, len);
 	gp->len += len;
 	return (0);
 }
@@ -85,7 +88,8 @@ main_get(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	int ch;
 	const char *a00 = *argv;
 	struct vsb *vsb;
-	struct getjob *gj;
+	struct getjob *gj = NULL;
+	struct objcache *oc = NULL;
 	struct get *gp;
 	const struct header *hdr1, *hdr9;
 	char *dig;
@@ -141,28 +145,45 @@ main_get(const char *a0, struct aardwarc *aa, int argc, char **argv)
 		gp->hdr = stderr;
 	}
 
-	vsb = VSB_new_auto();
-	AN(vsb);
+	if (!zip)
+		oc = ObjCache_Lookup(aa, *argv);
 
-	gj = GetJob_New(aa, *argv, vsb);
-	if (gj == NULL) {
-		AZ(VSB_finish(vsb));
-		fprintf(stderr, "%s\n", VSB_data(vsb));
-		exit (1);
-	}
-	VSB_delete(vsb);
-	hdr1 = GetJob_Header(gj, 1);
-	AN(hdr1);
-	hdr9 = GetJob_Header(gj, 0);
-	AN(hdr9);
-	if (!quiet) {
+	if (oc != NULL) {
+		/* The cached headers are already merged, see GetJob_Headers */
+		hdr1 = ObjCache_Header(oc);
+		hdr9 = hdr1;
+		if (!quiet)
+			fprintf(gp->hdr, "%s", ObjCache_Headers(oc));
+	} else {
+		vsb = VSB_new_auto();
+		AN(vsb);
+
+		gj = GetJob_New(aa, *argv, vsb);
+		if (gj == NULL) {
+			AZ(VSB_finish(vsb));
+			fprintf(stderr, "%s\n", VSB_data(vsb));
+			exit (1);
+		}
+		VSB_delete(vsb);
+		hdr1 = GetJob_Header(gj, 1);
+		AN(hdr1);
+		hdr9 = GetJob_Header(gj, 0);
+		AN(hdr9);
 		vsb = GetJob_Headers(gj);
 		AZ(VSB_finish(vsb));
-		fprintf(gp->hdr, "%s", VSB_data(vsb));
+		if (!quiet)
+			fprintf(gp->hdr, "%s", VSB_data(vsb));
+		if (!zip && !hdr_only)
+			gp->oc = ObjCache_Create(aa, *argv, VSB_data(vsb),
+			    GetJob_TotalLength(gj, 0));
+		VSB_delete(vsb);
 	}
 
 	if (!hdr_only) {
-		GetJob_Iter(gj, get_iter, gp, zip);
+		if (oc != NULL)
+			ObjCache_Iter(oc, get_iter, gp);
+		else
+			GetJob_Iter(gj, get_iter, gp, zip);
 
 		dig = SHA256_End(gp->sha256, NULL);
 		AN(dig);
@@ -183,9 +204,16 @@ main_get(const char *a0, struct aardwarc *aa, int argc, char **argv)
 			bprintf(buf, "%ju", (uintmax_t)gp->len);
 			assert(!strcmp(p, buf));
 		}
+
+		/* Only checked objects go into the cache */
+		if (gp->oc != NULL)
+			ObjCache_Commit(&gp->oc);
 	}
 
 	FREE_OBJ(gp);
-	GetJob_Delete(&gj);
+	if (oc != NULL)
+		ObjCache_Close(&oc);
+	if (gj != NULL)
+		GetJob_Delete(&gj);
 	return (0);
 }
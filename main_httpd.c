@@ -0,0 +1,725 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * A persistent HTTP/1.1 server with the same semantics as main_cgi.c
+ *
+ * A single poller thread owns the listening socket and all idle
+ * (keep-alive) connections, and reads the request headers as they
+ * arrive, without blocking.  Once a connection has a complete request
+ * it is handed to a pool of worker threads, which do the (blocking)
+ * index and silo I/O, and hand the connection back to the poller once
+ * the request has been served.  Idle and slow clients therefore cost
+ * a file descriptor, but not a worker.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+#define HTTPD_RXBUF		8192
+#define HTTPD_TXBUF		(64 * 1024)
+#define HTTPD_TIMEOUT		30	/* seconds */
+
+struct conn {
+	unsigned		magic;
+#define CONN_MAGIC		0x4f5a1c37
+	int			fd;
+	time_t			t_idle;
+	VTAILQ_ENTRY(conn)	list;
+
+	size_t			rxlen;
+	char			rxbuf[HTTPD_RXBUF + 1];
+
+	int			error;
+	struct objcache		*fill;
+	size_t			txlen;
+	char			txbuf[HTTPD_TXBUF];
+};
+
+VTAILQ_HEAD(connhead, conn);
+
+struct httpd {
+	unsigned		magic;
+#define HTTPD_MAGIC		0x1d3b7a6e
+	struct aardwarc		*aa;
+	int			listen_fd;
+	int			wake[2];
+
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	struct connhead		ready;		// Waiting for a worker
+	struct connhead		back;		// Returned by a worker
+
+	/* Only touched by the poller thread */
+	struct connhead		idle;
+	unsigned		nidle;
+};
+
+/*--------------------------------------------------------------------*/
+
+static void
+httpd_close(struct conn *cp)
+{
+
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+	closefd(&cp->fd);
+	FREE_OBJ(cp);
+}
+
+static void
+httpd_flush(struct conn *cp)
+{
+	const char *p;
+	ssize_t i;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+	p = cp->txbuf;
+	while (cp->txlen > 0 && !cp->error) {
+		i = write(cp->fd, p, cp->txlen);
+		if (i <= 0) {
+			cp->error = 1;
+			break;
+		}
+		p += i;
+		cp->txlen -= i;
+	}
+	cp->txlen = 0;
+}
+
+static void
+httpd_tx(struct conn *cp, const void *ptr, size_t len)
+{
+	const char *p = ptr;
+	size_t l;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+	while (len > 0 && !cp->error) {
+		if (cp->txlen == sizeof cp->txbuf)
+			httpd_flush(cp);
+		l = sizeof cp->txbuf - cp->txlen;
+		if (l > len)
+			l = len;
+		memcpy(cp->txbuf + cp->txlen, p, l);
+		cp->txlen += l;
+		p += l;
+		len -= l;
+	}
+}
+
+static void
+httpd_txvsb(struct conn *cp, struct vsb **vsbp)
+{
+
+	AN(vsbp);
+	AZ(VSB_finish(*vsbp));
+	httpd_tx(cp, VSB_data(*vsbp), VSB_len(*vsbp));
+	VSB_destroy(vsbp);
+}
+
+static int v_matchproto_(byte_iter_f)
+httpd_body_iter(void *priv, const void *ptr, ssize_t len)
+{
+	struct conn *cp;
+
+	CAST_OBJ_NOTNULL(cp, priv, CONN_MAGIC);
+	httpd_tx(cp, ptr, len);
+	if (cp->fill != NULL)
+		(void)ObjCache_Fill(cp->fill, ptr, len);
+	return (cp->error);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+httpd_response(struct conn *cp, const char *status, int keep)
+{
+	struct vsb *vsb;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "HTTP/1.1 %s\r\n", status);
+	VSB_printf(vsb, "Content-Type: text/html\r\n");
+	if (!keep)
+		VSB_printf(vsb, "Connection: close\r\n");
+	VSB_printf(vsb, "Content-Length: 0\r\n");
+	VSB_printf(vsb, "\r\n");
+	httpd_txvsb(cp, &vsb);
+}
+
+static void
+httpd_get(const struct httpd *hp, struct conn *cp, const char *id,
+    int head, int gzip, int keep)
+{
+	struct vsb *vsb, *body;
+	struct getjob *gj = NULL;
+	struct objcache *oc = NULL;
+	const struct header *hdr;
+	const char *ct;
+	off_t o;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+
+	if (!gzip)
+		oc = ObjCache_Lookup(hp->aa, id);
+	if (oc == NULL)
+		gj = GetJob_New(hp->aa, id, vsb);
+	if (oc == NULL && gj == NULL) {
+		AZ(VSB_finish(vsb));
+		body = VSB_new_auto();
+		AN(body);
+		VSB_printf(body, "<html><pre>%s\n</pre></html>", VSB_data(vsb));
+		AZ(VSB_finish(body));
+		VSB_clear(vsb);
+		VSB_printf(vsb, "HTTP/1.1 501 Error\r\n");
+		VSB_printf(vsb, "Content-Type: text/html\r\n");
+		if (!keep)
+			VSB_printf(vsb, "Connection: close\r\n");
+		VSB_printf(vsb, "Content-Length: %zd\r\n", VSB_len(body));
+		VSB_printf(vsb, "\r\n");
+		httpd_txvsb(cp, &vsb);
+		if (!head)
+			httpd_tx(cp, VSB_data(body), VSB_len(body));
+		VSB_destroy(&body);
+		return;
+	}
+	VSB_clear(vsb);
+
+	if (oc != NULL) {
+		hdr = ObjCache_Header(oc);
+		o = ObjCache_Length(oc);
+	} else {
+		hdr = GetJob_Header(gj, 1);
+		o = GetJob_TotalLength(gj, gzip);
+	}
+	AN(hdr);
+
+	ct = Header_Get(hdr, "Content-Type");
+	if (ct == NULL)
+		ct = "application/binary";
+
+	VSB_printf(vsb, "HTTP/1.1 200 OK\r\n");
+	VSB_printf(vsb, "Content-Type: %s\r\n", ct);
+	if (gzip)
+		VSB_printf(vsb, "Content-Encoding: gzip\r\n");
+	if (!keep)
+		VSB_printf(vsb, "Connection: close\r\n");
+	VSB_printf(vsb, "Content-Length: %jd\r\n", (intmax_t)o);
+	VSB_printf(vsb, "\r\n");
+	httpd_txvsb(cp, &vsb);
+
+	if (oc != NULL) {
+		if (!head)
+			ObjCache_Iter(oc, httpd_body_iter, cp);
+		ObjCache_Close(&oc);
+		return;
+	}
+
+	if (!head && !gzip) {
+		vsb = GetJob_Headers(gj);
+		AZ(VSB_finish(vsb));
+		cp->fill = ObjCache_Create(hp->aa, id, VSB_data(vsb), o);
+		VSB_destroy(&vsb);
+	}
+	if (!head)
+		GetJob_Iter(gj, httpd_body_iter, cp, gzip);
+	if (cp->fill != NULL)
+		ObjCache_Commit(&cp->fill);
+	GetJob_Delete(&gj);
+}
+
+/*--------------------------------------------------------------------
+ * Handle one request, return non-zero if the connection can be kept.
+ */
+
+static int
+httpd_request(const struct httpd *hp, struct conn *cp, char *p)
+{
+	char *q, *meth, *url, *proto, *name, *val;
+	int keep, gzip = 0, body = 0, head;
+
+	q = strstr(p, "\r\n");
+	AN(q);
+	*q = '\0';
+	meth = p;
+	p = q + 2;
+
+	url = strchr(meth, ' ');
+	if (url == NULL) {
+		httpd_response(cp, "400 Bad Request", 0);
+		return (0);
+	}
+	*url++ = '\0';
+	proto = strchr(url, ' ');
+	if (proto == NULL) {
+		httpd_response(cp, "400 Bad Request", 0);
+		return (0);
+	}
+	*proto++ = '\0';
+
+	if (!strcmp(proto, "HTTP/1.1")) {
+		keep = 1;
+	} else if (!strcmp(proto, "HTTP/1.0")) {
+		keep = 0;
+	} else {
+		httpd_response(cp, "505 HTTP Version Not Supported", 0);
+		return (0);
+	}
+
+	while ((q = strstr(p, "\r\n")) != NULL) {
+		*q = '\0';
+		name = p;
+		p = q + 2;
+		val = strchr(name, ':');
+		if (val == NULL)
+			continue;
+		*val++ = '\0';
+		while (*val == ' ' || *val == '\t')
+			val++;
+		if (!strcasecmp(name, "Connection")) {
+			if (!strcasecmp(val, "close"))
+				keep = 0;
+			else if (!strcasecmp(val, "keep-alive"))
+				keep = 1;
+		} else if (!strcasecmp(name, "Accept-Encoding")) {
+			if (strstr(val, "gzip") != NULL)
+				gzip = 1;
+		} else if (!strcasecmp(name, "Content-Length")) {
+			if (strcmp(val, "0"))
+				body = 1;
+		} else if (!strcasecmp(name, "Transfer-Encoding")) {
+			body = 1;
+		}
+	}
+
+	if (body) {
+		/* We never expect a body, so we cannot find the next request */
+		httpd_response(cp, "400 Bad Request", 0);
+		return (0);
+	}
+
+	if (!strcmp(meth, "GET")) {
+		head = 0;
+	} else if (!strcmp(meth, "HEAD")) {
+		head = 1;
+	} else {
+		httpd_response(cp, "501 Not Implemented", keep);
+		return (keep);
+	}
+
+	q = strchr(url, '?');
+	if (q != NULL)
+		*q = '\0';
+	if (*url == '/')
+		url++;
+
+	httpd_get(hp, cp, url, head, gzip, keep);
+	return (keep);
+}
+
+/*--------------------------------------------------------------------
+ * Look for a complete request header in what we have received.
+ *
+ * Returns the length of the header, zero if we need more and -1 if
+ * the header is too long.
+ */
+
+static ssize_t
+httpd_complete(struct conn *cp)
+{
+	char *p;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+	cp->rxbuf[cp->rxlen] = '\0';
+	p = strstr(cp->rxbuf, "\r\n\r\n");
+	if (p != NULL)
+		return ((p + 4) - cp->rxbuf);
+	if (cp->rxlen == HTTPD_RXBUF)
+		return (-1);
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * The poller found the connection readable, take what is there.
+ *
+ * Returns -1 on EOF/error, 1 if a worker has something to do and
+ * zero if we need more.
+ */
+
+static int
+httpd_rx(struct conn *cp)
+{
+	ssize_t i;
+
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+	assert(cp->rxlen < HTTPD_RXBUF);
+	i = recv(cp->fd, cp->rxbuf + cp->rxlen,
+	    HTTPD_RXBUF - cp->rxlen, MSG_DONTWAIT);
+	if (i < 0 && (errno == EAGAIN || errno == EINTR))
+		return (0);
+	if (i <= 0)
+		return (-1);
+	cp->rxlen += i;
+	return (httpd_complete(cp) != 0);
+}
+
+static void
+httpd_session(struct httpd *hp, struct conn *cp)
+{
+	ssize_t l;
+	int keep;
+
+	CHECK_OBJ_NOTNULL(hp, HTTPD_MAGIC);
+	CHECK_OBJ_NOTNULL(cp, CONN_MAGIC);
+
+	while (1) {
+		l = httpd_complete(cp);
+		if (l == 0)
+			break;
+		if (l < 0) {
+			httpd_response(cp, "431 Request Header Too Large", 0);
+			httpd_flush(cp);
+			httpd_close(cp);
+			return;
+		}
+		/* Terminate header, any pipelined request stays put */
+		cp->rxbuf[l - 1] = '\0';
+		keep = httpd_request(hp, cp, cp->rxbuf);
+		httpd_flush(cp);
+		if (!keep || cp->error) {
+			httpd_close(cp);
+			return;
+		}
+		cp->rxlen -= l;
+		memmove(cp->rxbuf, cp->rxbuf + l, cp->rxlen);
+	}
+
+	/* Any partial request is completed by the poller */
+
+	AZ(pthread_mutex_lock(&hp->mtx));
+	VTAILQ_INSERT_TAIL(&hp->back, cp, list);
+	AZ(pthread_mutex_unlock(&hp->mtx));
+	assert(write(hp->wake[1], "", 1) == 1);
+}
+
+static void *
+httpd_worker(void *priv)
+{
+	struct httpd *hp;
+	struct conn *cp;
+
+	CAST_OBJ_NOTNULL(hp, priv, HTTPD_MAGIC);
+	while (1) {
+		AZ(pthread_mutex_lock(&hp->mtx));
+		while (VTAILQ_EMPTY(&hp->ready))
+			AZ(pthread_cond_wait(&hp->cond, &hp->mtx));
+		cp = VTAILQ_FIRST(&hp->ready);
+		VTAILQ_REMOVE(&hp->ready, cp, list);
+		AZ(pthread_mutex_unlock(&hp->mtx));
+		httpd_session(hp, cp);
+	}
+	NEEDLESS(return (NULL));
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+httpd_accept(struct httpd *hp, time_t now)
+{
+	struct conn *cp;
+	struct timeval tv;
+	int fd;
+
+	fd = accept(hp->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	/*
+	 * BSD sockets inherit O_NONBLOCK from the listen socket.  The
+	 * workers write blocking, the poller reads with MSG_DONTWAIT.
+	 */
+	AZ(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK));
+	memset(&tv, 0, sizeof tv);
+	tv.tv_sec = HTTPD_TIMEOUT;
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	ALLOC_OBJ(cp, CONN_MAGIC);
+	AN(cp);
+	cp->fd = fd;
+	cp->t_idle = now;
+	VTAILQ_INSERT_TAIL(&hp->idle, cp, list);
+	hp->nidle++;
+}
+
+static void
+httpd_poller(struct httpd *hp)
+{
+	struct pollfd *fds = NULL;
+	unsigned nfds = 0, u;
+	struct conn *cp, *cp2;
+	char buf[64];
+	time_t now;
+	int i;
+
+	CHECK_OBJ_NOTNULL(hp, HTTPD_MAGIC);
+	now = time(NULL);
+	while (1) {
+		AZ(pthread_mutex_lock(&hp->mtx));
+		while (!VTAILQ_EMPTY(&hp->back)) {
+			cp = VTAILQ_FIRST(&hp->back);
+			VTAILQ_REMOVE(&hp->back, cp, list);
+			cp->t_idle = now;
+			VTAILQ_INSERT_TAIL(&hp->idle, cp, list);
+			hp->nidle++;
+		}
+		AZ(pthread_mutex_unlock(&hp->mtx));
+
+		if (nfds < hp->nidle + 2) {
+			nfds = hp->nidle + 2;
+			fds = realloc(fds, sizeof *fds * nfds);
+			AN(fds);
+		}
+		memset(fds, 0, sizeof *fds * nfds);
+		fds[0].fd = hp->listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = hp->wake[0];
+		fds[1].events = POLLIN;
+		u = 2;
+		VTAILQ_FOREACH(cp, &hp->idle, list) {
+			fds[u].fd = cp->fd;
+			fds[u++].events = POLLIN;
+		}
+		i = poll(fds, u, 1000);
+		if (i < 0 && errno == EINTR)
+			continue;
+		assert(i >= 0);
+		now = time(NULL);
+
+		if (fds[1].revents)
+			(void)read(hp->wake[0], buf, sizeof buf);
+
+		u = 2;
+		VTAILQ_FOREACH_SAFE(cp, &hp->idle, list, cp2) {
+			i = fds[u++].revents;
+			if (i)
+				i = httpd_rx(cp);
+			/* A request must be complete within the timeout */
+			if (!i && now - cp->t_idle < HTTPD_TIMEOUT)
+				continue;
+			VTAILQ_REMOVE(&hp->idle, cp, list);
+			hp->nidle--;
+			if (i <= 0) {
+				httpd_close(cp);
+				continue;
+			}
+			AZ(pthread_mutex_lock(&hp->mtx));
+			VTAILQ_INSERT_TAIL(&hp->ready, cp, list);
+			AZ(pthread_cond_signal(&hp->cond));
+			AZ(pthread_mutex_unlock(&hp->mtx));
+		}
+
+		if (fds[0].revents)
+			httpd_accept(hp, now);
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static int
+httpd_listen(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	struct stat st;
+	char *host, *port;
+	int fd = -1, i, one = 1;
+
+	if (*addr == '/') {
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof sun.sun_path) {
+			fprintf(stderr, "Socket path too long: %s\n", addr);
+			return (-1);
+		}
+		bstrcpy(sun.sun_path, addr);
+		if (!lstat(addr, &st) && S_ISSOCK(st.st_mode))
+			(void)unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 &&
+		    bind(fd, (const void *)&sun, sizeof sun) == 0 &&
+		    listen(fd, 128) == 0)
+			return (fd);
+		fprintf(stderr, "Cannot listen on %s: %s\n",
+		    addr, strerror(errno));
+		if (fd >= 0)
+			closefd(&fd);
+		return (-1);
+	}
+
+	host = strdup(addr);
+	AN(host);
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		fprintf(stderr, "Address must be host:port or /path (%s)\n",
+		    addr);
+		free(host);
+		return (-1);
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	i = getaddrinfo(*host != '\0' ? host : NULL, port, &hints, &res);
+	if (i) {
+		fprintf(stderr, "Cannot resolve %s: %s\n",
+		    addr, gai_strerror(i));
+		free(host);
+		return (-1);
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		    &one, sizeof one);
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, 128) == 0)
+			break;
+		closefd(&fd);
+	}
+	freeaddrinfo(res);
+	free(host);
+	if (fd < 0)
+		fprintf(stderr, "Cannot listen on %s: %s\n",
+		    addr, strerror(errno));
+	return (fd);
+}
+
+static
+void
+usage_httpd(const char *a0, const char *a00, const char *err)
+{
+	usage(a0, err);
+	fprintf(stderr, "Usage for this operation:\n");
+	fprintf(stderr, "\t%s [global options] %s [options]\n",
+	    a0, a00);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-a {host:port|/socket/path} (default: %s)\n",
+	    "localhost:8080");
+	fprintf(stderr, "\t-n number of worker threads (default: 8)\n");
+}
+
+int v_matchproto_(main_f)
+main_httpd(const char *a0, struct aardwarc *aa, int argc, char **argv)
+{
+	int ch;
+	const char *a00 = *argv;
+	const char *addr = "localhost:8080";
+	struct httpd *hp;
+	pthread_t thr;
+	long nworker = 8;
+	char *p;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+
+	while ((ch = getopt(argc, argv, "a:hn:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'h':
+			usage_httpd(a0, a00, NULL);
+			exit(1);
+		case 'n':
+			nworker = strtol(optarg, &p, 0);
+			if (*p != '\0' || nworker < 1 || nworker > 1024) {
+				usage_httpd(a0, a00, "Illegal -n argument.");
+				exit(1);
+			}
+			break;
+		default:
+			usage_httpd(a0, a00, "Unknown option error.");
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		usage_httpd(a0, a00, "Too many arguments.");
+		exit (1);
+	}
+
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	ALLOC_OBJ(hp, HTTPD_MAGIC);
+	AN(hp);
+	hp->aa = aa;
+	VTAILQ_INIT(&hp->ready);
+	VTAILQ_INIT(&hp->back);
+	VTAILQ_INIT(&hp->idle);
+	AZ(pthread_mutex_init(&hp->mtx, NULL));
+	AZ(pthread_cond_init(&hp->cond, NULL));
+	AZ(pipe(hp->wake));
+	AZ(fcntl(hp->wake[0], F_SETFL, O_NONBLOCK));
+
+	hp->listen_fd = httpd_listen(addr);
+	if (hp->listen_fd < 0)
+		exit(1);
+	AZ(fcntl(hp->listen_fd, F_SETFL, O_NONBLOCK));
+
+	for (; nworker > 0; nworker--) {
+		AZ(pthread_create(&thr, NULL, httpd_worker, hp));
+		AZ(pthread_detach(thr));
+	}
+
+	httpd_poller(hp);
+	return (0);
+}
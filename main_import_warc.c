@@ -0,0 +1,851 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Import foreign WARC files
+ * -------------------------
+ *
+ * Plain, gzip'ed and multi-member gzip'ed WARC files are read record by
+ * record, and the block of each record is stored as a resource with the
+ * Content-Type of the record.  With -M the original WARC header, which
+ * has the target URI, date &c, is stored as an "application/warc-fields"
+ * metadata record referring to it.
+ *
+ * The IDs are derived the same way 'store' does it (see ident.c), so
+ * we hash each block before anything else and skip what we have.
+ *
+ * The compressing and committing is done by a pool of workers, each
+ * with their own batch silo, while this thread reads and parses the
+ * input.  Records are handed to the workers by ID, so that duplicates
+ * meet in the same batch.  Blocks too big to hold in memory are
+ * streamed into silos of their own by this thread, segjob.c spreads
+ * the compression of those over several threads by itself.
+ *
+ * The manifest, "ID [metadata-ID] original-Record-ID" per record, is
+ * printed as the records are committed and synced to disk, so it is
+ * not in input order.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sha256.h>
+#include <zlib.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+#include "vqueue.h"
+
+#include "aardwarc.h"
+
+#define IMPORT_SMALL	(1024 * 1024)
+#define IMPORT_BUFSIZE	(128 * 1024)
+#define IMPORT_QUEUE	8
+#define IMPORT_META	"application/warc-fields"
+
+struct imp_job {
+	unsigned		magic;
+#define IMP_JOB_MAGIC		0x2a6b03d9
+	VTAILQ_ENTRY(imp_job)	list;
+	struct header		*hdr;		// NULL if we have it
+	char			*body;
+	size_t			len;
+	const char		*validator;
+	struct header		*mhdr;		// NULL if we have it
+	struct vsb		*meta;
+	char			*line;
+};
+
+VTAILQ_HEAD(imp_jobhead, imp_job);
+
+struct imp_worker {
+	unsigned		magic;
+#define IMP_WORKER_MAGIC	0x6d31c0f4
+	struct importer		*im;
+	pthread_t		thr;
+	pthread_cond_t		cond;
+	struct imp_jobhead	queue;
+	unsigned		nqueue;
+	struct wsilo		*sl;
+	struct imp_jobhead	pending;	// Waiting for the batch
+};
+
+struct importer {
+	unsigned		magic;
+#define IMPORTER_MAGIC		0x51e7a8b2
+	struct aardwarc		*aa;
+	const char		*mt;
+	int			meta;
+	unsigned		nworker;
+	struct imp_worker	*wrk;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;		// Room in a queue
+	int			done;
+	struct SHA256Context	sha256[1];
+	uintmax_t		nrec;
+	uintmax_t		ndup;
+	int			retval;
+};
+
+/* Input ---------------------------------------------------------------*/
+
+struct imp_in {
+	unsigned		magic;
+#define IMP_IN_MAGIC		0x0f94d27e
+	const char		*fn;
+	int			fd;
+	int			gz;
+	int			zend;		// Between gzip members
+	int			err;
+	z_stream		zs[1];
+	uint8_t			*zbuf;
+	char			*buf;
+	size_t			ptr;
+	size_t			len;
+};
+
+/* Returns one if there is more input, zero on EOF, -1 on trouble */
+
+static int
+imp_fill(struct imp_in *in)
+{
+	ssize_t i;
+	int z;
+
+	assert(in->ptr == in->len);
+	in->ptr = in->len = 0;
+	if (in->err)
+		return (-1);
+	while (in->len == 0) {
+		if (in->gz && in->zs->avail_in > 0) {
+			if (in->zend) {
+				AZ(inflateReset(in->zs));
+				in->zend = 0;
+			}
+			in->zs->next_out = (void*)in->buf;
+			in->zs->avail_out = IMPORT_BUFSIZE;
+			z = inflate(in->zs, Z_NO_FLUSH);
+			in->len = IMPORT_BUFSIZE - in->zs->avail_out;
+			if (z == Z_STREAM_END) {
+				in->zend = 1;
+			} else if (z != Z_OK && z != Z_BUF_ERROR) {
+				fprintf(stderr, "%s: Bad gzip data\n", in->fn);
+				in->err = 1;
+				return (-1);
+			}
+			continue;
+		}
+		i = read(in->fd, in->gz ? (void*)in->zbuf : (void*)in->buf,
+		    IMPORT_BUFSIZE);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i < 0) {
+			fprintf(stderr, "%s: Read error: %s\n",
+			    in->fn, strerror(errno));
+			in->err = 1;
+			return (-1);
+		}
+		if (i == 0 && in->gz && !in->zend) {
+			fprintf(stderr, "%s: Truncated gzip data\n", in->fn);
+			in->err = 1;
+			return (-1);
+		}
+		if (i == 0)
+			return (0);
+		if (in->gz) {
+			in->zs->next_in = in->zbuf;
+			in->zs->avail_in = (uInt)i;
+		} else {
+			in->len = (size_t)i;
+		}
+	}
+	return (1);
+}
+
+static void
+imp_in_init(struct imp_in *in, const char *fn, int fd)
+{
+	ssize_t i;
+	size_t l;
+
+	INIT_OBJ(in, IMP_IN_MAGIC);
+	in->fn = fn;
+	in->fd = fd;
+	in->buf = malloc(IMPORT_BUFSIZE);
+	AN(in->buf);
+	in->zbuf = malloc(IMPORT_BUFSIZE);
+	AN(in->zbuf);
+
+	/* Sniff for the gzip magic */
+	for (l = 0; l < 2; l += (size_t)i) {
+		i = read(fd, in->zbuf + l, IMPORT_BUFSIZE - l);
+		if (i <= 0)
+			break;
+	}
+	if (l >= 2 && in->zbuf[0] == 0x1f && in->zbuf[1] == 0x8b) {
+		in->gz = 1;
+		in->zend = 1;
+		AZ(inflateInit2(in->zs, 15 + 16));
+		in->zs->next_in = in->zbuf;
+		in->zs->avail_in = (uInt)l;
+	} else {
+		memcpy(in->buf, in->zbuf, l);
+		in->len = l;
+	}
+}
+
+static void
+imp_in_fini(struct imp_in *in)
+{
+
+	CHECK_OBJ_NOTNULL(in, IMP_IN_MAGIC);
+	if (in->gz)
+		(void)inflateEnd(in->zs);
+	free(in->buf);
+	free(in->zbuf);
+}
+
+static int
+imp_getc(struct imp_in *in)
+{
+
+	if (in->ptr == in->len && imp_fill(in) <= 0)
+		return (-1);
+	return (in->buf[in->ptr++] & 0xff);
+}
+
+/* Read a line without the CRLF, -1 on EOF */
+
+static int
+imp_line(struct imp_in *in, struct vsb *vsb)
+{
+	char *p;
+	int c;
+
+	VSB_clear(vsb);
+	while ((c = imp_getc(in)) != '\n') {
+		if (c < 0)
+			return (-1);
+		if (VSB_len(vsb) >= IMPORT_SMALL)
+			return (-1);
+		(void)VSB_putc(vsb, c);
+	}
+	AZ(VSB_finish(vsb));
+	p = VSB_data(vsb);
+	if (VSB_len(vsb) > 0 && p[VSB_len(vsb) - 1] == '\r')
+		p[VSB_len(vsb) - 1] = '\0';
+	return (0);
+}
+
+/* Hand the next 'len' bytes of block to 'func' */
+
+static int
+imp_block(struct imp_in *in, uintmax_t len, byte_iter_f *func, void *priv)
+{
+	size_t l;
+
+	while (len > 0) {
+		if (in->ptr == in->len && imp_fill(in) <= 0) {
+			if (!in->err)
+				fprintf(stderr, "%s: Truncated record\n",
+				    in->fn);
+			return (-1);
+		}
+		l = in->len - in->ptr;
+		if (l > len)
+			l = (size_t)len;
+		if (func != NULL)
+			(void)func(priv, in->buf + in->ptr, (ssize_t)l);
+		in->ptr += l;
+		len -= l;
+	}
+	return (0);
+}
+
+/* Workers -------------------------------------------------------------*/
+
+static void
+imp_job_free(struct imp_job **jpp)
+{
+	struct imp_job *jp;
+
+	TAKE_OBJ_NOTNULL(jp, jpp, IMP_JOB_MAGIC);
+	if (jp->hdr != NULL)
+		Header_Destroy(&jp->hdr);
+	if (jp->mhdr != NULL)
+		Header_Destroy(&jp->mhdr);
+	if (jp->meta != NULL)
+		VSB_destroy(&jp->meta);
+	free(jp->body);
+	free(jp->line);
+	FREE_OBJ(jp);
+}
+
+static void
+imp_print(struct importer *im, const char *line)
+{
+
+	AZ(pthread_mutex_lock(&im->mtx));
+	(void)fputs(line, stdout);
+	AZ(pthread_mutex_unlock(&im->mtx));
+}
+
+/* Once the batch and everything else we did is on disk, tell about it */
+
+static void
+imp_flush(struct imp_worker *wrk)
+{
+	struct imp_job *jp, *jp2;
+	uint64_t gen;
+
+	if (wrk->sl != NULL)
+		Wsilo_BatchCommit(&wrk->sl);
+	gen = Commit_Done(wrk->im->aa);
+	if (gen != 0)
+		Commit_Wait(wrk->im->aa, gen);
+	VTAILQ_FOREACH_SAFE(jp, &wrk->pending, list, jp2) {
+		VTAILQ_REMOVE(&wrk->pending, jp, list);
+		imp_print(wrk->im, jp->line);
+		imp_job_free(&jp);
+	}
+}
+
+static int
+imp_store(struct imp_worker *wrk, const struct header *hdr,
+    const void *ptr, size_t len, const char *validator)
+{
+	struct validator *vl = NULL;
+	struct segjob *sj;
+	struct vsb *vsb;
+	char *id;
+	int batch;
+
+	batch = Wsilo_BatchFits(wrk->im->aa, len);
+	if (batch && wrk->sl != NULL && !Wsilo_BatchRoom(wrk->sl, len))
+		imp_flush(wrk);
+	if (batch && wrk->sl == NULL)
+		wrk->sl = Wsilo_Batch(wrk->im->aa);
+
+	if (validator != NULL) {
+		vl = Validator_New(validator);
+		Validator_Feed(vl, ptr, len);
+	}
+	sj = SegJob_New(wrk->im->aa, hdr, NULL);
+	AN(sj);
+	if (batch)
+		SegJob_Batch(sj, wrk->sl);
+	SegJob_Feed(sj, ptr, (ssize_t)len);
+	vsb = Validator_Verdict(&vl);
+	if (vsb != NULL) {
+		SegJob_Abandon(&sj);
+		fprintf(stderr, "%s\n", VSB_data(vsb));
+		VSB_destroy(&vsb);
+		return (-1);
+	}
+	id = SegJob_Commit(sj);
+	REPLACE(id, NULL);
+	return (0);
+}
+
+static void
+imp_job(struct imp_worker *wrk, struct imp_job *jp)
+{
+
+	if (jp->hdr != NULL && imp_store(wrk, jp->hdr, jp->body, jp->len,
+	    jp->validator)) {
+		AZ(pthread_mutex_lock(&wrk->im->mtx));
+		wrk->im->retval = 1;
+		AZ(pthread_mutex_unlock(&wrk->im->mtx));
+		imp_job_free(&jp);
+		return;
+	}
+	if (jp->mhdr != NULL)
+		AZ(imp_store(wrk, jp->mhdr, VSB_data(jp->meta),
+		    VSB_len(jp->meta), NULL));
+	VTAILQ_INSERT_TAIL(&wrk->pending, jp, list);
+}
+
+static void *
+imp_thread(void *priv)
+{
+	struct imp_worker *wrk;
+	struct importer *im;
+	struct imp_job *jp;
+
+	CAST_OBJ_NOTNULL(wrk, priv, IMP_WORKER_MAGIC);
+	im = wrk->im;
+	AZ(pthread_mutex_lock(&im->mtx));
+	while (1) {
+		jp = VTAILQ_FIRST(&wrk->queue);
+		if (jp == NULL &&
+		    (wrk->sl != NULL || !VTAILQ_EMPTY(&wrk->pending))) {
+			/* Nothing else to do, so commit what we have */
+			AZ(pthread_mutex_unlock(&im->mtx));
+			imp_flush(wrk);
+			AZ(pthread_mutex_lock(&im->mtx));
+			continue;
+		}
+		if (jp == NULL && im->done)
+			break;
+		if (jp == NULL) {
+			AZ(pthread_cond_wait(&wrk->cond, &im->mtx));
+			continue;
+		}
+		VTAILQ_REMOVE(&wrk->queue, jp, list);
+		wrk->nqueue--;
+		AZ(pthread_cond_broadcast(&im->cond));
+		AZ(pthread_mutex_unlock(&im->mtx));
+		imp_job(wrk, jp);
+		AZ(pthread_mutex_lock(&im->mtx));
+	}
+	AZ(pthread_mutex_unlock(&im->mtx));
+	return (NULL);
+}
+
+static void
+imp_dispatch(struct importer *im, struct imp_job *jp, const char *ident)
+{
+	struct imp_worker *wrk;
+	char buf[9];
+
+	/* Same ID, same worker, so the batch catches duplicates */
+	bprintf(buf, "%.8s", ident);
+	wrk = &im->wrk[strtoul(buf, NULL, 16) % im->nworker];
+	AZ(pthread_mutex_lock(&im->mtx));
+	while (wrk->nqueue >= IMPORT_QUEUE)
+		AZ(pthread_cond_wait(&im->cond, &im->mtx));
+	VTAILQ_INSERT_TAIL(&wrk->queue, jp, list);
+	wrk->nqueue++;
+	AZ(pthread_cond_signal(&wrk->cond));
+	AZ(pthread_mutex_unlock(&im->mtx));
+}
+
+/* Records -------------------------------------------------------------*/
+
+struct imp_big {
+	struct segjob		*sj;
+	struct validator	*vl;
+};
+
+static int v_matchproto_(byte_iter_f)
+imp_feed(void *priv, const void *ptr, ssize_t len)
+{
+	struct imp_big *ib = priv;
+
+	if (ib->vl != NULL)
+		Validator_Feed(ib->vl, ptr, (size_t)len);
+	SegJob_Feed(ib->sj, ptr, len);
+	return (0);
+}
+
+/*
+ * Too big for memory, we stream it into silos of our own.  Returns
+ * non-zero if the input failed, '*idp' is NULL if the validator
+ * rejected the block.
+ */
+
+static int
+imp_big(struct importer *im, struct imp_in *in, const struct header *hdr,
+    uintmax_t len, const char *validator, char **idp)
+{
+	struct imp_big ib[1];
+	struct vsb *vsb;
+	uint64_t gen;
+	int i, j = 0;
+
+	*idp = NULL;
+	memset(ib, 0, sizeof ib);
+	ib->sj = SegJob_New(im->aa, hdr, NULL);
+	AN(ib->sj);
+	if (validator != NULL)
+		ib->vl = Validator_New(validator);
+	i = imp_block(in, len, imp_feed, ib);
+	vsb = Validator_Verdict(&ib->vl);
+	if (vsb != NULL) {
+		if (!i) {
+			fprintf(stderr, "%s\n", VSB_data(vsb));
+			im->retval = 1;
+		}
+		VSB_destroy(&vsb);
+		j = 1;
+	}
+	if (i || j) {
+		SegJob_Abandon(&ib->sj);
+		return (i);
+	}
+	*idp = SegJob_Commit(ib->sj);
+	gen = Commit_Done(im->aa);
+	if (gen != 0)
+		Commit_Wait(im->aa, gen);
+	return (0);
+}
+
+static int v_matchproto_(byte_iter_f)
+imp_copy(void *priv, const void *ptr, ssize_t len)
+{
+	struct imp_job *jp;
+
+	CAST_OBJ_NOTNULL(jp, priv, IMP_JOB_MAGIC);
+	memcpy(jp->body + jp->len, ptr, len);
+	jp->len += (size_t)len;
+	return (0);
+}
+
+/*
+ * Import one record, returns zero at EOF and -1 if we cannot make
+ * sense of the input.
+ */
+
+static int
+imp_record(struct importer *im, struct imp_in *in, struct vsb *line)
+{
+	struct header *fhdr;
+	struct imp_job *jp;
+	struct vsb *meta;
+	char dig[SHA256_DIGEST_STRING_LENGTH];
+	char ident[SHA256_DIGEST_STRING_LENGTH];
+	char mident[SHA256_DIGEST_STRING_LENGTH];
+	const char *mt, *validator = NULL;
+	char *p, *q, *fid, *rid, *mid = NULL;
+	intmax_t clen;
+	int c;
+
+	/* Tolerate sloppy record separators */
+	do
+		c = imp_getc(in);
+	while (c == '\r' || c == '\n');
+	if (c < 0)
+		return (in->err ? -1 : 0);
+	in->ptr--;
+
+	if (imp_line(in, line) || strncmp(VSB_data(line), "WARC/", 5)) {
+		fprintf(stderr, "%s: Not a WARC record\n", in->fn);
+		return (-1);
+	}
+
+	/* Parse the header ---------------------------------------------*/
+
+	fhdr = Header_New(im->aa);
+	meta = VSB_new_auto();
+	AN(meta);
+	fid = NULL;
+	while (1) {
+		if (imp_line(in, line)) {
+			fprintf(stderr, "%s: Truncated WARC header\n", in->fn);
+			Header_Destroy(&fhdr);
+			VSB_destroy(&meta);
+			free(fid);
+			return (-1);
+		}
+		p = VSB_data(line);
+		if (*p == '\0')
+			break;
+		VSB_printf(meta, "%s\r\n", p);
+		q = strchr(p, ':');
+		if (q == NULL || q == p)
+			continue;
+		*q++ = '\0';
+		q += strspn(q, " \t");
+		if (strcasecmp(p, "WARC-Record-ID"))
+			Header_Set(fhdr, p, "%s", q);
+		else if (fid == NULL) {
+			q += (*q == '<');
+			fid = strndup(q, strcspn(q, ">"));
+		}
+	}
+	AZ(VSB_finish(meta));
+	if (fid == NULL)
+		REPLACE(fid, "-");
+	AN(fid);
+
+	clen = Header_Get_Number(fhdr, "Content-Length");
+	if (clen < 0) {
+		fprintf(stderr, "%s: Bad Content-Length in %s\n",
+		    in->fn, fid);
+		Header_Destroy(&fhdr);
+		VSB_destroy(&meta);
+		free(fid);
+		return (-1);
+	}
+	im->nrec++;
+
+	mt = im->mt;
+	if (mt == NULL)
+		mt = Header_Get(fhdr, "Content-Type");
+	if (mt == NULL)
+		mt = "application/octet-stream";
+	c = 1;
+	if (clen == 0) {
+		fprintf(stderr, "Skipping %s: Empty\n", fid);
+		c = 0;
+	} else if (Config_Find(im->aa->cfg, "resource.mime-types",
+	    mt, &validator)) {
+		fprintf(stderr, "Skipping %s: Illegal mime-type %s\n",
+		    fid, mt);
+		im->retval = 1;
+		c = 0;
+	}
+	if (!c) {
+		c = imp_block(in, (uintmax_t)clen, NULL, NULL) ? -1 : 1;
+		Header_Destroy(&fhdr);
+		VSB_destroy(&meta);
+		free(fid);
+		return (c);
+	}
+
+	/* The block ----------------------------------------------------*/
+
+	ALLOC_OBJ(jp, IMP_JOB_MAGIC);
+	AN(jp);
+	jp->hdr = Wsilo_NewHeader(im->aa, "resource", mt);
+	jp->validator = validator;
+
+	if (clen <= IMPORT_SMALL) {
+		jp->body = malloc((size_t)clen);
+		AN(jp->body);
+		c = imp_block(in, (uintmax_t)clen, imp_copy, jp);
+		SHA256_Init(im->sha256);
+		SHA256_Update(im->sha256, jp->body, jp->len);
+		AN(SHA256_End(im->sha256, dig));
+		Ident_Create(im->aa, jp->hdr, dig, ident);
+		rid = Digest2Ident(im->aa, ident);
+		if (!c && Wsilo_Have(im->aa, NULL, rid)) {
+			Header_Destroy(&jp->hdr);
+			REPLACE(jp->body, NULL);
+		}
+	} else {
+		c = imp_big(im, in, jp->hdr, (uintmax_t)clen, validator, &rid);
+		Header_Destroy(&jp->hdr);
+		if (!c && rid == NULL)
+			c = 1;		// Rejected, but we can go on
+		else if (!c)
+			bstrcpy(ident, rid + strlen(im->aa->prefix));
+	}
+	if (c) {
+		imp_job_free(&jp);
+		Header_Destroy(&fhdr);
+		VSB_destroy(&meta);
+		free(fid);
+		free(rid);
+		return (c < 0 ? -1 : 1);
+	}
+
+	/* The original header ------------------------------------------*/
+
+	if (im->meta) {
+		jp->mhdr = Wsilo_NewHeader(im->aa, "metadata", IMPORT_META);
+		Header_Set(jp->mhdr, "WARC-Refers-To", "<%s>", rid);
+		SHA256_Init(im->sha256);
+		SHA256_Update(im->sha256, VSB_data(meta), VSB_len(meta));
+		AN(SHA256_End(im->sha256, dig));
+		Ident_Create(im->aa, jp->mhdr, dig, mident);
+		mid = Digest2Ident(im->aa, mident);
+		if (Wsilo_Have(im->aa, NULL, mid))
+			Header_Destroy(&jp->mhdr);
+		else
+			jp->meta = meta;
+	}
+	if (jp->meta == NULL)
+		VSB_destroy(&meta);
+
+	VSB_clear(line);
+	VSB_cat(line, rid);
+	if (mid != NULL)
+		VSB_printf(line, " %s", mid);
+	VSB_printf(line, " %s\n", fid);
+	AZ(VSB_finish(line));
+	jp->line = strdup(VSB_data(line));
+	AN(jp->line);
+
+	if (jp->hdr == NULL && jp->mhdr == NULL) {
+		im->ndup++;
+		imp_print(im, jp->line);
+		imp_job_free(&jp);
+	} else {
+		imp_dispatch(im, jp, ident);
+	}
+	REPLACE(rid, NULL);
+	REPLACE(mid, NULL);
+	Header_Destroy(&fhdr);
+	free(fid);
+	return (1);
+}
+
+/*--------------------------------------------------------------------*/
+
+static
+void
+usage_import_warc(const char *a0, const char *a00, const char *err)
+{
+	usage(a0, err);
+	fprintf(stderr, "Usage for this operation:\n");
+	fprintf(stderr, "\t%s [global options] %s [options] [file|-]...\n",
+	    a0, a00);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-M Store the original WARC headers as metadata\n");
+	fprintf(stderr, "\t-m mime_type (instead of the records')\n");
+	fprintf(stderr, "\t-n Number of workers (default: 8)\n");
+	fprintf(stderr, "\t-v Report statistics\n");
+}
+
+int v_matchproto_(main_f)
+main_import_warc(const char *a0, struct aardwarc *aa, int argc, char **argv)
+{
+	const char *a00 = *argv;
+	struct importer im[1];
+	struct imp_worker *wrk;
+	struct imp_in in[1];
+	struct vsb *vsb;
+	unsigned u;
+	int ch, fd, i, v_arg = 0;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	INIT_OBJ(im, IMPORTER_MAGIC);
+	im->aa = aa;
+	im->nworker = 8;
+
+	while ((ch = getopt(argc, argv, "hMm:n:v")) != -1) {
+		switch (ch) {
+		case 'M':
+			im->meta = 1;
+			break;
+		case 'm':
+			im->mt = optarg;
+			break;
+		case 'n':
+			im->nworker = (unsigned)strtoul(optarg, NULL, 0);
+			if (im->nworker < 1 || im->nworker > 1024) {
+				usage_import_warc(a0, a00,
+				    "Illegal -n argument.");
+				exit(1);
+			}
+			break;
+		case 'v':
+			v_arg = 1;
+			break;
+		case 'h':
+			usage_import_warc(a0, a00, NULL);
+			exit(1);
+		default:
+			usage_import_warc(a0, a00, "Unknown option error.");
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (im->mt != NULL && Config_Find(aa->cfg, "resource.mime-types",
+	    im->mt, NULL)) {
+		fprintf(stderr, "Illegal mime-type for resource\n");
+		exit(1);
+	}
+	if (im->meta && Config_Find(aa->cfg, "metadata.mime-types",
+	    IMPORT_META, NULL)) {
+		fprintf(stderr, "Config doesn't allow %s for metadata\n",
+		    IMPORT_META);
+		exit(1);
+	}
+
+	AZ(pthread_mutex_init(&im->mtx, NULL));
+	AZ(pthread_cond_init(&im->cond, NULL));
+	im->wrk = calloc(im->nworker, sizeof *im->wrk);
+	AN(im->wrk);
+	for (u = 0; u < im->nworker; u++) {
+		wrk = &im->wrk[u];
+		INIT_OBJ(wrk, IMP_WORKER_MAGIC);
+		wrk->im = im;
+		VTAILQ_INIT(&wrk->queue);
+		VTAILQ_INIT(&wrk->pending);
+		AZ(pthread_cond_init(&wrk->cond, NULL));
+		AZ(pthread_create(&wrk->thr, NULL, imp_thread, wrk));
+	}
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	for (i = 0; i < argc || (i == 0 && argc == 0); i++) {
+		if (argc == 0 || !strcmp(argv[i], "-")) {
+			fd = 0;
+			imp_in_init(in, "-", fd);
+		} else {
+			fd = open(argv[i], O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "Cannot open %s: %s\n",
+				    argv[i], strerror(errno));
+				im->retval = 1;
+				continue;
+			}
+			imp_in_init(in, argv[i], fd);
+		}
+		do
+			ch = imp_record(im, in, vsb);
+		while (ch > 0);
+		if (ch < 0)
+			im->retval = 1;
+		imp_in_fini(in);
+		if (fd > 0)
+			closefd(&fd);
+	}
+	VSB_destroy(&vsb);
+
+	AZ(pthread_mutex_lock(&im->mtx));
+	im->done = 1;
+	for (u = 0; u < im->nworker; u++)
+		AZ(pthread_cond_signal(&im->wrk[u].cond));
+	AZ(pthread_mutex_unlock(&im->mtx));
+	for (u = 0; u < im->nworker; u++) {
+		wrk = &im->wrk[u];
+		AZ(pthread_join(wrk->thr, NULL));
+		AZ(wrk->nqueue);
+		AZ(wrk->sl);
+		AZ(pthread_cond_destroy(&wrk->cond));
+	}
+	Commit_Flush(aa);
+	(void)fflush(stdout);
+
+	if (v_arg) {
+		vsb = VSB_new_auto();
+		AN(vsb);
+		VSB_printf(vsb, "Records: %ju, already had %ju\n",
+		    im->nrec, im->ndup);
+		Commit_Report(aa, vsb);
+		AZ(VSB_finish(vsb));
+		fprintf(stderr, "%s", VSB_data(vsb));
+		VSB_destroy(&vsb);
+	}
+
+	free(im->wrk);
+	AZ(pthread_cond_destroy(&im->cond));
+	AZ(pthread_mutex_destroy(&im->mtx));
+	return (im->retval);
+}
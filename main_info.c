@@ -27,6 +27,8 @@
  *
  */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,68 @@
 
 #include "aardwarc.h"
 
+/*
+ * Fragmentation report, a silo in many small extents reads slowly
+ */
+
+struct info_frag {
+	unsigned		magic;
+#define INFO_FRAG_MAGIC		0x0b5c77e2
+	uintmax_t		nsilo;
+	uintmax_t		size;
+	uintmax_t		extents;
+	uintmax_t		unknown;
+};
+
+static int v_matchproto_(byte_iter_f)
+info_frag_iter(void *priv, const void *fn, ssize_t silono)
+{
+	struct info_frag *fr;
+	off_t sz;
+	int i;
+
+	CAST_OBJ_NOTNULL(fr, priv, INFO_FRAG_MAGIC);
+	(void)silono;
+	i = Silo_Extents(fn, &sz);
+	if (sz < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n",
+		    (const char *)fn, strerror(errno));
+		fr->unknown++;
+		return (0);
+	}
+	if (i < 0) {
+		printf("%s %jd bytes, extents unknown\n",
+		    (const char *)fn, (intmax_t)sz);
+		fr->unknown++;
+		return (0);
+	}
+	printf("%s %jd bytes, %d extents\n", (const char *)fn, (intmax_t)sz, i);
+	fr->nsilo++;
+	fr->size += sz;
+	fr->extents += i;
+	return (0);
+}
+
+static void
+info_frag(const struct aardwarc *aa, int argc, char **argv)
+{
+	struct info_frag fr[1];
+
+	INIT_OBJ(fr, INFO_FRAG_MAGIC);
+	if (argc == 0)
+		(void)Silo_Iter(aa, info_frag_iter, fr);
+	while (argc-- > 0)
+		(void)info_frag_iter(fr, *argv++, -1);
+	printf("%ju silos, %ju bytes, %ju extents", fr->nsilo, fr->size,
+	    fr->extents);
+	if (fr->extents > 0)
+		printf(", %.1f MB per extent",
+		    fr->size / (1048576. * fr->extents));
+	if (fr->unknown > 0)
+		printf(", %ju silos unknown", fr->unknown);
+	printf("\n");
+}
+
 static
 void
 usage_info(const char *a0, const char *a00, const char *err)
@@ -47,6 +111,8 @@ usage_info(const char *a0, const char *a00, const char *err)
 	fprintf(stderr, "Usage for this operation:\n");
 	fprintf(stderr, "\t%s [global options] %s [options] [silo]...\n",
 	    a0, a00);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-f Report fragmentation of silos\n");
 }
 
 int v_matchproto_(main_f)
@@ -54,11 +120,15 @@ main_info(const char *a0, struct aardwarc *aa, int argc, char **argv)
 {
 	int ch;
 	const char *a00 = *argv;
+	int f_arg = 0;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
-	while ((ch = getopt(argc, argv, "h")) != -1) {
+	while ((ch = getopt(argc, argv, "fh")) != -1) {
 		switch (ch) {
+		case 'f':
+			f_arg = 1;
+			break;
 		case 'h':
 			usage_info(a0, a00, NULL);
 			exit(1);
@@ -67,7 +137,14 @@ main_info(const char *a0, struct aardwarc *aa, int argc, char **argv)
 			exit(1);
 		}
 	}
-	if (argc > optind) {
+	argc -= optind;
+	argv += optind;
+
+	if (f_arg) {
+		info_frag(aa, argc, argv);
+		return (0);
+	}
+	if (argc > 0) {
 		usage_info(a0, a00, "No arguments allowed.");
 		exit(1);
 	}
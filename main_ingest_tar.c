@@ -0,0 +1,693 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Ingest a tar(1) or cpio(1) stream
+ * ---------------------------------
+ *
+ * Store every regular file in an archive read from stdin, so that
+ * a directory tree can be imported with one process:
+ *
+ *	tar cf - dir | ssh host aardwarc ingest-tar -M
+ *
+ * ustar, pax and GNU tar, and "newc" and "odc" cpio are recognized.
+ * Members up to INGEST_SMALL are read into memory, so that we can skip
+ * those we have already, and the small ones are packed into batch silos
+ * like 'store -b' does.  Bigger members are streamed into silos of
+ * their own, so that we never need more memory than that.
+ *
+ * With -M a metadata record with the path and mtime of the member is
+ * stored for each of them.
+ *
+ * The manifest, "ID path" or "ID metadata-ID path" per member, is not
+ * printed until the members are committed and synced to disk.  We read
+ * the input to EOF, so that the sender does not trip over the trailing
+ * padding.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sha256.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+#define INGEST_SMALL	(1024 * 1024)
+#define INGEST_NAMELEN	(64 * 1024)
+
+struct ingest {
+	unsigned		magic;
+#define INGEST_MAGIC		0x7c2e9a41
+	struct aardwarc		*aa;
+	const char		*mt;
+	const char		*validator;
+	int			meta;
+	int			fd;
+	struct SHA256Context	sha256[1];
+	struct wsilo		*sl;
+	struct vsb		*out;
+	struct vsb		*path;
+	struct vsb		*next_path;	// From GNU 'L' or pax
+	int64_t			next_size;	// From pax, or -1
+	int64_t			next_mtime;	// From pax, or -1
+	char			*ibuf;
+	uintmax_t		nmember;
+	int			retval;
+};
+
+/* Input ---------------------------------------------------------------*/
+
+static int
+ingest_read(struct ingest *ig, void *ptr, size_t len)
+{
+	char *p = ptr;
+	ssize_t i;
+
+	while (len > 0) {
+		i = read(ig->fd, p, len);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i < 0) {
+			fprintf(stderr, "Input read error: %s\n",
+			    strerror(errno));
+			return (-1);
+		}
+		if (i == 0) {
+			fprintf(stderr, "Input truncated\n");
+			return (-1);
+		}
+		p += i;
+		len -= (size_t)i;
+	}
+	return (0);
+}
+
+static int
+ingest_skip(struct ingest *ig, uintmax_t len)
+{
+	size_t l;
+
+	while (len > 0) {
+		l = len < INGEST_SMALL ? (size_t)len : INGEST_SMALL;
+		if (ingest_read(ig, ig->ibuf, l))
+			return (-1);
+		len -= l;
+	}
+	return (0);
+}
+
+/* Output --------------------------------------------------------------*/
+
+static int
+ingest_validated(struct validator **vlp, const char *path)
+{
+	struct vsb *vsb;
+
+	vsb = Validator_Verdict(vlp);
+	if (vsb == NULL)
+		return (1);
+	fprintf(stderr, "Skipping %s: %s\n", path, VSB_data(vsb));
+	VSB_destroy(&vsb);
+	return (0);
+}
+
+/* Storing -------------------------------------------------------------*/
+
+/*
+ * An object we have all of in memory, we can skip if we have it
+ * already, otherwise it goes into the batch if it is small enough.
+ * Returns NULL if the validator rejects it.
+ */
+
+static char *
+ingest_small(struct ingest *ig, const struct header *hdr,
+    const void *ptr, size_t len, const char *validator)
+{
+	struct validator *vl = NULL;
+	struct segjob *sj;
+	char dig[SHA256_DIGEST_STRING_LENGTH];
+	char ident[SHA256_DIGEST_STRING_LENGTH];
+	char *xid, *id;
+	int batch;
+
+	SHA256_Init(ig->sha256);
+	SHA256_Update(ig->sha256, ptr, len);
+	AN(SHA256_End(ig->sha256, dig));
+	Ident_Create(ig->aa, hdr, dig, ident);
+	xid = Digest2Ident(ig->aa, ident);
+
+	if (Wsilo_Have(ig->aa, ig->sl, ident))
+		return (xid);
+
+	batch = Wsilo_BatchFits(ig->aa, len);
+	if (batch && ig->sl != NULL && !Wsilo_BatchRoom(ig->sl, len))
+		Wsilo_BatchDone(ig->aa, &ig->sl, ig->out);
+	if (batch && ig->sl == NULL)
+		ig->sl = Wsilo_Batch(ig->aa);
+
+	if (validator != NULL) {
+		vl = Validator_New(validator);
+		Validator_Feed(vl, ptr, len);
+	}
+	sj = SegJob_New(ig->aa, hdr, NULL);
+	AN(sj);
+	if (batch)
+		SegJob_Batch(sj, ig->sl);
+	SegJob_Feed(sj, ptr, len);
+	if (!ingest_validated(&vl, VSB_data(ig->path))) {
+		SegJob_Abandon(&sj);
+		REPLACE(xid, NULL);
+		return (NULL);
+	}
+	id = SegJob_Commit(sj);
+	AZ(strcmp(id, xid));
+	REPLACE(xid, NULL);
+	return (id);
+}
+
+/*
+ * Too big for memory, stream it into silos of its own.  Returns
+ * non-zero if the input failed, '*idp' is NULL if the validator
+ * rejected the object.
+ */
+
+static int
+ingest_big(struct ingest *ig, const struct header *hdr, uintmax_t len,
+    char **idp)
+{
+	struct validator *vl = NULL;
+	struct segjob *sj;
+	size_t l;
+
+	*idp = NULL;
+	sj = SegJob_New(ig->aa, hdr, NULL);
+	AN(sj);
+	if (ig->validator != NULL)
+		vl = Validator_New(ig->validator);
+	while (len > 0) {
+		l = len < INGEST_SMALL ? (size_t)len : INGEST_SMALL;
+		if (ingest_read(ig, ig->ibuf, l)) {
+			(void)ingest_validated(&vl, VSB_data(ig->path));
+			SegJob_Abandon(&sj);
+			return (-1);
+		}
+		if (vl != NULL)
+			Validator_Feed(vl, ig->ibuf, l);
+		SegJob_Feed(sj, ig->ibuf, (ssize_t)l);
+		len -= l;
+	}
+	if (!ingest_validated(&vl, VSB_data(ig->path))) {
+		SegJob_Abandon(&sj);
+		return (0);
+	}
+	*idp = SegJob_Commit(sj);
+	return (0);
+}
+
+static void
+ingest_json_str(struct vsb *vsb, const char *s)
+{
+
+	(void)VSB_putc(vsb, '"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			VSB_printf(vsb, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			VSB_printf(vsb, "\\u%04x", (unsigned char)*s);
+		else
+			(void)VSB_putc(vsb, *s);
+	}
+	(void)VSB_putc(vsb, '"');
+}
+
+static char *
+ingest_meta(struct ingest *ig, const char *id, int64_t mtime)
+{
+	struct header *hdr;
+	struct vsb *vsb;
+	char *mid;
+
+	hdr = Wsilo_NewHeader(ig->aa, "metadata", STOW_META);
+	Header_Set(hdr, "WARC-Refers-To", "<%s>", id);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_cat(vsb, "{\"path\": ");
+	ingest_json_str(vsb, VSB_data(ig->path));
+	VSB_printf(vsb, ", \"mtime\": %jd}\n", (intmax_t)mtime);
+	AZ(VSB_finish(vsb));
+	mid = ingest_small(ig, hdr, VSB_data(vsb), VSB_len(vsb), NULL);
+	AN(mid);
+	VSB_destroy(&vsb);
+	Header_Destroy(&hdr);
+	return (mid);
+}
+
+/*
+ * Store a member whose 'len' bytes are next in the input, returns
+ * non-zero if we cannot continue with the input.
+ */
+
+static int
+ingest_member(struct ingest *ig, uintmax_t len, int64_t mtime)
+{
+	struct header *hdr;
+	char *id, *mid;
+	int i;
+
+	AZ(VSB_finish(ig->path));
+	if (len == 0) {
+		fprintf(stderr, "Skipping %s: Empty\n", VSB_data(ig->path));
+		return (0);
+	}
+	hdr = Wsilo_NewHeader(ig->aa, "resource", ig->mt);
+	if (len <= INGEST_SMALL) {
+		i = ingest_read(ig, ig->ibuf, (size_t)len);
+		id = NULL;
+		if (!i)
+			id = ingest_small(ig, hdr, ig->ibuf, (size_t)len,
+			    ig->validator);
+	} else {
+		i = ingest_big(ig, hdr, len, &id);
+	}
+	Header_Destroy(&hdr);
+	if (i)
+		return (i);
+	if (id == NULL) {
+		ig->retval = 1;
+		return (0);
+	}
+	ig->nmember++;
+	if (ig->meta) {
+		mid = ingest_meta(ig, id, mtime);
+		VSB_printf(ig->out, "%s %s %s\n", id, mid, VSB_data(ig->path));
+		REPLACE(mid, NULL);
+	} else {
+		VSB_printf(ig->out, "%s %s\n", id, VSB_data(ig->path));
+	}
+	REPLACE(id, NULL);
+	if (ig->sl == NULL)
+		Wsilo_Done(ig->aa, ig->out);
+	return (0);
+}
+
+/* tar(1) --------------------------------------------------------------*/
+
+#define TAR_BLOCK	512
+
+static int
+tar_num(const uint8_t *p, size_t len, uintmax_t *r)
+{
+	size_t u;
+
+	*r = 0;
+	if (*p & 0x80) {
+		/* GNU base-256 for big numbers, we don't do negative */
+		if (*p & 0x40)
+			return (-1);
+		*r = *p & 0x3f;
+		for (u = 1; u < len; u++) {
+			if (*r >> 55)
+				return (-1);
+			*r = (*r << 8) | p[u];
+		}
+		return (0);
+	}
+	for (u = 0; u < len && (p[u] == ' ' || p[u] == '\0'); u++)
+		continue;
+	for (; u < len && p[u] >= '0' && p[u] <= '7'; u++)
+		*r = (*r << 3) | (p[u] - '0');
+	for (; u < len; u++)
+		if (p[u] != ' ' && p[u] != '\0')
+			return (-1);
+	return (0);
+}
+
+static int
+tar_check(const uint8_t *blk)
+{
+	uintmax_t sum, chk;
+	unsigned u;
+
+	if (tar_num(blk + 148, 8, &chk))
+		return (-1);
+	sum = 0;
+	for (u = 0; u < TAR_BLOCK; u++)
+		sum += (u >= 148 && u < 156) ? ' ' : blk[u];
+	return (sum == chk ? 0 : -1);
+}
+
+static int
+tar_zero(const uint8_t *blk)
+{
+	unsigned u;
+
+	for (u = 0; u < TAR_BLOCK; u++)
+		if (blk[u])
+			return (0);
+	return (1);
+}
+
+/* Read a member's data into the name buffer */
+
+static int
+tar_longname(struct ingest *ig, uintmax_t len)
+{
+
+	if (len >= INGEST_NAMELEN) {
+		fprintf(stderr, "Name too long in input\n");
+		return (-1);
+	}
+	if (ingest_read(ig, ig->ibuf, (size_t)len))
+		return (-1);
+	ig->ibuf[len] = '\0';
+	return (0);
+}
+
+/* Pick the few things we care about out of pax extended header records */
+
+static int
+tar_pax(struct ingest *ig, uintmax_t len)
+{
+	char *p, *q, *e, *v;
+	uintmax_t rl;
+
+	if (tar_longname(ig, len))
+		return (-1);
+	e = ig->ibuf + len;
+	for (p = ig->ibuf; p < e; p = q) {
+		rl = strtoumax(p, &v, 10);
+		q = p + rl;
+		if (v == p || *v != ' ' || rl == 0 || q > e || q[-1] != '\n') {
+			fprintf(stderr, "Bad pax header in input\n");
+			return (-1);
+		}
+		q[-1] = '\0';
+		v++;
+		if (!strncmp(v, "path=", 5)) {
+			VSB_clear(ig->next_path);
+			VSB_cat(ig->next_path, v + 5);
+		} else if (!strncmp(v, "size=", 5)) {
+			ig->next_size = strtoll(v + 5, NULL, 10);
+		} else if (!strncmp(v, "mtime=", 6)) {
+			ig->next_mtime = strtoll(v + 6, NULL, 10);
+		}
+	}
+	return (0);
+}
+
+static void
+tar_path(struct ingest *ig, const uint8_t *blk)
+{
+
+	VSB_clear(ig->path);
+	if (VSB_len(ig->next_path) > 0) {
+		AZ(VSB_finish(ig->next_path));
+		VSB_cat(ig->path, VSB_data(ig->next_path));
+		VSB_clear(ig->next_path);
+		return;
+	}
+	if (!memcmp(blk + 257, "ustar", 5) && blk[345] != '\0')
+		VSB_printf(ig->path, "%.155s/", (const char *)blk + 345);
+	VSB_printf(ig->path, "%.100s", (const char *)blk);
+}
+
+static int
+ingest_tar(struct ingest *ig, uint8_t *blk)
+{
+	uintmax_t size, mtime, pad;
+	int i;
+
+	while (1) {
+		if (tar_zero(blk))
+			return (0);
+		if (tar_check(blk)) {
+			fprintf(stderr, "Bad tar header checksum in input\n");
+			return (-1);
+		}
+		if (tar_num(blk + 124, 12, &size) ||
+		    tar_num(blk + 136, 12, &mtime)) {
+			fprintf(stderr, "Bad tar header in input\n");
+			return (-1);
+		}
+		if (ig->next_size >= 0)
+			size = (uintmax_t)ig->next_size;
+		if (ig->next_mtime >= 0)
+			mtime = (uintmax_t)ig->next_mtime;
+		pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+		switch (blk[156]) {
+		case 'L':
+			if (tar_longname(ig, size))
+				return (-1);
+			VSB_clear(ig->next_path);
+			VSB_cat(ig->next_path, ig->ibuf);
+			i = 0;
+			break;
+		case 'x':
+			i = tar_pax(ig, size);
+			break;
+		case '0':
+		case '7':
+		case '\0':
+			tar_path(ig, blk);
+			i = ingest_member(ig, size, (int64_t)mtime);
+			ig->next_size = ig->next_mtime = -1;
+			break;
+		case 'K':
+		case 'g':
+			/* GNU long link names, pax global headers */
+			i = ingest_skip(ig, size);
+			break;
+		default:
+			/* Directories, links, devices &c */
+			VSB_clear(ig->next_path);
+			ig->next_size = ig->next_mtime = -1;
+			i = ingest_skip(ig, size);
+			break;
+		}
+		if (i || ingest_skip(ig, pad) ||
+		    ingest_read(ig, blk, TAR_BLOCK))
+			return (-1);
+	}
+}
+
+/* cpio(1) -------------------------------------------------------------*/
+
+static int
+cpio_num(const char *p, int len, int base, uintmax_t *r)
+{
+	char buf[16], *e;
+
+	assert(len < (int)sizeof buf);
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	*r = strtoumax(buf, &e, base);
+	return (*e != '\0' || e == buf ? -1 : 0);
+}
+
+/*
+ * "newc" has eight hex digits per field and pads to four bytes,
+ * "odc" has octal fields of varying width and does not pad.
+ */
+
+static int
+ingest_cpio(struct ingest *ig, char *hd)
+{
+	uintmax_t mode, mtime, nsize, fsize;
+	char magic[6];
+	int newc, i;
+	size_t hlen;
+
+	memcpy(magic, hd, sizeof magic);
+	newc = memcmp(hd, "070707", 6);
+	hlen = newc ? 110 : 76;
+	while (1) {
+		if (ingest_read(ig, hd + 6, hlen - 6))
+			return (-1);
+		if (newc)
+			i = cpio_num(hd + 14, 8, 16, &mode) ||
+			    cpio_num(hd + 46, 8, 16, &mtime) ||
+			    cpio_num(hd + 54, 8, 16, &fsize) ||
+			    cpio_num(hd + 94, 8, 16, &nsize);
+		else
+			i = cpio_num(hd + 18, 6, 8, &mode) ||
+			    cpio_num(hd + 48, 11, 8, &mtime) ||
+			    cpio_num(hd + 59, 6, 8, &nsize) ||
+			    cpio_num(hd + 65, 11, 8, &fsize);
+		if (i || nsize == 0 || nsize >= INGEST_NAMELEN) {
+			fprintf(stderr, "Bad cpio header in input\n");
+			return (-1);
+		}
+		if (newc)
+			nsize += (4 - (hlen + nsize) % 4) % 4;
+		if (ingest_read(ig, ig->ibuf, (size_t)nsize))
+			return (-1);
+		ig->ibuf[nsize] = '\0';
+		if (!strcmp(ig->ibuf, "TRAILER!!!"))
+			return (0);
+		if (S_ISREG(mode)) {
+			VSB_clear(ig->path);
+			VSB_cat(ig->path, ig->ibuf);
+			i = ingest_member(ig, fsize, (int64_t)mtime);
+		} else {
+			i = ingest_skip(ig, fsize);
+		}
+		if (i || (newc && ingest_skip(ig, (4 - fsize % 4) % 4)))
+			return (-1);
+		if (ingest_read(ig, hd, 6))
+			return (-1);
+		if (memcmp(hd, magic, sizeof magic)) {
+			fprintf(stderr, "Bad cpio header in input\n");
+			return (-1);
+		}
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static
+void
+usage_ingest_tar(const char *a0, const char *a00, const char *err)
+{
+	usage(a0, err);
+	fprintf(stderr, "Usage for this operation:\n");
+	fprintf(stderr, "\t%s [global options] %s [options] < archive\n",
+	    a0, a00);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-M Store metadata with path and mtime\n");
+	fprintf(stderr, "\t-m mime_type\n");
+	fprintf(stderr, "\t-v Report commit statistics\n");
+}
+
+int v_matchproto_(main_f)
+main_ingest_tar(const char *a0, struct aardwarc *aa, int argc, char **argv)
+{
+	const char *a00 = *argv;
+	struct ingest ig[1];
+	struct vsb *vsb;
+	char hd[TAR_BLOCK];
+	int ch, v_arg = 0, i;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	INIT_OBJ(ig, INGEST_MAGIC);
+	ig->aa = aa;
+	ig->mt = "application/octet-stream";
+
+	while ((ch = getopt(argc, argv, "hMm:v")) != -1) {
+		switch (ch) {
+		case 'M':
+			ig->meta = 1;
+			break;
+		case 'm':
+			ig->mt = optarg;
+			break;
+		case 'v':
+			v_arg = 1;
+			break;
+		case 'h':
+			usage_ingest_tar(a0, a00, NULL);
+			exit(1);
+		default:
+			usage_ingest_tar(a0, a00, "Unknown option error.");
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		usage_ingest_tar(a0, a00, "The archive is read from stdin");
+		exit(1);
+	}
+	if (Config_Find(aa->cfg, "resource.mime-types", ig->mt,
+	    &ig->validator)) {
+		fprintf(stderr, "Illegal mime-type for resource\n");
+		exit(1);
+	}
+	if (ig->meta && Config_Find(aa->cfg, "metadata.mime-types",
+	    STOW_META, NULL)) {
+		fprintf(stderr, "Config doesn't allow %s for metadata\n",
+		    STOW_META);
+		exit(1);
+	}
+
+	ig->out = VSB_new_auto();
+	AN(ig->out);
+	ig->path = VSB_new_auto();
+	AN(ig->path);
+	ig->next_path = VSB_new_auto();
+	AN(ig->next_path);
+	ig->next_size = ig->next_mtime = -1;
+	ig->ibuf = malloc(INGEST_SMALL + 1);
+	AN(ig->ibuf);
+
+	if (ingest_read(ig, hd, 6))
+		i = -1;
+	else if (!memcmp(hd, "070701", 6) || !memcmp(hd, "070702", 6) ||
+	    !memcmp(hd, "070707", 6))
+		i = ingest_cpio(ig, hd);
+	else if (ingest_read(ig, hd + 6, TAR_BLOCK - 6))
+		i = -1;
+	else
+		i = ingest_tar(ig, (uint8_t *)hd);
+
+	/* Keep what we have, even if the input went bad */
+	Wsilo_BatchDone(ig->aa, &ig->sl, ig->out);
+	Commit_Flush(aa);
+	Wsilo_Print(ig->out);
+	if (i)
+		ig->retval = 1;
+	else
+		while (read(ig->fd, ig->ibuf, INGEST_SMALL) > 0)
+			continue;
+
+	if (v_arg) {
+		vsb = VSB_new_auto();
+		AN(vsb);
+		VSB_printf(vsb, "Members: %ju\n", ig->nmember);
+		Commit_Report(aa, vsb);
+		AZ(VSB_finish(vsb));
+		fprintf(stderr, "%s", VSB_data(vsb));
+		VSB_destroy(&vsb);
+	}
+
+	REPLACE(ig->ibuf, NULL);
+	VSB_destroy(&ig->next_path);
+	VSB_destroy(&ig->path);
+	VSB_destroy(&ig->out);
+	return (ig->retval);
+}
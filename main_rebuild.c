@@ -58,7 +58,7 @@ struct rebuild {
 	int				state;
 	intmax_t			rlen;
 	off_t				body_start;
-	z_stream			zs[1];
+	z_stream			*zs;
 	unsigned char			obuf[128 * 1024];
 	struct SHA256Context		sha256[1];
 	struct header			*h;
@@ -118,7 +118,8 @@ rebuild_process(struct rebuild *rb, const unsigned char *ptr, ssize_t len)
 			rb->hdrlen = 0;
 			rb->body_start = lseek(rb->fdo, 0, SEEK_CUR);
 
-			Gzip_InitDeflate(rb->zs);
+			AZ(rb->zs);
+			rb->zs = Gzip_GetDeflate(AA_COMPRESSION);
 			Gzip_AddAa(rb->zs);
 
 			rb->state = 10;
@@ -163,7 +164,8 @@ rebuild_process(struct rebuild *rb, const unsigned char *ptr, ssize_t len)
 			rb->hdrlen = 0;
 
 			rb->body_start = lseek(rb->fdo, 0, SEEK_CUR);
-			Gzip_InitDeflate(rb->zs);
+			AZ(rb->zs);
+			rb->zs = Gzip_GetDeflate(AA_COMPRESSION);
 			Gzip_AddAa(rb->zs);
 			rb->zs->avail_in = rb->clen;
 			rb->zs->next_in = rb->fixbuf;
@@ -204,7 +206,7 @@ rebuild_process(struct rebuild *rb, const unsigned char *ptr, ssize_t len)
 				rb->state = 10;
 				continue;
 			}
-			assert(deflateEnd(rb->zs) == Z_OK);
+			Gzip_Put(&rb->zs);
 			ll = lseek(rb->fdo, 0, SEEK_CUR);
 			(void)lseek(rb->fdo, rb->body_start, SEEK_SET);
 			Gzip_WriteAa(rb->fdo, ll - rb->body_start);
@@ -235,7 +237,7 @@ static int v_matchproto_(byte_iter_f)
 rebuild_silo_iter(void *priv, const void *fn, ssize_t silono)
 {
 	struct rebuild	*rb;
-	z_stream	zs[1];
+	z_stream	*zs;
 	int		ps = getpagesize();
 	unsigned char	ibuf[ps * 16];
 	unsigned char	obuf[ps * 16];
@@ -259,10 +261,8 @@ rebuild_silo_iter(void *priv, const void *fn, ssize_t silono)
 	rb->fdo = open(VSB_data(rb->vsb), O_RDWR | O_CREAT | O_TRUNC, 0600);
 	assert(rb->fdo >= 0);
 
-	memset(zs, 0, sizeof zs);
+	zs = Gzip_GetInflate(15 + 32);
 	zs->next_in = (void*)ibuf;
-	i = inflateInit2(zs, 15 + 32);
-	assert(i == Z_OK);
 
 	do {
 		zs->next_out = (void*)obuf;
@@ -279,11 +279,11 @@ rebuild_silo_iter(void *priv, const void *fn, ssize_t silono)
 		obuf[oz] = '\0';
 		rebuild_process(rb, obuf, oz);
 		if (i == Z_STREAM_END) {
-			assert(inflateEnd(zs) == Z_OK);
-			i = inflateInit2(zs, 15 + 32);
+			i = inflateReset(zs);
 			assert(i == Z_OK);
 		}
 	} while (i == Z_OK);
+	Gzip_Put(&zs);
 
 	AZ(close(rb->fdo));
 
@@ -37,6 +37,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/endian.h>
+
 #include "vdef.h"
 
 #include "vas.h"
@@ -48,6 +50,7 @@ struct seg {
 	unsigned		magic;
 #define SEG_MAGIC		0x0753a4c0
 	char			*id;
+	struct idx_key		key;
 	uint32_t		flg;
 	char			*parent;
 	ssize_t			silono;
@@ -119,20 +122,24 @@ try_seg(const struct aardwarc *aa, struct seg *seg)
 		emit_seg(aa, seg2, seg);
 }
 
-static int v_matchproto_(idx_iter_f)
-reindex_iter(void *priv, const char *key,
-    uint32_t flag, uint32_t silo, int64_t offset, const char *cont)
+static int v_matchproto_(idx_iter_bin_f)
+reindex_iter(void *priv, const struct idx_key *key,
+    uint32_t flag, uint32_t silo, int64_t offset, uint32_t cont)
 {
 	struct seg *seg, *seg2;
+	uint8_t c[4];
+	char hcont[9];
 
 	(void)silo;
 	(void)offset;
 	if (!(flag & IDX_F_SEGMENTED))
 		return(0);
 	VTAILQ_FOREACH_SAFE(seg, &segs, list, seg2) {
-		if (!strncmp(key, seg->id, 16)) {
+		if (!memcmp(key->b, seg->key.b, 8)) {
+			be32enc(c, cont);
+			IDX_Hex(hcont, c, sizeof c);
 			IDX_Insert(priv, seg->id, seg->flg, seg->silono,
-			    seg->off, cont);
+			    seg->off, hcont);
 			seg->done++;
 			drop_seg(seg);
 		}
@@ -171,6 +178,7 @@ got_seg(const struct aardwarc *aa, const struct header *hdr,
 	AN(seg);
 	nsegs++;
 	REPLACE(seg->id, id);
+	assert(IDX_Unhex(seg->key.b, sizeof seg->key.b, id) >= 0);
 	REPLACE(seg->parent, parent);
 	seg->flg = flg;
 	seg->off = off;
@@ -300,7 +308,7 @@ main_reindex(const char *a0, struct aardwarc *aa, int argc, char **argv)
 		retval |= silo_iter(aa, *argv++, -1);
 	if (nsegs > 0) {
 		printf("Rematch (%u)\n", nsegs);
-		(void)IDX_Iter(aa, NULL, reindex_iter, aa);
+		(void)IDX_IterBin(aa, NULL, 0, reindex_iter, aa);
 	}
 	if (nsegs > 0) {
 		printf("Leftovers\n");
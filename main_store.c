@@ -27,12 +27,20 @@
  *
  */
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sha256.h>
 
 #include "vdef.h"
 
@@ -74,6 +82,428 @@ mime_type(struct aardwarc *aa, const char *wt, const char *mt)
 	return (i);
 }
 
+/*
+ * Hash a regular file before we compress it, so that we can skip all
+ * the work if we have it already.  We pick up where the first read()
+ * left off, which need not be 'len' into the file if we inherited it
+ * already positioned, and pread(2) so the position stays there.
+ *
+ * Returns NULL if the file cannot be read, errno says why.
+ */
+
+static char *
+store_prehash(int fd, const char *buf, ssize_t len)
+{
+	struct SHA256Context sha256[1];
+	char tbuf[128 * 1024];
+	ssize_t rlen;
+	off_t o;
+	char *dig;
+
+	o = lseek(fd, 0, SEEK_CUR);
+	if (o < 0)
+		return (NULL);
+	SHA256_Init(sha256);
+	SHA256_Update(sha256, buf, len);
+	while (1) {
+		rlen = pread(fd, tbuf, sizeof tbuf, o);
+		if (rlen < 0)
+			return (NULL);
+		if (rlen == 0)
+			break;
+		SHA256_Update(sha256, tbuf, rlen);
+		o += rlen;
+	}
+	dig = SHA256_End(sha256, NULL);
+	AN(dig);
+	return (dig);
+}
+
+/*
+ * Read-ahead
+ * ----------
+ *
+ * A thread reads the input into a ring of buffers, so that a slow pipe
+ * or disk does not have to wait for the compression, and vice versa.
+ */
+
+#define STORE_RA_BUFS	4
+
+struct store_ra {
+	unsigned		magic;
+#define STORE_RA_MAGIC		0x5d02c7e1
+	int			fd;
+	pthread_t		thr;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	size_t			bufsize;
+	char			*buf[STORE_RA_BUFS];
+	ssize_t			len[STORE_RA_BUFS];
+	unsigned		head;
+	unsigned		tail;
+	int			eof;
+	int			err;
+};
+
+static void *
+store_ra_thread(void *priv)
+{
+	struct store_ra *ra;
+	ssize_t rlen;
+	unsigned n;
+
+	CAST_OBJ_NOTNULL(ra, priv, STORE_RA_MAGIC);
+	while (1) {
+		AZ(pthread_mutex_lock(&ra->mtx));
+		while (ra->head - ra->tail == STORE_RA_BUFS)
+			AZ(pthread_cond_wait(&ra->cond, &ra->mtx));
+		n = ra->head % STORE_RA_BUFS;
+		AZ(pthread_mutex_unlock(&ra->mtx));
+
+		rlen = read(ra->fd, ra->buf[n], ra->bufsize);
+
+		AZ(pthread_mutex_lock(&ra->mtx));
+		if (rlen <= 0) {
+			ra->eof = 1;
+			ra->err = rlen < 0 ? errno : 0;
+		} else {
+			ra->len[n] = rlen;
+			ra->head++;
+		}
+		AZ(pthread_cond_broadcast(&ra->cond));
+		AZ(pthread_mutex_unlock(&ra->mtx));
+		if (rlen <= 0)
+			break;
+	}
+	return (NULL);
+}
+
+static struct store_ra *
+store_ra_new(int fd, size_t bufsize)
+{
+	struct store_ra *ra;
+	unsigned u;
+
+	ALLOC_OBJ(ra, STORE_RA_MAGIC);
+	AN(ra);
+	ra->fd = fd;
+	ra->bufsize = bufsize;
+	for (u = 0; u < STORE_RA_BUFS; u++) {
+		ra->buf[u] = malloc(bufsize);
+		AN(ra->buf[u]);
+	}
+	AZ(pthread_mutex_init(&ra->mtx, NULL));
+	AZ(pthread_cond_init(&ra->cond, NULL));
+	AZ(pthread_create(&ra->thr, NULL, store_ra_thread, ra));
+	return (ra);
+}
+
+/* Wait for the next buffer, returns zero at EOF, -1 on error */
+
+static ssize_t
+store_ra_get(struct store_ra *ra, const char **ptr)
+{
+	ssize_t rlen;
+
+	CHECK_OBJ_NOTNULL(ra, STORE_RA_MAGIC);
+	AN(ptr);
+	AZ(pthread_mutex_lock(&ra->mtx));
+	while (ra->tail == ra->head && !ra->eof)
+		AZ(pthread_cond_wait(&ra->cond, &ra->mtx));
+	if (ra->tail != ra->head) {
+		*ptr = ra->buf[ra->tail % STORE_RA_BUFS];
+		rlen = ra->len[ra->tail % STORE_RA_BUFS];
+	} else if (ra->err) {
+		errno = ra->err;
+		rlen = -1;
+	} else {
+		rlen = 0;
+	}
+	AZ(pthread_mutex_unlock(&ra->mtx));
+	return (rlen);
+}
+
+/* Done with the buffer from store_ra_get() */
+
+static void
+store_ra_release(struct store_ra *ra)
+{
+
+	CHECK_OBJ_NOTNULL(ra, STORE_RA_MAGIC);
+	AZ(pthread_mutex_lock(&ra->mtx));
+	assert(ra->tail != ra->head);
+	ra->tail++;
+	AZ(pthread_cond_broadcast(&ra->cond));
+	AZ(pthread_mutex_unlock(&ra->mtx));
+}
+
+static void
+store_ra_destroy(struct store_ra **rap)
+{
+	struct store_ra *ra;
+	unsigned u;
+
+	TAKE_OBJ_NOTNULL(ra, rap, STORE_RA_MAGIC);
+	AN(ra->eof);
+	AZ(pthread_join(ra->thr, NULL));
+	AZ(pthread_cond_destroy(&ra->cond));
+	AZ(pthread_mutex_destroy(&ra->mtx));
+	for (u = 0; u < STORE_RA_BUFS; u++)
+		free(ra->buf[u]);
+	FREE_OBJ(ra);
+}
+
+/*
+ * Batch mode
+ * ----------
+ *
+ * Store every file named in a list, one per line, packing the small
+ * ones into batch silos (see Wsilo_Batch()) so that the cost per object
+ * is the compression and not the filesystem metadata operations.
+ *
+ * The IDs are not printed until the batch they are in is committed and
+ * synced to disk, see commit.c.
+ */
+
+struct store_batch {
+	unsigned		magic;
+#define STORE_BATCH_MAGIC	0x1e5b7a0c
+	struct aardwarc		*aa;
+	const char		*wt;
+	const char		*mt;
+	struct wsilo		*sl;
+	struct vsb		*out;
+	char			*ibuf;
+	size_t			ibuf_len;
+	int			retval;
+};
+
+static void
+store_batch_file(struct store_batch *sb, const char *fn)
+{
+	struct header *hdr;
+	struct segjob *sj;
+	struct validator *vl = NULL;
+	struct stat st;
+	struct vsb *vsb;
+	char ident[SHA256_DIGEST_STRING_LENGTH];
+	char *dig, *xid = NULL, *id;
+	ssize_t rlen;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", fn, strerror(errno));
+		sb->retval = 1;
+		return;
+	}
+	AZ(fstat(fd, &st));
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		fprintf(stderr, "Skipping %s: %s\n", fn,
+		    S_ISREG(st.st_mode) ? "Input file empty" :
+		    "Not a regular file");
+		AZ(close(fd));
+		sb->retval = 1;
+		return;
+	}
+
+	hdr = Wsilo_NewHeader(sb->aa, sb->wt, sb->mt);
+
+	dig = store_prehash(fd, NULL, 0);
+	if (dig == NULL) {
+		fprintf(stderr, "Cannot read %s: %s\n", fn, strerror(errno));
+		sb->retval = 1;
+		goto done;
+	}
+	Ident_Create(sb->aa, hdr, dig, ident);
+	REPLACE(dig, NULL);
+	xid = Digest2Ident(sb->aa, ident);
+
+	if (Wsilo_Have(sb->aa, sb->sl, ident)) {
+		VSB_printf(sb->out, "%s %s\n", xid, fn);
+		goto done;
+	}
+
+	if (sb->sl == NULL || !Wsilo_BatchRoom(sb->sl, st.st_size)) {
+		Wsilo_BatchDone(sb->aa, &sb->sl, sb->out);
+		if (Wsilo_BatchFits(sb->aa, st.st_size))
+			sb->sl = Wsilo_Batch(sb->aa);
+	}
+
+	sj = SegJob_New(sb->aa, hdr, NULL);
+	AN(sj);
+	if (sb->sl != NULL)
+		SegJob_Batch(sj, sb->sl);
+	if (sb->aa->mime_validator != NULL)
+		vl = Validator_New(sb->aa->mime_validator);
+	while (st.st_size > 0) {
+		rlen = read(fd, sb->ibuf,
+		    st.st_size < (off_t)sb->ibuf_len ?
+		    (size_t)st.st_size : sb->ibuf_len);
+		if (rlen < 0) {
+			/* Keep going, the batch so far is good */
+			fprintf(stderr, "Cannot read %s: %s\n",
+			    fn, strerror(errno));
+			vsb = Validator_Verdict(&vl);
+			if (vsb != NULL)
+				VSB_destroy(&vsb);
+			SegJob_Abandon(&sj);
+			sb->retval = 1;
+			goto done;
+		}
+		if (rlen == 0)
+			break;
+		if (vl != NULL)
+			Validator_Feed(vl, sb->ibuf, rlen);
+		SegJob_Feed(sj, sb->ibuf, rlen);
+		st.st_size -= rlen;
+	}
+	vsb = Validator_Verdict(&vl);
+	if (vsb != NULL) {
+		SegJob_Abandon(&sj);
+		fprintf(stderr, "Skipping %s: %s\n", fn, VSB_data(vsb));
+		VSB_destroy(&vsb);
+		sb->retval = 1;
+		goto done;
+	}
+	id = SegJob_Commit(sj);
+	if (strcmp(id, xid)) {
+		fprintf(stderr, "%s changed while being stored\n", fn);
+		sb->retval = 1;
+	}
+
+	VSB_printf(sb->out, "%s %s\n", id, fn);
+	if (sb->sl == NULL)
+		Wsilo_Done(sb->aa, sb->out);
+	REPLACE(id, NULL);
+
+  done:
+	REPLACE(xid, NULL);
+	Header_Destroy(&hdr);
+	AZ(close(fd));
+}
+
+static int
+store_batch(struct aardwarc *aa, const char *wt, const char *mt,
+    const char *list)
+{
+	struct store_batch sb[1];
+	FILE *fi;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t l;
+
+	if (!strcmp(list, "-"))
+		fi = stdin;
+	else
+		fi = fopen(list, "r");
+	if (fi == NULL) {
+		fprintf(stderr, "Cannot open %s: %s\n", list, strerror(errno));
+		exit(1);
+	}
+
+	INIT_OBJ(sb, STORE_BATCH_MAGIC);
+	sb->aa = aa;
+	sb->wt = wt;
+	sb->mt = mt;
+	sb->out = VSB_new_auto();
+	AN(sb->out);
+	sb->ibuf_len = 128 * 1024;
+	sb->ibuf = malloc(sb->ibuf_len);
+	AN(sb->ibuf);
+
+	while ((l = getline(&line, &linecap, fi)) > 0) {
+		if (line[l - 1] == '\n')
+			line[--l] = '\0';
+		if (l == 0)
+			continue;
+		store_batch_file(sb, line);
+	}
+	Wsilo_BatchDone(aa, &sb->sl, sb->out);
+	Commit_Flush(aa);
+	Wsilo_Print(sb->out);
+
+	free(line);
+	REPLACE(sb->ibuf, NULL);
+	VSB_destroy(&sb->out);
+	if (fi != stdin)
+		AZ(fclose(fi));
+	return (sb->retval);
+}
+
+/*
+ * Hand the input to a 'stored' daemon, see main_stored.c, which saves
+ * us setting up silos and syncing them all by ourselves.
+ */
+
+static int
+store_daemon(const char *addr, const char *mt, int fd)
+{
+	struct sockaddr_un sun;
+	char buf[128 * 1024];
+	unsigned cmd, len;
+	ssize_t rlen;
+	size_t l;
+	int sfd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(addr) >= sizeof sun.sun_path) {
+		fprintf(stderr, "Socket path too long: %s\n", addr);
+		return (1);
+	}
+	bstrcpy(sun.sun_path, addr);
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0 || connect(sfd, (const void *)&sun, sizeof sun)) {
+		fprintf(stderr, "Cannot connect to %s: %s\n",
+		    addr, strerror(errno));
+		return (1);
+	}
+	/* If the daemon bails out, we want to hear why */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	proto_out(sfd, PROTO_META, mt, strlen(mt));
+	while ((rlen = read(fd, buf, sizeof buf)) > 0)
+		proto_out(sfd, PROTO_DATA, buf, rlen);
+	if (rlen < 0) {
+		fprintf(stderr, "Input file read error: %s\n", strerror(errno));
+		exit(1);
+	}
+	proto_out(sfd, PROTO_DATA, NULL, 0);
+
+	if (proto_in(sfd, &cmd, &len) != 1 || len >= sizeof buf) {
+		fprintf(stderr, "Lost connection to %s\n", addr);
+		return (1);
+	}
+	for (l = 0; l < len; l += (size_t)rlen) {
+		rlen = read(sfd, buf + l, len - l);
+		if (rlen <= 0) {
+			fprintf(stderr, "Lost connection to %s\n", addr);
+			return (1);
+		}
+	}
+	buf[len] = '\0';
+	closefd(&sfd);
+	if (cmd == PROTO_DATA)
+		printf("%s\n", buf);
+	else
+		fprintf(stderr, "%s\n", buf);
+	return (cmd == PROTO_DATA ? 0 : 1);
+}
+
+static void
+store_report(const struct aardwarc *aa)
+{
+	struct vsb *vsb;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	Commit_Report(aa, vsb);
+	AZ(VSB_finish(vsb));
+	fprintf(stderr, "%s", VSB_data(vsb));
+	VSB_destroy(&vsb);
+}
+
 static
 void
 usage_store(const char *a0, const char *a00, const char *err)
@@ -82,11 +512,17 @@ usage_store(const char *a0, const char *a00, const char *err)
 	fprintf(stderr, "Usage for this operation:\n");
 	fprintf(stderr, "\t%s [global options] %s [options] {filename|-}\n",
 	    a0, a00);
+	fprintf(stderr,
+	    "\t%s [global options] %s [options] -b {listfile|-}\n", a0, a00);
 	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-b List of files to store, one per line\n");
+	fprintf(stderr, "\t-d SHA256 of input (skip if already stored)\n");
 	fprintf(stderr, "\t-i Forced identifier (metadata only)\n");
 	fprintf(stderr, "\t-m mime_type\n");
 	fprintf(stderr, "\t-r WARC-Refers-To: reference (metadata only)\n");
+	fprintf(stderr, "\t-S /socket/path of stored daemon\n");
 	fprintf(stderr, "\t-t {metadata|resource}\n");
+	fprintf(stderr, "\t-v Report commit statistics\n");
 }
 
 int v_matchproto_(main_f)
@@ -99,20 +535,44 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 	struct header *hdr;
 	struct getjob *gj;
 	struct segjob *sj;
+	struct validator *vl = NULL;
 	char *id;
 	const char *a00 = *argv;
 	char *ibuf_ptr;
 	const char *r_arg = NULL;
 	const char *i_arg = NULL;
+	const char *b_arg = NULL;
+	const char *S_arg = NULL;
+	int v_arg = 0;
 	const char *ref = NULL;
 	ssize_t ibuf_len, rlen;
 	struct vsb *vsb;
 	const char *e;
+	char *dig = NULL, *xid = NULL, *q;
+	char ident[SHA256_DIGEST_STRING_LENGTH];
+	struct stat st;
+	struct store_ra *ra;
+	const char *p;
+	int i;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
-	while ((ch = getopt(argc, argv, "hi:m:t:r:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:d:hi:m:t:r:S:v")) != -1) {
 		switch (ch) {
+		case 'b':
+			b_arg = optarg;
+			break;
+		case 'd':
+			if (strlen(optarg) != SHA256_DIGEST_STRING_LENGTH - 1 ||
+			    strspn(optarg, "0123456789abcdefABCDEF") !=
+			    SHA256_DIGEST_STRING_LENGTH - 1) {
+				usage_store(a0, a00, "Illegal -d argument.");
+				exit(1);
+			}
+			REPLACE(dig, optarg);
+			for (q = dig; *q != '\0'; q++)
+				*q = tolower(*q);
+			break;
 		case 'h':
 			usage_store(a0, a00, NULL);
 			exit(1);
@@ -149,6 +609,12 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 			}
 			r_arg = optarg;
 			break;
+		case 'S':
+			S_arg = optarg;
+			break;
+		case 'v':
+			v_arg = 1;
+			break;
 		default:
 			usage_store(a0, a00, "Unknown option error.");
 			exit(1);
@@ -197,6 +663,27 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 			ref = r_arg;
 	}
 
+	if (S_arg != NULL && (wt != WT_RESOURCE || dig != NULL ||
+	    b_arg != NULL || v_arg)) {
+		usage_store(a0, a00, "Daemon (-S) only for resources,"
+		    " without -b, -d or -v");
+		exit(1);
+	}
+
+	if (b_arg != NULL) {
+		if (wt != WT_RESOURCE || dig != NULL || argc != 0) {
+			usage_store(a0, a00, "Batch (-b) only for resources,"
+			    " without -d or filename");
+			exit(1);
+		}
+		if (mime_type(aa, wt, mt))
+			exit(1);
+		i = store_batch(aa, wt, mt, b_arg);
+		if (v_arg)
+			store_report(aa);
+		return (i);
+	}
+
 	/* Figure out the input file ----------------------------------*/
 
 	if (argc == 0) {
@@ -215,6 +702,9 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 		}
 	}
 
+	if (S_arg != NULL)
+		return (store_daemon(S_arg, mt, fd));
+
 	ibuf_len = 128 * 1024;
 	ibuf_ptr = malloc(ibuf_len);
 	AN(ibuf_ptr);
@@ -236,11 +726,7 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 
 	/* Create headers ---------------------------------------------*/
 
-	hdr = Header_New(aa);
-	AN(hdr);
-	Header_Set_Date(hdr);
-	Header_Set(hdr, "Content-Type", "%s", mt);
-	Header_Set(hdr, "WARC-Type", "%s", wt);
+	hdr = Wsilo_NewHeader(aa, wt, mt);
 
 	if (ref != NULL) {
 		assert(wt == WT_METADATA);
@@ -258,18 +744,66 @@ main_store(const char *a0, struct aardwarc *aa, int argc, char **argv)
 		Header_Set(hdr, "WARC-Refers-To", "<%s>", ref);
 	}
 
+	/* Check if we have it already -------------------------------*/
+
+	if (dig == NULL && !fstat(fd, &st) && S_ISREG(st.st_mode))
+		dig = store_prehash(fd, ibuf_ptr, rlen);
+
+	if (dig != NULL) {
+		if (i_arg != NULL) {
+			AZ(IDX_Valid_Id(aa, i_arg, &e));
+			xid = Digest2Ident(aa, e);
+		} else {
+			Ident_Create(aa, hdr, dig, ident);
+			xid = Digest2Ident(aa, ident);
+		}
+		if (Wsilo_Have(aa, NULL, xid)) {
+			fprintf(stderr, "ID %s already in archive\n", xid);
+			printf("%s\n", xid);
+			return (0);
+		}
+	}
+
 	sj = SegJob_New(aa, hdr, i_arg);
 	AN(sj);
 
+	if (aa->mime_validator != NULL)
+		vl = Validator_New(aa->mime_validator);
+
+	ra = store_ra_new(fd, ibuf_len);
+	if (vl != NULL)
+		Validator_Feed(vl, ibuf_ptr, rlen);
 	SegJob_Feed(sj, ibuf_ptr, rlen);
-	do {
-		rlen = read(fd, ibuf_ptr, ibuf_len);
-		if (rlen > 0)
-			SegJob_Feed(sj, ibuf_ptr, rlen);
-	} while (rlen > 0);
+	while ((rlen = store_ra_get(ra, &p)) > 0) {
+		if (vl != NULL)
+			Validator_Feed(vl, p, rlen);
+		SegJob_Feed(sj, p, rlen);
+		store_ra_release(ra);
+	}
+	if (rlen < 0) {
+		fprintf(stderr, "Input file read error: %s\n", strerror(errno));
+		exit(1);
+	}
+	store_ra_destroy(&ra);
+
+	vsb = Validator_Verdict(&vl);
+	if (vsb != NULL) {
+		SegJob_Abandon(&sj);
+		fprintf(stderr, "%s\n", VSB_data(vsb));
+		exit(1);
+	}
 
 	id = SegJob_Commit(sj);
+	(void)Commit_Done(aa);
+	Commit_Flush(aa);
 	printf("%s\n", id);
+	if (v_arg)
+		store_report(aa);
+
+	if (xid != NULL && strcmp(id, xid)) {
+		fprintf(stderr, "Input does not match digest (-d)\n");
+		exit(1);
+	}
 
 	REPLACE(ibuf_ptr, NULL);
 	Header_Destroy(&hdr);
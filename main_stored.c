@@ -0,0 +1,886 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * A store daemon
+ *
+ * Clients connect to a local socket and upload objects using the same
+ * framing as the stow/stevedore protocol (see proto.c):
+ *
+ *	PROTO_META	Content-Type (optional, before any data)
+ *	PROTO_DATA	The body, in any number of frames
+ *	PROTO_DATA	Zero length, end of object
+ *
+ * and get the ID back in a PROTO_DATA frame once the object is safely
+ * stored, or the reason why not in a PROTO_MSG frame.  A connection
+ * can carry any number of objects, one after the other.
+ *
+ * As in main_httpd.c, a poller thread owns the listening socket and
+ * the idle connections, and reads the frames of small objects as they
+ * arrive, without blocking.  Only once it has all of an object, or the
+ * start of one too big to hold on to, is the connection handed to a
+ * pool of worker threads.
+ *
+ * Each worker keeps a batch silo (see Wsilo_Batch()) open, and appends
+ * the small objects it is handed to it.  The clients are not answered
+ * until the batch is committed, which happens when the worker runs out
+ * of connections to serve, when the batch is full, or when the oldest
+ * object in it has waited for the batch window (-w).  The workers
+ * share the group commit (see commit.c), so that under load many
+ * batches go to disk on the same fsync(2).
+ *
+ * Two clients may upload the same object to two workers at the same
+ * time.  Neither GetJob_New() nor the other worker's batch can tell
+ * us, so each worker claims the IDs in its open batch, and an upload
+ * of a claimed ID waits for the batch of the worker holding the claim.
+ * Claims are only released once the index records have been handed to
+ * the group commit, where GetJob_New() will find them.
+ *
+ * Objects too big for a batch are streamed into silos of their own as
+ * they arrive, exactly as 'store' would.  That blocks the worker on the
+ * client, so it commits its batch first.
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sha256.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+#define STORED_SMALL		(1024 * 1024)
+#define STORED_TIMEOUT		30	/* seconds */
+#define STORED_NCLAIM		256	/* hash buckets */
+
+struct sworker;
+
+struct sclaim {
+	unsigned		magic;
+#define SCLAIM_MAGIC		0x58d3a0e7
+	struct sworker		*wrk;
+	char			ident[SHA256_DIGEST_STRING_LENGTH];
+	VTAILQ_ENTRY(sclaim)	hlist;
+	VTAILQ_ENTRY(sclaim)	wlist;
+};
+
+VTAILQ_HEAD(sclaimhead, sclaim);
+
+struct sconn {
+	unsigned		magic;
+#define SCONN_MAGIC		0x6c0e92d5
+	int			fd;
+	time_t			t_idle;
+	char			*id;
+	VTAILQ_ENTRY(sconn)	list;
+
+	/* The object being received, see stored_rx() */
+	uint8_t			fhd[5];
+	unsigned		fhdlen;
+	unsigned		fleft;		// Of the current frame
+	char			*fdst;
+	int			data;		// Data frame seen
+	int			big;		// fleft is for the worker
+	const char		*err;
+	char			mt[256];
+	char			*buf;
+	size_t			len;
+	size_t			space;
+};
+
+VTAILQ_HEAD(sconnhead, sconn);
+
+struct stored {
+	unsigned		magic;
+#define STORED_MAGIC		0x3a81f4b6
+	struct aardwarc		*aa;
+	int			listen_fd;
+	int			wake[2];
+	double			window;
+
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	struct sconnhead	ready;		// Waiting for a worker
+	struct sconnhead	back;		// Returned by a worker
+
+	/* Only touched by the poller thread */
+	struct sconnhead	idle;
+	unsigned		nidle;
+
+	/* IDs in the open batches, also protects sworker->pending */
+	pthread_mutex_t		claim_mtx;
+	struct sclaimhead	claims[STORED_NCLAIM];
+};
+
+struct sworker {
+	unsigned		magic;
+#define SWORKER_MAGIC		0x1f57ce08
+	struct stored		*sd;
+	struct wsilo		*sl;
+	double			t_first;
+	struct sconnhead	pending;	// Waiting for the batch
+	struct sclaimhead	claims;		// In the batch
+
+	char			*ibuf;
+	const char		*validator;	// Of the current object
+};
+
+static double
+stored_now(void)
+{
+	struct timespec ts;
+
+	AZ(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+/*--------------------------------------------------------------------*/
+
+/* Ready for the next object */
+
+static void
+stored_rx_reset(struct sconn *cp)
+{
+
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	cp->fhdlen = 0;
+	cp->fleft = 0;
+	cp->fdst = NULL;
+	cp->data = 0;
+	cp->big = 0;
+	cp->err = NULL;
+	bstrcpy(cp->mt, "application/octet-stream");
+	REPLACE(cp->buf, NULL);
+	cp->len = cp->space = 0;
+}
+
+static void
+stored_close(struct sconn *cp)
+{
+
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	closefd(&cp->fd);
+	REPLACE(cp->id, NULL);
+	REPLACE(cp->buf, NULL);
+	FREE_OBJ(cp);
+}
+
+/* Hand the connection back to the poller, for the next object */
+
+static void
+stored_back(struct stored *sd, struct sconn *cp)
+{
+
+	CHECK_OBJ_NOTNULL(sd, STORED_MAGIC);
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	stored_rx_reset(cp);
+	AZ(pthread_mutex_lock(&sd->mtx));
+	VTAILQ_INSERT_TAIL(&sd->back, cp, list);
+	AZ(pthread_mutex_unlock(&sd->mtx));
+	assert(write(sd->wake[1], "", 1) == 1);
+}
+
+static void
+stored_reply(struct stored *sd, struct sconn *cp)
+{
+
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	AN(cp->id);
+	proto_out(cp->fd, PROTO_DATA, cp->id, strlen(cp->id));
+	REPLACE(cp->id, NULL);
+	stored_back(sd, cp);
+}
+
+/* We do not know where in the stream we are, so give up on it */
+
+static void
+stored_error(struct sconn *cp, const char *msg)
+{
+
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	proto_send_msg(cp->fd, "%s", msg);
+	stored_close(cp);
+}
+
+/* Only used for objects too big for the poller to collect */
+
+static int
+stored_read(const struct sconn *cp, void *ptr, size_t len)
+{
+	char *p = ptr;
+	ssize_t i;
+
+	while (len > 0) {
+		i = read(cp->fd, p, len);
+		if (i <= 0)
+			return (-1);
+		p += i;
+		len -= (size_t)i;
+	}
+	return (0);
+}
+
+/* Get the verdict of the validator, if any, and tell the client if bad */
+
+static int
+stored_validated(struct sconn *cp, struct validator **vlp)
+{
+	struct vsb *vsb;
+
+	vsb = Validator_Verdict(vlp);
+	if (vsb == NULL)
+		return (1);
+	if (cp != NULL)
+		stored_error(cp, VSB_data(vsb));
+	VSB_destroy(&vsb);
+	return (0);
+}
+
+/* Wait for everything this worker has committed to be on disk */
+
+static void
+stored_durable(const struct sworker *wrk)
+{
+	uint64_t gen;
+
+	gen = Commit_Done(wrk->sd->aa);
+	if (gen != 0)
+		Commit_Wait(wrk->sd->aa, gen);
+}
+
+static struct sclaimhead *
+stored_claimhead(struct stored *sd, const char *ident)
+{
+	unsigned h = 0;
+
+	for (; *ident != '\0'; ident++)
+		h = h * 33 + (unsigned char)*ident;
+	return (&sd->claims[h % STORED_NCLAIM]);
+}
+
+/*
+ * Wait for the open batch which has this ID, if any, and return true.
+ * Otherwise claim the ID for our own batch, if 'claim'.
+ */
+
+static int
+stored_claim(struct sworker *wrk, struct sconn *cp, const char *ident,
+    char **xid, int claim)
+{
+	struct stored *sd;
+	struct sclaimhead *hp;
+	struct sclaim *sc;
+
+	sd = wrk->sd;
+	hp = stored_claimhead(sd, ident);
+
+	AZ(pthread_mutex_lock(&sd->claim_mtx));
+	VTAILQ_FOREACH(sc, hp, hlist)
+		if (!strcmp(sc->ident, ident))
+			break;
+	if (sc != NULL) {
+		CHECK_OBJ_NOTNULL(sc, SCLAIM_MAGIC);
+		cp->id = *xid;
+		*xid = NULL;
+		VTAILQ_INSERT_TAIL(&sc->wrk->pending, cp, list);
+	} else if (claim) {
+		ALLOC_OBJ(sc, SCLAIM_MAGIC);
+		AN(sc);
+		sc->wrk = wrk;
+		bstrcpy(sc->ident, ident);
+		VTAILQ_INSERT_TAIL(hp, sc, hlist);
+		VTAILQ_INSERT_TAIL(&wrk->claims, sc, wlist);
+		sc = NULL;
+	}
+	AZ(pthread_mutex_unlock(&sd->claim_mtx));
+	return (sc != NULL);
+}
+
+static void
+stored_flush(struct sworker *wrk)
+{
+	struct stored *sd;
+	struct sconnhead done;
+	struct sconn *cp, *cp2;
+	struct sclaim *sc, *sc2;
+
+	CHECK_OBJ_NOTNULL(wrk, SWORKER_MAGIC);
+	if (wrk->sl == NULL)
+		return;
+	sd = wrk->sd;
+	Wsilo_BatchCommit(&wrk->sl);
+	stored_durable(wrk);
+
+	VTAILQ_INIT(&done);
+	AZ(pthread_mutex_lock(&sd->claim_mtx));
+	VTAILQ_CONCAT(&done, &wrk->pending, list);
+	VTAILQ_FOREACH_SAFE(sc, &wrk->claims, wlist, sc2) {
+		CHECK_OBJ_NOTNULL(sc, SCLAIM_MAGIC);
+		VTAILQ_REMOVE(stored_claimhead(sd, sc->ident), sc, hlist);
+		VTAILQ_REMOVE(&wrk->claims, sc, wlist);
+		FREE_OBJ(sc);
+	}
+	AZ(pthread_mutex_unlock(&sd->claim_mtx));
+
+	VTAILQ_FOREACH_SAFE(cp, &done, list, cp2) {
+		VTAILQ_REMOVE(&done, cp, list);
+		stored_reply(sd, cp);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * An object which goes into a silo of its own, 'len' is the size of
+ * the first unread data frame, if 'more'.
+ */
+
+static void
+stored_single(struct sworker *wrk, struct sconn *cp, const struct header *hdr,
+    unsigned len, int more)
+{
+	struct segjob *sj;
+	struct validator *vl = NULL;
+	unsigned cmd;
+	size_t l;
+
+	/* Do not keep the batch waiting for us, or the client */
+	stored_flush(wrk);
+
+	sj = SegJob_New(wrk->sd->aa, hdr, NULL);
+	AN(sj);
+	if (wrk->validator != NULL)
+		vl = Validator_New(wrk->validator);
+	if (cp->len > 0) {
+		if (vl != NULL)
+			Validator_Feed(vl, cp->buf, cp->len);
+		SegJob_Feed(sj, cp->buf, cp->len);
+	}
+	while (more && len > 0) {
+		l = len < STORED_SMALL ? len : STORED_SMALL;
+		if (stored_read(cp, wrk->ibuf, l)) {
+			(void)stored_validated(NULL, &vl);
+			SegJob_Abandon(&sj);
+			stored_close(cp);
+			return;
+		}
+		if (vl != NULL)
+			Validator_Feed(vl, wrk->ibuf, l);
+		SegJob_Feed(sj, wrk->ibuf, l);
+		len -= l;
+		if (len == 0 && (proto_in(cp->fd, &cmd, &len) != 1 ||
+		    cmd != PROTO_DATA)) {
+			(void)stored_validated(NULL, &vl);
+			SegJob_Abandon(&sj);
+			stored_error(cp, "Expected data");
+			return;
+		}
+	}
+	if (!stored_validated(cp, &vl)) {
+		SegJob_Abandon(&sj);
+		return;
+	}
+	cp->id = SegJob_Commit(sj);
+	stored_durable(wrk);
+	stored_reply(wrk->sd, cp);
+}
+
+/* A small object, which we have all of, goes into the batch ----------*/
+
+static void
+stored_batch(struct sworker *wrk, struct sconn *cp, const struct header *hdr)
+{
+	struct aardwarc *aa;
+	struct segjob *sj;
+	struct validator *vl = NULL;
+	char ident[SHA256_DIGEST_STRING_LENGTH];
+	char *dig, *xid;
+
+	aa = wrk->sd->aa;
+	if (!Wsilo_BatchFits(aa, cp->len)) {
+		stored_single(wrk, cp, hdr, 0, 0);
+		return;
+	}
+
+	dig = SHA256_Data(cp->buf, cp->len, NULL);
+	AN(dig);
+	Ident_Create(aa, hdr, dig, ident);
+	REPLACE(dig, NULL);
+	xid = Digest2Ident(aa, ident);
+
+	if (stored_claim(wrk, cp, ident, &xid, 0))
+		return;
+	if (Wsilo_Have(aa, NULL, xid)) {
+		cp->id = xid;
+		stored_reply(wrk->sd, cp);
+		return;
+	}
+
+	/* We have all of it, so the verdict comes before the claim */
+	if (wrk->validator != NULL) {
+		vl = Validator_New(wrk->validator);
+		Validator_Feed(vl, cp->buf, cp->len);
+	}
+	if (!stored_validated(cp, &vl)) {
+		REPLACE(xid, NULL);
+		return;
+	}
+	if (wrk->sl != NULL && !Wsilo_BatchRoom(wrk->sl, cp->len))
+		stored_flush(wrk);
+	if (stored_claim(wrk, cp, ident, &xid, 1))
+		return;
+	REPLACE(xid, NULL);
+
+	if (wrk->sl == NULL) {
+		wrk->sl = Wsilo_Batch(aa);
+		wrk->t_first = stored_now();
+	}
+	sj = SegJob_New(aa, hdr, NULL);
+	AN(sj);
+	SegJob_Batch(sj, wrk->sl);
+	SegJob_Feed(sj, cp->buf, cp->len);
+	cp->id = SegJob_Commit(sj);
+	AZ(pthread_mutex_lock(&wrk->sd->claim_mtx));
+	VTAILQ_INSERT_TAIL(&wrk->pending, cp, list);
+	AZ(pthread_mutex_unlock(&wrk->sd->claim_mtx));
+}
+
+/* The poller has received an object, or the start of one -------------*/
+
+static void
+stored_object(struct sworker *wrk, struct sconn *cp)
+{
+	struct header *hdr;
+	const char *p;
+
+	CHECK_OBJ_NOTNULL(wrk, SWORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+
+	if (cp->err != NULL) {
+		stored_error(cp, cp->err);
+		return;
+	}
+	if (Config_Find(wrk->sd->aa->cfg, "resource.mime-types", cp->mt, &p)) {
+		stored_error(cp, "Illegal mime-type");
+		return;
+	}
+	if (!cp->big && cp->len == 0) {
+		stored_error(cp, "Input empty");
+		return;
+	}
+	wrk->validator = p;
+	hdr = Wsilo_NewHeader(wrk->sd->aa, "resource", cp->mt);
+	if (cp->big)
+		stored_single(wrk, cp, hdr, cp->fleft, 1);
+	else
+		stored_batch(wrk, cp, hdr);
+	Header_Destroy(&hdr);
+}
+
+static void *
+stored_worker(void *priv)
+{
+	struct stored *sd;
+	struct sworker *wrk;
+	struct sconn *cp;
+
+	CAST_OBJ_NOTNULL(sd, priv, STORED_MAGIC);
+	ALLOC_OBJ(wrk, SWORKER_MAGIC);
+	AN(wrk);
+	wrk->sd = sd;
+	VTAILQ_INIT(&wrk->pending);
+	VTAILQ_INIT(&wrk->claims);
+	wrk->ibuf = malloc(STORED_SMALL);
+	AN(wrk->ibuf);
+
+	while (1) {
+		if (wrk->sl != NULL &&
+		    stored_now() - wrk->t_first >= sd->window)
+			stored_flush(wrk);
+		AZ(pthread_mutex_lock(&sd->mtx));
+		if (wrk->sl != NULL && VTAILQ_EMPTY(&sd->ready)) {
+			/* Nothing else to do, commit the batch */
+			AZ(pthread_mutex_unlock(&sd->mtx));
+			stored_flush(wrk);
+			continue;
+		}
+		while (VTAILQ_EMPTY(&sd->ready))
+			AZ(pthread_cond_wait(&sd->cond, &sd->mtx));
+		cp = VTAILQ_FIRST(&sd->ready);
+		VTAILQ_REMOVE(&sd->ready, cp, list);
+		AZ(pthread_mutex_unlock(&sd->mtx));
+		stored_object(wrk, cp);
+	}
+	NEEDLESS(return (NULL));
+}
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * The poller found the connection readable, take what is there, but
+ * never beyond the current frame, so that the rest of a big object is
+ * left in the socket for the worker.
+ *
+ * Returns -1 on EOF/error, 1 if a worker has something to do and zero
+ * if we need more.
+ */
+
+static int
+stored_rxerr(ssize_t i)
+{
+
+	if (i < 0 && (errno == EAGAIN || errno == EINTR))
+		return (0);
+	return (-1);
+}
+
+static int
+stored_rx(struct sconn *cp)
+{
+	static const unsigned hdlen[4] = { 1, 1, 2, 5 };
+	unsigned cmd, len, need;
+	ssize_t i;
+
+	CHECK_OBJ_NOTNULL(cp, SCONN_MAGIC);
+	while (1) {
+		if (cp->fleft > 0) {
+			i = recv(cp->fd, cp->fdst, cp->fleft, MSG_DONTWAIT);
+			if (i <= 0)
+				return (stored_rxerr(i));
+			cp->fdst += i;
+			cp->fleft -= i;
+			if (cp->data)
+				cp->len += i;
+			continue;
+		}
+
+		/* The first byte of the frame says how long the header is */
+		need = cp->fhdlen == 0 ? 1 : hdlen[cp->fhd[0] >> 6];
+		if (cp->fhdlen < need) {
+			i = recv(cp->fd, cp->fhd + cp->fhdlen,
+			    need - cp->fhdlen, MSG_DONTWAIT);
+			if (i <= 0)
+				return (stored_rxerr(i));
+			cp->fhdlen += i;
+			continue;
+		}
+		cp->fhdlen = 0;
+		cmd = cp->fhd[0] & 7;
+		switch (cp->fhd[0] >> 6) {
+		case 0:
+			len = 0;
+			break;
+		case 1:
+			len = 32;
+			break;
+		case 2:
+			len = cp->fhd[1];
+			break;
+		default:
+			len = be32dec(cp->fhd + 1);
+			break;
+		}
+
+		if (cmd == PROTO_META && !cp->data && len < sizeof cp->mt) {
+			cp->mt[len] = '\0';
+			cp->fdst = cp->mt;
+			cp->fleft = len;
+			continue;
+		}
+		if (cmd != PROTO_DATA) {
+			cp->err = "Expected data";
+			return (1);
+		}
+		cp->data = 1;
+		if (len == 0)
+			return (1);
+		if (cp->len + len > STORED_SMALL) {
+			cp->big = 1;
+			cp->fleft = len;
+			return (1);
+		}
+		if (cp->len + len > cp->space) {
+			cp->space = cp->len + len;
+			if (cp->space < 2 * cp->len)
+				cp->space = 2 * cp->len;
+			if (cp->space > STORED_SMALL)
+				cp->space = STORED_SMALL;
+			cp->buf = realloc(cp->buf, cp->space);
+			AN(cp->buf);
+		}
+		cp->fdst = cp->buf + cp->len;
+		cp->fleft = len;
+	}
+}
+
+static void
+stored_accept(struct stored *sd, time_t now)
+{
+	struct sconn *cp;
+	struct timeval tv;
+	int fd;
+
+	fd = accept(sd->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	/*
+	 * BSD sockets inherit O_NONBLOCK from the listen socket.  The
+	 * workers read and write blocking, the poller reads with
+	 * MSG_DONTWAIT.
+	 */
+	AZ(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK));
+	memset(&tv, 0, sizeof tv);
+	tv.tv_sec = STORED_TIMEOUT;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	ALLOC_OBJ(cp, SCONN_MAGIC);
+	AN(cp);
+	cp->fd = fd;
+	cp->t_idle = now;
+	stored_rx_reset(cp);
+	VTAILQ_INSERT_TAIL(&sd->idle, cp, list);
+	sd->nidle++;
+}
+
+static void
+stored_poller(struct stored *sd)
+{
+	struct pollfd *fds = NULL;
+	unsigned nfds = 0, u;
+	struct sconn *cp, *cp2;
+	char buf[64];
+	time_t now;
+	int i;
+
+	CHECK_OBJ_NOTNULL(sd, STORED_MAGIC);
+	now = time(NULL);
+	while (1) {
+		AZ(pthread_mutex_lock(&sd->mtx));
+		while (!VTAILQ_EMPTY(&sd->back)) {
+			cp = VTAILQ_FIRST(&sd->back);
+			VTAILQ_REMOVE(&sd->back, cp, list);
+			cp->t_idle = now;
+			VTAILQ_INSERT_TAIL(&sd->idle, cp, list);
+			sd->nidle++;
+		}
+		AZ(pthread_mutex_unlock(&sd->mtx));
+
+		if (nfds < sd->nidle + 2) {
+			nfds = sd->nidle + 2;
+			fds = realloc(fds, sizeof *fds * nfds);
+			AN(fds);
+		}
+		memset(fds, 0, sizeof *fds * nfds);
+		fds[0].fd = sd->listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = sd->wake[0];
+		fds[1].events = POLLIN;
+		u = 2;
+		VTAILQ_FOREACH(cp, &sd->idle, list) {
+			fds[u].fd = cp->fd;
+			fds[u++].events = POLLIN;
+		}
+		i = poll(fds, u, 1000);
+		if (i < 0 && errno == EINTR)
+			continue;
+		assert(i >= 0);
+		now = time(NULL);
+
+		if (fds[1].revents)
+			(void)read(sd->wake[0], buf, sizeof buf);
+
+		u = 2;
+		VTAILQ_FOREACH_SAFE(cp, &sd->idle, list, cp2) {
+			i = fds[u++].revents;
+			if (i) {
+				i = stored_rx(cp);
+				if (!i)
+					cp->t_idle = now;
+			}
+			if (!i && now - cp->t_idle < STORED_TIMEOUT)
+				continue;
+			VTAILQ_REMOVE(&sd->idle, cp, list);
+			sd->nidle--;
+			if (i <= 0) {
+				stored_close(cp);
+				continue;
+			}
+			AZ(pthread_mutex_lock(&sd->mtx));
+			VTAILQ_INSERT_TAIL(&sd->ready, cp, list);
+			AZ(pthread_cond_signal(&sd->cond));
+			AZ(pthread_mutex_unlock(&sd->mtx));
+		}
+
+		if (fds[0].revents)
+			stored_accept(sd, now);
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static int
+stored_listen(const char *addr)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(addr) >= sizeof sun.sun_path) {
+		fprintf(stderr, "Socket path too long: %s\n", addr);
+		return (-1);
+	}
+	bstrcpy(sun.sun_path, addr);
+	if (!lstat(addr, &st) && S_ISSOCK(st.st_mode))
+		(void)unlink(addr);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 &&
+	    bind(fd, (const void *)&sun, sizeof sun) == 0 &&
+	    listen(fd, 128) == 0)
+		return (fd);
+	fprintf(stderr, "Cannot listen on %s: %s\n", addr, strerror(errno));
+	if (fd >= 0)
+		closefd(&fd);
+	return (-1);
+}
+
+static
+void
+usage_stored(const char *a0, const char *a00, const char *err)
+{
+	usage(a0, err);
+	fprintf(stderr, "Usage for this operation:\n");
+	fprintf(stderr, "\t%s [global options] %s [options] -a /socket/path\n",
+	    a0, a00);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-a /socket/path\n");
+	fprintf(stderr, "\t-n number of worker threads (default: 8)\n");
+	fprintf(stderr, "\t-w batch window in milliseconds (default: 50)\n");
+}
+
+int v_matchproto_(main_f)
+main_stored(const char *a0, struct aardwarc *aa, int argc, char **argv)
+{
+	int ch;
+	const char *a00 = *argv;
+	const char *addr = NULL;
+	struct stored *sd;
+	pthread_t thr;
+	long nworker = 8;
+	long window = 50;
+	unsigned u;
+	char *p;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+
+	while ((ch = getopt(argc, argv, "a:hn:w:")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'h':
+			usage_stored(a0, a00, NULL);
+			exit(1);
+		case 'n':
+			nworker = strtol(optarg, &p, 0);
+			if (*p != '\0' || nworker < 1 || nworker > 1024) {
+				usage_stored(a0, a00, "Illegal -n argument.");
+				exit(1);
+			}
+			break;
+		case 'w':
+			window = strtol(optarg, &p, 0);
+			if (*p != '\0' || window < 0 || window > 60000) {
+				usage_stored(a0, a00, "Illegal -w argument.");
+				exit(1);
+			}
+			break;
+		default:
+			usage_stored(a0, a00, "Unknown option error.");
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0) {
+		usage_stored(a0, a00, "Too many arguments.");
+		exit (1);
+	}
+	if (addr == NULL || *addr != '/') {
+		usage_stored(a0, a00, "Must specify -a /socket/path.");
+		exit (1);
+	}
+
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	ALLOC_OBJ(sd, STORED_MAGIC);
+	AN(sd);
+	sd->aa = aa;
+	sd->window = window * 1e-3;
+	VTAILQ_INIT(&sd->ready);
+	VTAILQ_INIT(&sd->back);
+	VTAILQ_INIT(&sd->idle);
+	AZ(pthread_mutex_init(&sd->mtx, NULL));
+	AZ(pthread_cond_init(&sd->cond, NULL));
+	AZ(pthread_mutex_init(&sd->claim_mtx, NULL));
+	for (u = 0; u < STORED_NCLAIM; u++)
+		VTAILQ_INIT(&sd->claims[u]);
+	AZ(pipe(sd->wake));
+	AZ(fcntl(sd->wake[0], F_SETFL, O_NONBLOCK));
+
+	sd->listen_fd = stored_listen(addr);
+	if (sd->listen_fd < 0)
+		exit(1);
+	AZ(fcntl(sd->listen_fd, F_SETFL, O_NONBLOCK));
+
+	for (; nworker > 0; nworker--) {
+		AZ(pthread_create(&thr, NULL, stored_worker, sd));
+		AZ(pthread_detach(thr));
+	}
+
+	stored_poller(sd);
+	return (0);
+}
@@ -0,0 +1,458 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * A cache of decompressed objects
+ * -------------------------------
+ *
+ * Records never change once written, so the only thing we need to
+ * manage is the space: Every cached object is a file named by its ID,
+ * containing the headers, as GetJob_Headers() produces them, followed
+ * by the uncompressed body.  Hits refresh the mtime, and when the
+ * total size exceeds 'cache.max_size' the oldest files are removed.
+ *
+ * The total is kept in the '_.size' file, eight bytes under flock(2),
+ * so the directories only need to be scanned when it is exceeded.
+ * Files replaced or removed behind our back make it too big, which
+ * the scan puts right.
+ *
+ * Files are created under a temporary name and renamed into place,
+ * so readers never see a partial object.  Temporary files left behind
+ * by a crash are removed once they have not been written to for
+ * OBJCACHE_STALE seconds.
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vdef.h"
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+#define OBJCACHE_STALE		600	/* seconds */
+
+struct objcache {
+	unsigned		magic;
+#define OBJCACHE_MAGIC		0x2b5e8f31
+	struct aardwarc		*aa;
+	int			fd;
+	char			*fn;
+	char			*tmpfn;
+
+	char			*hdrtxt;
+	struct header		*hdr;
+
+	off_t			len;
+	off_t			done;
+	off_t			size;
+	int			failed;
+};
+
+static struct vsb *
+objcache_filename(const struct aardwarc *aa, const char *id)
+{
+	struct vsb *vsb;
+	const char *nid;
+
+	if (aa->objcache_dirname == NULL)
+		return (NULL);
+	if (IDX_Valid_Id(aa, id, &nid) != NULL)
+		return (NULL);
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "%s%c%c/", aa->objcache_dirname,
+	    tolower(nid[0]), tolower(nid[1]));
+	for (; *nid != '\0'; nid++)
+		VSB_putc(vsb, tolower(*nid));
+	AZ(VSB_finish(vsb));
+	return (vsb);
+}
+
+static void
+objcache_destroy(struct objcache **ocp)
+{
+	struct objcache *oc;
+
+	TAKE_OBJ_NOTNULL(oc, ocp, OBJCACHE_MAGIC);
+	if (oc->fd >= 0)
+		closefd(&oc->fd);
+	if (oc->hdr != NULL)
+		Header_Destroy(&oc->hdr);
+	REPLACE(oc->hdrtxt, NULL);
+	REPLACE(oc->tmpfn, NULL);
+	REPLACE(oc->fn, NULL);
+	FREE_OBJ(oc);
+}
+
+/* Lookup -------------------------------------------------------------*/
+
+struct objcache *
+ObjCache_Lookup(struct aardwarc *aa, const char *id)
+{
+	struct objcache *oc;
+	struct vsb *vsb;
+	struct stat st;
+	char buf[16384 + 1];
+	char *p;
+	ssize_t sz;
+	size_t l;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	vsb = objcache_filename(aa, id);
+	if (vsb == NULL)
+		return (NULL);
+
+	ALLOC_OBJ(oc, OBJCACHE_MAGIC);
+	AN(oc);
+	oc->aa = aa;
+	oc->fd = open(VSB_data(vsb), O_RDONLY);
+	VSB_delete(vsb);
+	if (oc->fd < 0) {
+		objcache_destroy(&oc);
+		return (NULL);
+	}
+
+	sz = read(oc->fd, buf, sizeof buf - 1);
+	if (sz <= 0) {
+		objcache_destroy(&oc);
+		return (NULL);
+	}
+	buf[sz] = '\0';
+	p = strstr(buf, "\r\n\r\n");
+	if (p == NULL) {
+		objcache_destroy(&oc);
+		return (NULL);
+	}
+	l = (p + 4) - buf;
+	oc->hdrtxt = malloc(l + 1L);
+	AN(oc->hdrtxt);
+	memcpy(oc->hdrtxt, buf, l);
+	oc->hdrtxt[l] = '\0';
+
+	/* Header_Parse() wants just the header */
+	buf[l] = '\0';
+	oc->hdr = Header_Parse(aa, buf);
+	AN(oc->hdr);
+
+	AZ(fstat(oc->fd, &st));
+	oc->len = st.st_size - l;
+	assert(lseek(oc->fd, l, SEEK_SET) == (off_t)l);
+
+	/* LRU: Remember we used it */
+	(void)futimens(oc->fd, NULL);
+	return (oc);
+}
+
+const struct header *
+ObjCache_Header(const struct objcache *oc)
+{
+
+	CHECK_OBJ_NOTNULL(oc, OBJCACHE_MAGIC);
+	AN(oc->hdr);
+	return (oc->hdr);
+}
+
+const char *
+ObjCache_Headers(const struct objcache *oc)
+{
+
+	CHECK_OBJ_NOTNULL(oc, OBJCACHE_MAGIC);
+	AN(oc->hdrtxt);
+	return (oc->hdrtxt);
+}
+
+off_t
+ObjCache_Length(const struct objcache *oc)
+{
+
+	CHECK_OBJ_NOTNULL(oc, OBJCACHE_MAGIC);
+	return (oc->len);
+}
+
+void
+ObjCache_Iter(const struct objcache *oc, byte_iter_f *func, void *priv)
+{
+	char buf[128 * 1024];
+	ssize_t sz;
+
+	CHECK_OBJ_NOTNULL(oc, OBJCACHE_MAGIC);
+	AN(func);
+	while (1) {
+		sz = read(oc->fd, buf, sizeof buf);
+		assert(sz >= 0);
+		if (sz == 0 || func(priv, buf, sz))
+			break;
+	}
+}
+
+void
+ObjCache_Close(struct objcache **ocp)
+{
+
+	AN(ocp);
+	CHECK_OBJ_NOTNULL(*ocp, OBJCACHE_MAGIC);
+	objcache_destroy(ocp);
+}
+
+/* Remove a temporary file nobody has written to for a long time */
+
+static int
+objcache_reap(const char *fn, const struct stat *st)
+{
+	struct stat st2;
+
+	if (st == NULL) {
+		if (stat(fn, &st2))
+			return (0);
+		st = &st2;
+	}
+	if (time(NULL) - st->st_mtime < OBJCACHE_STALE)
+		return (0);
+	return (!unlink(fn));
+}
+
+/* Insertion ----------------------------------------------------------*/
+
+struct objcache *
+ObjCache_Create(struct aardwarc *aa, const char *id, const char *hdrtxt,
+    off_t len)
+{
+	struct objcache *oc;
+	struct vsb *vsb;
+	char *p;
+	size_t l;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	AN(hdrtxt);
+
+	/* Do not let a single object wipe out the entire cache */
+	if (len > aa->objcache_maxsize / 4)
+		return (NULL);
+
+	vsb = objcache_filename(aa, id);
+	if (vsb == NULL)
+		return (NULL);
+
+	ALLOC_OBJ(oc, OBJCACHE_MAGIC);
+	AN(oc);
+	oc->aa = aa;
+	oc->len = len;
+	REPLACE(oc->fn, VSB_data(vsb));
+	VSB_clear(vsb);
+	VSB_printf(vsb, "%s.tmp.%jd", oc->fn, (intmax_t)getpid());
+	AZ(VSB_finish(vsb));
+	REPLACE(oc->tmpfn, VSB_data(vsb));
+	VSB_delete(vsb);
+
+	(void)mkdir(aa->objcache_dirname, 0755);
+	p = strrchr(oc->fn, '/');
+	AN(p);
+	*p = '\0';
+	(void)mkdir(oc->fn, 0755);
+	*p = '/';
+
+	/* EEXIST means somebody else is already doing it, or died doing it */
+	oc->fd = open(oc->tmpfn, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (oc->fd < 0 && errno == EEXIST && objcache_reap(oc->tmpfn, NULL))
+		oc->fd = open(oc->tmpfn, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (oc->fd < 0) {
+		REPLACE(oc->tmpfn, NULL);
+		objcache_destroy(&oc);
+		return (NULL);
+	}
+	l = strlen(hdrtxt);
+	if (write(oc->fd, hdrtxt, l) != (ssize_t)l)
+		oc->failed = 1;
+	oc->size = l + len;
+	return (oc);
+}
+
+int v_matchproto_(byte_iter_f)
+ObjCache_Fill(void *priv, const void *ptr, ssize_t len)
+{
+	struct objcache *oc;
+
+	CAST_OBJ_NOTNULL(oc, priv, OBJCACHE_MAGIC);
+	if (!oc->failed && write(oc->fd, ptr, len) != len)
+		oc->failed = 1;
+	oc->done += len;
+	return (0);
+}
+
+struct objcache_ent {
+	time_t			mtime;
+	off_t			size;
+	char			*fn;
+};
+
+static int
+objcache_ent_cmp(const void *a, const void *b)
+{
+	const struct objcache_ent *ea = a, *eb = b;
+
+	if (ea->mtime < eb->mtime)
+		return (-1);
+	if (ea->mtime > eb->mtime)
+		return (1);
+	return (0);
+}
+
+/* Returns the total size of what is left */
+
+static off_t
+objcache_evict(const struct aardwarc *aa)
+{
+	struct objcache_ent *ent = NULL;
+	size_t nent = 0, lent = 0, u;
+	off_t total = 0;
+	struct vsb *vsb;
+	struct dirent *de, *de2;
+	struct stat st;
+	DIR *d, *d2;
+
+	d = opendir(aa->objcache_dirname);
+	if (d == NULL)
+		return (0);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	while ((de = readdir(d)) != NULL) {
+		if (strlen(de->d_name) != 2 || *de->d_name == '.')
+			continue;
+		VSB_clear(vsb);
+		VSB_printf(vsb, "%s%s/", aa->objcache_dirname, de->d_name);
+		AZ(VSB_finish(vsb));
+		d2 = opendir(VSB_data(vsb));
+		if (d2 == NULL)
+			continue;
+		while ((de2 = readdir(d2)) != NULL) {
+			if (*de2->d_name == '.')
+				continue;
+			VSB_clear(vsb);
+			VSB_printf(vsb, "%s%s/%s",
+			    aa->objcache_dirname, de->d_name, de2->d_name);
+			AZ(VSB_finish(vsb));
+			if (stat(VSB_data(vsb), &st) || !S_ISREG(st.st_mode))
+				continue;
+			/* Files being created count, but cannot be evicted */
+			if (strstr(de2->d_name, ".tmp.") != NULL) {
+				if (!objcache_reap(VSB_data(vsb), &st))
+					total += st.st_size;
+				continue;
+			}
+			if (nent == lent) {
+				lent += 1024;
+				ent = realloc(ent, lent * sizeof *ent);
+				AN(ent);
+			}
+			ent[nent].mtime = st.st_mtime;
+			ent[nent].size = st.st_size;
+			ent[nent].fn = strdup(VSB_data(vsb));
+			AN(ent[nent].fn);
+			nent++;
+			total += st.st_size;
+		}
+		AZ(closedir(d2));
+	}
+	AZ(closedir(d));
+	VSB_delete(vsb);
+
+	if (total > aa->objcache_maxsize) {
+		/* Leave headroom, so the next scan is some inserts away */
+		qsort(ent, nent, sizeof *ent, objcache_ent_cmp);
+		for (u = 0; u < nent; u++) {
+			if (total <= aa->objcache_maxsize -
+			    aa->objcache_maxsize / 8)
+				break;
+			if (!unlink(ent[u].fn))
+				total -= ent[u].size;
+		}
+	}
+	for (u = 0; u < nent; u++)
+		free(ent[u].fn);
+	free(ent);
+	return (total);
+}
+
+static void
+objcache_account(const struct aardwarc *aa, off_t size)
+{
+	struct vsb *vsb;
+	uint8_t buf[8];
+	off_t total = -1;
+	int fd;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "%s_.size", aa->objcache_dirname);
+	AZ(VSB_finish(vsb));
+	fd = open(VSB_data(vsb), O_RDWR|O_CREAT, 0644);
+	VSB_delete(vsb);
+	if (fd < 0)
+		return;
+	AZ(flock(fd, LOCK_EX));
+	if (pread(fd, buf, sizeof buf, 0) == sizeof buf)
+		total = (off_t)be64dec(buf) + size;
+	/* Unknown the first time */
+	if (total < 0 || total > aa->objcache_maxsize)
+		total = objcache_evict(aa);
+	be64enc(buf, (uint64_t)total);
+	assert(pwrite(fd, buf, sizeof buf, 0) == sizeof buf);
+	AZ(close(fd));
+}
+
+void
+ObjCache_Commit(struct objcache **ocp)
+{
+	struct objcache *oc;
+
+	TAKE_OBJ_NOTNULL(oc, ocp, OBJCACHE_MAGIC);
+	if (oc->done != oc->len)
+		oc->failed = 1;
+	if (close(oc->fd))
+		oc->failed = 1;
+	oc->fd = -1;
+	if (!oc->failed && !rename(oc->tmpfn, oc->fn))
+		objcache_account(oc->aa, oc->size);
+	else
+		(void)unlink(oc->tmpfn);
+	objcache_destroy(&oc);
+}
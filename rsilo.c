@@ -119,6 +119,10 @@ Rsilo_Open(struct aardwarc *aa, const char *fn, uint32_t nsilo, int64_t off)
 		rs = rsilo_open_fn(fn, aa, 0xffffffff);
 	}
 	if (rs != NULL) {
+		/* Starting from the top means we will scan the silo */
+		if (off == 0)
+			(void)posix_fadvise(rs->silo_fd, 0, 0,
+			    POSIX_FADV_SEQUENTIAL);
 		rsilo_seek(rs, off);
 		rs->silo_where = RS_HEAD;
 	}
@@ -161,7 +165,7 @@ Rsilo_Tell(const struct rsilo *rs)
 struct header *
 Rsilo_ReadHeader(struct rsilo *rs)
 {
-	z_stream	zs[1];
+	z_stream	*zs;
 	int		ps = getpagesize();
 	char		ibuf[ps];
 	char		obuf[ps + 1];
@@ -175,13 +179,11 @@ Rsilo_ReadHeader(struct rsilo *rs)
 	if (i == 0)
 		return (NULL);
 
-	memset(zs, 0, sizeof zs);
+	zs = Gzip_GetInflate(15 + 32);
 	zs->next_in = (void*)ibuf;
 	zs->avail_in = i;
 	zs->next_out = (void*)obuf;
 	zs->avail_out = sizeof obuf - 1;
-	i = inflateInit2(zs, 15 + 32);
-	assert(i == Z_OK);
 
 	i = inflate(zs, 0);
 	xxxassert(i == Z_STREAM_END);	// One page is enough for everybody...
@@ -192,8 +194,7 @@ Rsilo_ReadHeader(struct rsilo *rs)
 
 	(void)lseek(rs->silo_fd, -(off_t)zs->avail_in, SEEK_CUR);
 
-	i = inflateEnd(zs);
-	assert(i == Z_OK);
+	Gzip_Put(&zs);
 
 	rs->silo_where = RS_BODY;
 	return (Header_Parse(rs->aa, obuf));
@@ -208,6 +209,36 @@ Rsilo_BodyLen(const struct rsilo *rs)
 	return(rs->silo_bodylen);
 }
 
+/*
+ * Tell the kernel we will be reading the body shortly, so that reads
+ * for multiple segments can be in flight on multiple disks at once.
+ */
+
+void
+Rsilo_Prefetch(const struct rsilo *rs)
+{
+
+	CHECK_OBJ_NOTNULL(rs, RSILO_MAGIC);
+	assert(rs->silo_where == RS_BODY);
+	(void)posix_fadvise(rs->silo_fd, Rsilo_Tell(rs),
+	    rs->silo_bodylen, POSIX_FADV_WILLNEED);
+}
+
+/* Read the last bytes of the gzip'ed body without moving -------------*/
+
+void
+Rsilo_ReadGZTail(const struct rsilo *rs, uint8_t *tail, size_t len)
+{
+	off_t o;
+
+	CHECK_OBJ_NOTNULL(rs, RSILO_MAGIC);
+	AN(tail);
+	assert(rs->silo_where == RS_BODY);
+	assert((int64_t)len <= rs->silo_bodylen);
+	o = Rsilo_Tell(rs) + rs->silo_bodylen - len;
+	assert(pread(rs->silo_fd, tail, len, o) == (ssize_t)len);
+}
+
 void
 Rsilo_NextHeader(struct rsilo *rs)
 {
@@ -259,7 +290,8 @@ Rsilo_ReadGZChunk(struct rsilo *rs, byte_iter_f *func, void *priv)
 uintmax_t
 Rsilo_ReadChunk(struct rsilo *rs, byte_iter_f *func, void *priv)
 {
-	z_stream	zs[1];
+	z_stream	*zs;
+	uintmax_t	ll;
 	int		ps = getpagesize();
 	char		ibuf[ps * 100];
 	char		obuf[ps * 100];
@@ -269,9 +301,7 @@ Rsilo_ReadChunk(struct rsilo *rs, byte_iter_f *func, void *priv)
 	AN(func);
 	assert(rs->silo_where == RS_BODY);
 
-	memset(zs, 0, sizeof zs);
-	i = inflateInit2(zs, 15 + 32);
-	assert(i == Z_OK);
+	zs = Gzip_GetInflate(15 + 32);
 
 	do {
 		if (zs->avail_in == 0) {
@@ -296,11 +326,11 @@ Rsilo_ReadChunk(struct rsilo *rs, byte_iter_f *func, void *priv)
 		(void)lseek(rs->silo_fd, -(off_t)zs->avail_in, SEEK_CUR);
 
 	rs->silo_where = RS_CRLF;
-	i = inflateEnd(zs);
-	assert(i == Z_OK);
+	ll = zs->total_in;
+	Gzip_Put(&zs);
 	if (j != 0)
 		return(0);
-	return(zs->total_in);
+	return(ll);
 }
 
 /* Read a CRNLCRNL separator ------------------------------------------*/
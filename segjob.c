@@ -27,6 +27,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,6 +44,56 @@
 
 #include "aardwarc.h"
 
+/*
+ * Parallel compression
+ * --------------------
+ *
+ * With 'compression.threads' > 1 input is collected into batches of
+ * one block per thread.  The blocks are deflated in parallel, each as a
+ * raw deflate stream primed with the preceeding 32K of input as
+ * dictionary and ending in a Z_SYNC_FLUSH, and the results are simply
+ * concatenated into the silo, in the manner of pigz.
+ *
+ * Because of this the gzip header and trailer are written here, rather
+ * than by zlib, and we keep track of the CRC32 ourselves.
+ *
+ * A batch is only compressed in parallel if the worst case output
+ * fits in the silo with plenty of room to spare, otherwise the blocks
+ * go through the serial steering in SegJob_Feed() which fills the
+ * silo almost exactly.
+ */
+
+#define SEGJOB_BLOCK		(1024 * 1024)
+#define SEGJOB_DICT		(32 * 1024)
+#define SEGJOB_RESERVE		(256 * 1024)
+
+/*
+ * Compression level
+ * -----------------
+ *
+ * The 'compression.level' config section can set the level for a
+ * mime-type, or for all ("*").  Without an entry we start out at
+ * AA_COMPRESSION, but first try to compress a sample of the input at
+ * level one, and if that does not gain much, as with JPEG, MP4 or
+ * already compressed files, we settle for level one or stored blocks.
+ */
+
+#define SEGJOB_PROBE_MIN	1024
+#define SEGJOB_PROBE_MAX	(64 * 1024)
+
+struct segpar {
+	unsigned		magic;
+#define SEGPAR_MAGIC		0x7c1e0a45
+	pthread_t		thr;
+	int			level;
+	const uint8_t		*dict;
+	size_t			dictlen;
+	const uint8_t		*in;
+	uint8_t			*out;
+	size_t			outlen;
+	uint32_t		crc;
+};
+
 /*
  * A segment of an object
  */
@@ -65,19 +116,56 @@ struct segjob {
 	struct aardwarc		*aa;
 	const struct header	*hdr;
 	const char		*ident;
+	struct wsilo		*batch;
 
 	int			nseg;
 	VTAILQ_HEAD(,segment)	segments;
 	struct segment		*cur_seg;
+
+	/*
+	 * For single segment objects the payload digest is the same
+	 * as the segment digest, so we only start a separate payload
+	 * digest, from a snapshot of the first segments context, when
+	 * a second segment is begun.
+	 */
 	struct SHA256Context	sha256_payload[1];
 	struct SHA256Context	sha256_segment[1];
 
 	off_t			size;
 	size_t			obuflen;
-	z_stream		gz[1];
+	z_stream		*gz;
 	int			gz_flag;
+	int			gz_dirty;
+	uint32_t		crc;
+	int			level;
+	int			probe;
+
+	/* Parallel compression */
+	unsigned		npar;
+	struct segpar		*par;
+	size_t			par_bound;
+	uint8_t			*pbuf;
+	size_t			plen;
+	uint8_t			dict[SEGJOB_DICT];
+	unsigned		dictlen;
 };
 
+static void
+segjob_par_fini(struct segjob *sj)
+{
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(sj, SEGJOB_MAGIC);
+	if (sj->par != NULL) {
+		for (u = 0; u < sj->npar; u++)
+			free(sj->par[u].out);
+		free(sj->par);
+		sj->par = NULL;
+	}
+	free(sj->pbuf);
+	sj->pbuf = NULL;
+}
+
 static void
 segjob_destroy(struct segjob *sj)
 {
@@ -87,11 +175,14 @@ segjob_destroy(struct segjob *sj)
 	while (!VTAILQ_EMPTY(&sj->segments)) {
 		sg = VTAILQ_FIRST(&sj->segments);
 		VTAILQ_REMOVE(&sj->segments, sg, list);
-		if (sg->silo != NULL)
+		if (sg->silo != NULL && sg->silo == sj->batch)
+			Wsilo_Rewind(sg->silo);
+		else if (sg->silo != NULL)
 			Wsilo_Abandon(&sg->silo);
 		Header_Destroy(&sg->hdr);
 		FREE_OBJ(sg);
 	}
+	segjob_par_fini(sj);
 	FREE_OBJ(sj);
 }
 
@@ -102,6 +193,8 @@ segjob_newseg(struct segjob *sj)
 	char *digest;
 	int pad = 0;
 	intmax_t im;
+	void *ptr;
+	ssize_t len;
 
 	CHECK_OBJ_NOTNULL(sj, SEGJOB_MAGIC);
 	AZ(sj->cur_seg);
@@ -147,16 +240,26 @@ segjob_newseg(struct segjob *sj)
 
 	REPLACE(digest, NULL);
 
-	sg->silo = Wsilo_Next(sj->aa);
+	if (sj->batch != NULL) {
+		/* The caller promised that the object fits */
+		assert(sg->segno == 1);
+		sg->silo = sj->batch;
+	} else
+		sg->silo = Wsilo_Next(sj->aa);
 	AN(sg->silo);
 	Wsilo_Header(sg->silo, sg->hdr, pad);
+	Wsilo_GetSpace(sg->silo, &ptr, &len);
+	AZ(Wsilo_Store(sg->silo, Gzip_AaHeader(ptr, len)));
 
 	VTAILQ_INSERT_TAIL(&sj->segments, sg, list);
 
 	SHA256_Init(sj->sha256_segment);
-	Gzip_InitDeflate(sj->gz);
+	AZ(sj->gz);
+	sj->gz = Gzip_GetRawDeflate(sj->level);
 	sj->gz_flag = 0;
-	Gzip_AddAa(sj->gz);
+	sj->gz_dirty = 0;
+	sj->crc = crc32(0L, NULL, 0);
+	sj->dictlen = 0;
 	sj->cur_seg = sg;
 }
 
@@ -172,7 +275,10 @@ segjob_finishseg(struct segjob *sj)
 	sj->cur_seg = NULL;
 	CHECK_OBJ_NOTNULL(sg, SEGMENT_MAGIC);
 
-	assert(deflateEnd(sj->gz) == Z_OK);
+	Gzip_Put(&sj->gz);
+	if (sg->segno == 1)
+		memcpy(sj->sha256_payload, sj->sha256_segment,
+		    sizeof sj->sha256_payload);
 	dig = SHA256_End(sj->sha256_segment, NULL);
 	AN(dig);
 	Header_Set(sg->hdr, "WARC-Block-Digest", "sha256:%s", dig);
@@ -182,10 +288,59 @@ segjob_finishseg(struct segjob *sj)
 	REPLACE(dig, NULL);
 }
 
+static void
+segjob_set_level(struct segjob *sj, int level)
+{
+	z_stream *zs;
+
+	sj->level = level;
+	if (sj->npar == 0)
+		return;
+	/* Add room for the sync flush and then some */
+	zs = Gzip_GetRawDeflate(level);
+	sj->par_bound = deflateBound(zs, SEGJOB_BLOCK) + 64;
+	Gzip_Put(&zs);
+}
+
+static void
+segjob_probe(struct segjob *sj, const void *ptr, size_t len)
+{
+	z_stream *zs;
+	uint8_t *obuf;
+	size_t olen;
+	int i;
+
+	sj->probe = 0;
+	if (len < SEGJOB_PROBE_MIN)
+		return;
+	if (len > SEGJOB_PROBE_MAX)
+		len = SEGJOB_PROBE_MAX;
+
+	zs = Gzip_GetRawDeflate(Z_BEST_SPEED);
+	olen = deflateBound(zs, len);
+	obuf = malloc(olen);
+	AN(obuf);
+	zs->next_in = ptr;
+	zs->avail_in = len;
+	zs->next_out = obuf;
+	zs->avail_out = olen;
+	i = deflate(zs, Z_FINISH);
+	assert(i == Z_STREAM_END);
+	olen -= zs->avail_out;
+	Gzip_Put(&zs);
+	free(obuf);
+
+	if (olen * 32 >= len * 31)		/* Less than 3% gain */
+		segjob_set_level(sj, Z_NO_COMPRESSION);
+	else if (olen * 8 >= len * 7)		/* Less than 12.5% gain */
+		segjob_set_level(sj, Z_BEST_SPEED);
+}
+
 struct segjob *
 SegJob_New(struct aardwarc *aa, const struct header *hdr, const char *ident)
 {
 	struct segjob *sj;
+	const char *p;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 	AN(hdr);
@@ -202,14 +357,44 @@ SegJob_New(struct aardwarc *aa, const struct header *hdr, const char *ident)
 	AN(sj);
 
 	VTAILQ_INIT(&sj->segments);
-	SHA256_Init(sj->sha256_payload);
 	sj->aa = aa;
 	sj->hdr = hdr;
 	sj->ident = ident;
 
+	if (aa->compression_threads > 1) {
+		sj->npar = aa->compression_threads;
+		sj->par = calloc(sj->npar, sizeof *sj->par);
+		AN(sj->par);
+		sj->pbuf = malloc((size_t)sj->npar * SEGJOB_BLOCK);
+		AN(sj->pbuf);
+	}
+
+	if (!Config_Find(aa->cfg, "compression.level",
+	    Header_Get(hdr, "Content-Type"), &p) && p != NULL) {
+		segjob_set_level(sj, atoi(p));
+	} else {
+		segjob_set_level(sj, AA_COMPRESSION);
+		sj->probe = 1;
+	}
+
 	return (sj);
 }
 
+/*
+ * Put the object into a batch silo, see Wsilo_Batch(), instead of
+ * a silo of its own.
+ */
+
+void
+SegJob_Batch(struct segjob *sj, struct wsilo *sl)
+{
+
+	CHECK_OBJ_NOTNULL(sj, SEGJOB_MAGIC);
+	AN(sl);
+	AZ(sj->nseg);
+	sj->batch = sl;
+}
+
 static void
 segjob_setup_outbuf(struct segjob *sj, const struct segment *sg)
 {
@@ -237,8 +422,8 @@ segjob_deflate(struct segjob *sj, const struct segment *sg)
 		AZ(Wsilo_Store(sg->silo, len));
 }
 
-void
-SegJob_Feed(struct segjob *sj, const void *iptr, ssize_t ilen)
+static void
+segjob_feed(struct segjob *sj, const void *iptr, ssize_t ilen)
 {
 	struct segment *sg;
 	const char *ip = iptr;
@@ -273,6 +458,10 @@ SegJob_Feed(struct segjob *sj, const void *iptr, ssize_t ilen)
 			segjob_setup_outbuf(sj, sg);
 			segjob_deflate(sj, sg);
 
+			Wsilo_GetSpace(sg->silo, &ptr, &sj->obuflen);
+			AZ(Wsilo_Store(sg->silo, Gzip_Trailer(ptr, sj->obuflen,
+			    sj->crc, (uint32_t)sg->size)));
+
 			Wsilo_GetSpace(sg->silo, &ptr, &sj->obuflen);
 			assert(sj->obuflen > (ssize_t)sizeof Gzip_crnlcrnl);
 			memcpy(ptr, Gzip_crnlcrnl, sizeof Gzip_crnlcrnl);
@@ -299,7 +488,10 @@ SegJob_Feed(struct segjob *sj, const void *iptr, ssize_t ilen)
 			sj->size += len;
 			sg->size += len;
 			SHA256_Update(sj->sha256_segment, ip, len);
-			SHA256_Update(sj->sha256_payload, ip, len);
+			if (sg->segno > 1)
+				SHA256_Update(sj->sha256_payload, ip, len);
+			sj->crc = crc32(sj->crc, (const void*)ip, len);
+			sj->gz_dirty = 1;
 
 			ilen -= len;
 			ip += len;
@@ -319,7 +511,211 @@ SegJob_Feed(struct segjob *sj, const void *iptr, ssize_t ilen)
 
 		segjob_deflate(sj, sg);
 
-	} while (sj->gz->avail_in > 0 || ilen > 0);
+	} while ((sj->gz != NULL && sj->gz->avail_in > 0) || ilen > 0);
+}
+
+/* Parallel compression -----------------------------------------------*/
+
+static void *
+segjob_par_worker(void *priv)
+{
+	struct segpar *sp;
+	z_stream *zs;
+	int i;
+
+	CAST_OBJ_NOTNULL(sp, priv, SEGPAR_MAGIC);
+
+	zs = Gzip_GetRawDeflate(sp->level);
+	if (sp->dictlen > 0)
+		AZ(deflateSetDictionary(zs, sp->dict, sp->dictlen));
+	zs->next_in = sp->in;
+	zs->avail_in = SEGJOB_BLOCK;
+	zs->next_out = sp->out;
+	zs->avail_out = sp->outlen;
+	i = deflate(zs, Z_SYNC_FLUSH);
+	assert(i == Z_OK);
+	AZ(zs->avail_in);
+	assert(zs->avail_out > 0);
+	sp->outlen -= zs->avail_out;
+	/* The stream is not finished, Gzip_Put() resets it anyway */
+	Gzip_Put(&zs);
+
+	sp->crc = crc32(0L, sp->in, SEGJOB_BLOCK);
+	return (NULL);
+}
+
+static void
+segjob_par_store(const struct segment *sg, const uint8_t *p, size_t l)
+{
+	void *ptr;
+	ssize_t len;
+
+	while (l > 0) {
+		Wsilo_GetSpace(sg->silo, &ptr, &len);
+		assert(len > 0);
+		if ((size_t)len > l)
+			len = l;
+		memcpy(ptr, p, len);
+		AZ(Wsilo_Store(sg->silo, len));
+		p += len;
+		l -= len;
+	}
+}
+
+/*
+ * How many blocks can we safely compress in parallel into this silo ?
+ */
+
+static unsigned
+segjob_par_room(const struct segjob *sj, const struct segment *sg)
+{
+	off_t left;
+
+	left = Wsilo_Left(sg->silo) - SEGJOB_RESERVE;
+	if (left < (off_t)sj->par_bound)
+		return (0);
+	if (left / sj->par_bound < sj->npar)
+		return (left / sj->par_bound);
+	return (sj->npar);
+}
+
+static void
+segjob_par_batch(struct segjob *sj, struct segment *sg,
+    const uint8_t *ip, unsigned n)
+{
+	struct segpar *sp;
+	size_t len = (size_t)n * SEGJOB_BLOCK;
+	unsigned u;
+
+	assert(n > 0 && n <= sj->npar);
+
+	if (sj->gz_dirty) {
+		/* Get the serial stream to a byte boundary */
+		segjob_setup_outbuf(sj, sg);
+		sj->gz_flag = Z_SYNC_FLUSH;
+		segjob_deflate(sj, sg);
+		assert(sj->gz->avail_out > 0);
+		sj->dictlen = sizeof sj->dict;
+		AZ(deflateGetDictionary(sj->gz, sj->dict, &sj->dictlen));
+		sj->gz_dirty = 0;
+	}
+
+	for (u = 0; u < n; u++) {
+		sp = &sj->par[u];
+		if (sp->out == NULL) {
+			sp->magic = SEGPAR_MAGIC;
+			sp->out = malloc(sj->par_bound);
+			AN(sp->out);
+		}
+		sp->in = ip + (size_t)u * SEGJOB_BLOCK;
+		if (u == 0) {
+			sp->dict = sj->dict;
+			sp->dictlen = sj->dictlen;
+		} else {
+			sp->dict = sp->in - SEGJOB_DICT;
+			sp->dictlen = SEGJOB_DICT;
+		}
+		sp->outlen = sj->par_bound;
+		sp->level = sj->level;
+		AZ(pthread_create(&sp->thr, NULL, segjob_par_worker, sp));
+	}
+
+	/* Hash while the workers compress */
+	SHA256_Update(sj->sha256_segment, ip, len);
+	if (sg->segno > 1)
+		SHA256_Update(sj->sha256_payload, ip, len);
+	sj->size += len;
+	sg->size += len;
+
+	for (u = 0; u < n; u++) {
+		sp = &sj->par[u];
+		AZ(pthread_join(sp->thr, NULL));
+		segjob_par_store(sg, sp->out, sp->outlen);
+		sj->crc = crc32_combine(sj->crc, sp->crc, SEGJOB_BLOCK);
+	}
+
+	/* Restart the serial stream where the blocks left off */
+	memcpy(sj->dict, ip + len - SEGJOB_DICT, SEGJOB_DICT);
+	sj->dictlen = SEGJOB_DICT;
+	AZ(deflateReset(sj->gz));
+	AZ(deflateSetDictionary(sj->gz, sj->dict, sj->dictlen));
+	sj->gz_flag = 0;
+}
+
+static void
+segjob_par_flush(struct segjob *sj)
+{
+	const uint8_t *p = sj->pbuf;
+	size_t l = sj->plen;
+	unsigned n;
+
+	while (l >= SEGJOB_BLOCK) {
+		if (sj->cur_seg == NULL)
+			segjob_newseg(sj);
+		n = segjob_par_room(sj, sj->cur_seg);
+		if (n > l / SEGJOB_BLOCK)
+			n = l / SEGJOB_BLOCK;
+		if (n == 0) {
+			/* Let the steering fill up this silo */
+			segjob_feed(sj, p, SEGJOB_BLOCK);
+			p += SEGJOB_BLOCK;
+			l -= SEGJOB_BLOCK;
+			continue;
+		}
+		segjob_par_batch(sj, sj->cur_seg, p, n);
+		p += (size_t)n * SEGJOB_BLOCK;
+		l -= (size_t)n * SEGJOB_BLOCK;
+	}
+	if (l > 0)
+		segjob_feed(sj, p, l);
+	sj->plen = 0;
+}
+
+void
+SegJob_Feed(struct segjob *sj, const void *iptr, ssize_t ilen)
+{
+	const char *ip = iptr;
+	size_t len;
+
+	CHECK_OBJ_NOTNULL(sj, SEGJOB_MAGIC);
+
+	if (sj->probe)
+		segjob_probe(sj, iptr, ilen);
+
+	if (sj->pbuf == NULL) {
+		segjob_feed(sj, iptr, ilen);
+		return;
+	}
+	if (ilen == 0) {
+		/* Finish up */
+		segjob_par_flush(sj);
+		segjob_feed(sj, iptr, ilen);
+		return;
+	}
+	while (ilen > 0) {
+		len = (size_t)sj->npar * SEGJOB_BLOCK - sj->plen;
+		if (len > (size_t)ilen)
+			len = ilen;
+		memcpy(sj->pbuf + sj->plen, ip, len);
+		sj->plen += len;
+		ip += len;
+		ilen -= len;
+		if (sj->plen == (size_t)sj->npar * SEGJOB_BLOCK)
+			segjob_par_flush(sj);
+	}
+}
+
+/* Give up on an object, for instance because the input went away */
+
+void
+SegJob_Abandon(struct segjob **sjp)
+{
+	struct segjob *sj;
+
+	TAKE_OBJ_NOTNULL(sj, sjp, SEGJOB_MAGIC);
+	if (sj->cur_seg != NULL)
+		Gzip_Put(&sj->gz);
+	segjob_destroy(sj);
 }
 
 char *
@@ -328,12 +724,11 @@ SegJob_Commit(struct segjob *sj)
 	char *id;
 	struct segment *sg, *sgn;
 	const char *fid, *rid;
-	struct getjob *gj;
-	struct vsb *vsb;
 
 	CHECK_OBJ_NOTNULL(sj, SEGJOB_MAGIC);
 	SegJob_Feed(sj, "", 0);
 	AN(sj->size);
+	segjob_par_fini(sj);
 
 	sg = VTAILQ_FIRST(&sj->segments);
 	AN(sg);
@@ -350,11 +745,7 @@ SegJob_Commit(struct segjob *sj)
 	fid = Header_Get_Id(sg->hdr);
 	id = Digest2Ident(sj->aa, fid);
 
-	vsb = VSB_new_auto();
-	AN(vsb);
-	gj = GetJob_New(sj->aa, fid, vsb);
-	if (gj != NULL) {
-		GetJob_Delete(&gj);
+	if (Wsilo_Have(sj->aa, sj->batch, fid)) {
 		fprintf(stderr, "ID %s already in archive\n", fid);
 		segjob_destroy(sj);
 		return (id);
@@ -28,7 +28,23 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#  include <linux/fiemap.h>
+#endif
+#ifdef __FreeBSD__
+#  include <sys/param.h>
+#  include <sys/filio.h>
+#  include <sys/ioctl.h>
+#endif
 
 #include "vdef.h"
 
@@ -65,15 +81,37 @@ numpart(struct vsb *vsb, int lvl, unsigned num)
 		VSB_printf(vsb, "%02u/", num % 100U);
 }
 
-struct vsb *
-Silo_Filename(const struct aardwarc *aa, unsigned number, int hold)
+/*
+ * Placement
+ * ---------
+ *
+ * 'silo.directory' can list more than one directory, typically one per
+ * disk, and 'silo.placement' decides which one each silo goes in:
+ *
+ *	round-robin	silo number modulo the number of directories
+ *	hash		a hash of the silo number, if the numbers have a
+ *			pattern round-robin would follow
+ *	least-full	where the silo or its hold already is, otherwise
+ *			the directory with the most free space
+ *
+ * round-robin and hash only depend on the silo number, so the list of
+ * directories cannot be changed once there are silos.  With least-full
+ * directories can be added at any time, at the cost of looking in all
+ * of them to find a silo.
+ *
+ * The index and the '_.cache' and '_.space' files live in the first
+ * directory.
+ */
+
+static struct vsb *
+silo_path(const struct aardwarc *aa, unsigned dir, unsigned number, int hold)
 {
 	struct vsb *vsb;
-	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
+	assert(dir < aa->nsilo_dir);
 	vsb = VSB_new_auto();
 	AN(vsb);
-	VSB_cat(vsb, aa->silo_dirname);
+	VSB_cat(vsb, aa->silo_dirs[dir]);
 	numpart(vsb, 0, number);
 	VSB_printf(vsb, aa->silo_basename, number);
 	if (hold)
@@ -82,11 +120,85 @@ Silo_Filename(const struct aardwarc *aa, unsigned number, int hold)
 	return (vsb);
 }
 
+static int
+silo_exists(const struct aardwarc *aa, unsigned dir, unsigned number, int hold)
+{
+	struct vsb *vsb;
+	struct stat st;
+	int i;
+
+	vsb = silo_path(aa, dir, number, hold);
+	i = stat(VSB_data(vsb), &st);
+	VSB_delete(vsb);
+	return (i == 0);
+}
+
+static unsigned
+silo_dir(const struct aardwarc *aa, unsigned number)
+{
+	struct statvfs sv;
+	uintmax_t avail, best = 0;
+	unsigned u, dir = 0;
+
+	if (aa->nsilo_dir == 1)
+		return (0);
+	switch (aa->silo_placement) {
+	case PLACE_ROUNDROBIN:
+		return (number % aa->nsilo_dir);
+	case PLACE_HASH:
+		return ((uint32_t)(number * 0x9e3779b1U) *
+		    (uint64_t)aa->nsilo_dir >> 32);
+	case PLACE_LEASTFULL:
+		for (u = 0; u < aa->nsilo_dir; u++)
+			if (silo_exists(aa, u, number, 0) ||
+			    silo_exists(aa, u, number, 1))
+				return (u);
+		for (u = 0; u < aa->nsilo_dir; u++) {
+			if (statvfs(aa->silo_dirs[u], &sv))
+				continue;
+			avail = (uintmax_t)sv.f_bavail * sv.f_frsize;
+			if (avail > best) {
+				best = avail;
+				dir = u;
+			}
+		}
+		return (dir);
+	default:
+		WRONG("Bad silo.placement");
+	}
+	NEEDLESS(return (0));
+}
+
+/*
+ * With 'silo.staging' the holds live in that directory, which should
+ * be on fast storage, see Wsilo_Install() for how they get out of it.
+ */
+
+struct vsb *
+Silo_Filename(const struct aardwarc *aa, unsigned number, int hold)
+{
+	struct vsb *vsb;
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+
+	if (hold && aa->staging_dirname != NULL) {
+		vsb = VSB_new_auto();
+		AN(vsb);
+		VSB_cat(vsb, aa->staging_dirname);
+		VSB_printf(vsb, aa->silo_basename, number);
+		VSB_cat(vsb, ".hold");
+		AZ(VSB_finish(vsb));
+		return (vsb);
+	}
+	return (silo_path(aa, silo_dir(aa, number), number, hold));
+}
+
 int
 Silo_Iter(const struct aardwarc *aa, byte_iter_f *func, void *priv)
 {
 	struct vsb *vsb;
 	uint32_t u;
+	unsigned d;
 	struct stat st;
 	int i, retval = 0;
 
@@ -94,15 +206,20 @@ Silo_Iter(const struct aardwarc *aa, byte_iter_f *func, void *priv)
 	AN(func);
 
 	for (u = 0; retval == 0; u++) {
-		vsb = VSB_new_auto();
-		AN(vsb);
-		VSB_cat(vsb, aa->silo_dirname);
-		numpart(vsb, 0, u);
-		AZ(VSB_finish(vsb));
-		i = stat(VSB_data(vsb), &st);
-		if (i && errno == ENOENT)
+		/* Stop when no directory has a place for it */
+		for (d = 0; d < aa->nsilo_dir; d++) {
+			vsb = VSB_new_auto();
+			AN(vsb);
+			VSB_cat(vsb, aa->silo_dirs[d]);
+			numpart(vsb, 0, u);
+			AZ(VSB_finish(vsb));
+			i = stat(VSB_data(vsb), &st);
+			VSB_delete(vsb);
+			if (!i || errno != ENOENT)
+				break;
+		}
+		if (d == aa->nsilo_dir)
 			break;
-		VSB_delete(vsb);
 		vsb = Silo_Filename(aa, u, 0);
 		i = stat(VSB_data(vsb), &st);
 		if (!i && S_ISREG(st.st_mode))
@@ -111,3 +228,69 @@ Silo_Iter(const struct aardwarc *aa, byte_iter_f *func, void *priv)
 	}
 	return (0);
 }
+
+/*
+ * Count the extents of a silo file, returns -1 if we cannot tell.
+ * '*size' is -1 if we cannot open the file, errno says why.
+ *
+ * Linux counts them for us (FIEMAP).  On FreeBSD we map the file one
+ * run of contiguous blocks at a time (FIOBMAP2), which UFS can do, but
+ * ZFS cannot.
+ */
+
+int
+Silo_Extents(const char *fn, off_t *size)
+{
+	struct stat st;
+	int fd, retval = -1;
+
+	AN(fn);
+	AN(size);
+	*size = -1;
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	AZ(fstat(fd, &st));
+	*size = st.st_size;
+#if defined(FS_IOC_FIEMAP)
+	{
+	struct fiemap fm;
+
+	memset(&fm, 0, sizeof fm);
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags = FIEMAP_FLAG_SYNC;
+	/* With no room for extents, we just get the count */
+	if (!ioctl(fd, FS_IOC_FIEMAP, &fm))
+		retval = (int)fm.fm_mapped_extents;
+	}
+#elif defined(FIOBMAP2)
+	{
+	struct fiobmap2_arg fb;
+	struct statvfs sv;
+	int64_t lbn, nblk, next = -1;
+	int n = 0;
+
+	/* Logical blocks are f_bsize, physical ones DEV_BSIZE */
+	if (!fstatvfs(fd, &sv) && sv.f_bsize >= DEV_BSIZE) {
+		nblk = (st.st_size + sv.f_bsize - 1) / sv.f_bsize;
+		for (lbn = 0; lbn < nblk; lbn += fb.runp + 1) {
+			memset(&fb, 0, sizeof fb);
+			fb.bn = lbn;
+			if (ioctl(fd, FIOBMAP2, &fb)) {
+				n = -1;
+				break;
+			}
+			if (fb.bn == -1)	/* A hole */
+				continue;
+			if (fb.bn != next)
+				n++;
+			next = fb.bn +
+			    (fb.runp + 1) * (int64_t)(sv.f_bsize / DEV_BSIZE);
+		}
+		retval = n;
+	}
+	}
+#endif
+	AZ(close(fd));
+	return (retval);
+}
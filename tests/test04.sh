@@ -41,10 +41,14 @@ for p in \
 	filter \
 	get \
 	housekeeping \
+	httpd \
+	import-warc \
 	info \
+	ingest-tar \
 	reindex \
 	stevedore \
 	store \
+	stored \
 	stow \
 	_testbytes
 do
@@ -73,9 +77,34 @@ fail 1 'has unknown config' ${AXEC} stow test04_c
 echo "#### $0 stevedore Argument and Usage code"
 fail 1 'Usage' ${AXEC} stevedore xyz
 
+echo "#### $0 stored Argument and Usage code"
+fail 1 'Must specify -a' ${AXEC} stored
+fail 1 'Cannot connect' ${AXEC} store -S /nonexistent test.rc
+
+echo "#### $0 ingest-tar Argument and Usage code"
+fail 1 'read from stdin' ${AXEC} ingest-tar test.rc
+fail 1 'Illegal mime-type' ${AXEC} ingest-tar -m text/weird < test.rc
+
+echo "#### $0 import-warc Argument and Usage code"
+fail 1 'Illegal -n argument' ${AXEC} import-warc -n 0
+fail 1 'Illegal mime-type' ${AXEC} import-warc -m text/weird
+fail 1 'Cannot open' ${AXEC} import-warc /nonexistent
+
+echo "#### $0 filter Argument and Usage code"
+fail 1 'Illegal -b argument' ${AXEC} filter -b 1k /dev/null
+
+echo "#### $0 dumpindex Argument and Usage code"
+fail 1 'Non-hex id-part' ${AXEC} dumpindex 12xy
+
 echo "#### $0 store Argument and Usage code"
 fail 1 'More than one -t argument' \
 	${AXEC} store -t resource -t metadata
+fail 1 'Illegal -d argument' \
+	${AXEC} store -d 1234
+fail 1 'Batch .-b. only for resources' \
+	${AXEC} store -b - foo
+fail 1 'Daemon .-S. only for resources' \
+	${AXEC} store -S /nonexistent -b -
 fail 1 'Illegal -t argument' \
 	${AXEC} store -t warcinfo
 fail 1 'Can only specify -r ID for metadata' \
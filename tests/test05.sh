@@ -44,3 +44,85 @@ fail 0 'Museum-quality bit-archive storage management' \
 export HTTP_ACCEPT_ENCODING=gzip
 fail 0 'Content-Encoding: gzip' \
 	${AXEC} cgi
+
+fail 1 'Too many arguments' \
+	${AXEC} httpd foo
+
+fail 1 'Illegal -n argument' \
+	${AXEC} httpd -n 0
+
+fail 1 'Address must be host:port' \
+	${AXEC} httpd -a localhost
+
+# Segmented objects are served as one stitched gzip member
+cat ../*.c > _seg
+export PATH_INFO=/`${AXEC} store -t resource -m text/plain _seg`
+${AXEC} cgi > _cgi
+fgrep -q 'Content-Encoding: gzip' _cgi
+hl=`sed '/^$/q' _cgi | wc -c`
+tail -c +$((hl + 1)) _cgi > _cgib
+cl=`sed -n '/^$/q;s/^Content-Length: //p' _cgi`
+test $cl -eq `wc -c < _cgib`
+zcat < _cgib | cmp - _seg
+
+# Second get of an object comes from the cache
+(
+	echo ""
+	echo "cache.directory:"
+	echo "		${ADIR}/cache/"
+) >> ${ADIR}/aardwarc.conf
+# Left behind by a crash
+mkdir -p ${ADIR}/cache/00
+echo crash > ${ADIR}/cache/00/00.tmp.1
+touch -t 200001010000 ${ADIR}/cache/00/00.tmp.1
+${AXEC} get -o _c1 ${PATH_INFO#/} > _h1
+test `find ${ADIR}/cache -type f ! -name _.size | wc -l` -eq 1
+test `wc -c < ${ADIR}/cache/_.size` -eq 8
+${AXEC} get -o _c2 ${PATH_INFO#/} > _h2
+cmp _seg _c1
+cmp _seg _c2
+diff _h1 _h2
+unset HTTP_ACCEPT_ENCODING
+${AXEC} cgi > _cgi
+fgrep -q "Content-Length: `wc -c < _seg | tr -d ' '`" _cgi
+
+# The httpd serves the same bytes as get, a client sending its request
+# in pieces does not hold up the (only) worker, and pipelined requests
+# are answered in order
+echo "#### $0 httpd"
+id=${PATH_INFO#/}
+rm -f ${ADIR}/_hsock _fifo
+${AXEC} httpd -a ${ADIR}/_hsock -n 1 &
+hd=$!
+while [ ! -S ${ADIR}/_hsock ]
+do
+	sleep 0.1
+done
+mkfifo _fifo
+nc -U ${ADIR}/_hsock < _fifo > _r2 &
+slow=$!
+exec 3> _fifo
+printf 'GET /%s HTTP/1.1\r\n' $id >&3
+sleep 0.5
+printf 'GET /%s HTTP/1.1\r\nConnection: close\r\n\r\n' $id | \
+    nc -U ${ADIR}/_hsock > _r1
+printf 'Connection: close\r\n\r\n' >&3
+exec 3>&-
+wait $slow
+cmp _r1 _r2
+CR=`printf '\r'`
+sed "/^${CR}\$/q" _r1 > _h1
+tail -c +$((`wc -c < _h1` + 1)) _r1 > _b1
+cmp _seg _b1
+fgrep -q "Content-Length: `wc -c < _seg | tr -d ' '`${CR}" _h1
+printf 'HEAD /%s HTTP/1.1\r\nConnection: close\r\n\r\n' $id | \
+    nc -U ${ADIR}/_hsock | cmp - _h1
+fgrep -v "Connection: close" _h1 > _h2
+printf 'GET /%s HTTP/1.1\r\n\r\nHEAD /%s HTTP/1.1\r\n\r\n' $id $id > _r2
+printf 'GET /%s HTTP/1.1\r\nConnection: close\r\n\r\n' $id >> _r2
+nc -U ${ADIR}/_hsock < _r2 > _r3
+cat _h2 _b1 _h2 _r1 | cmp - _r3
+kill $hd
+rm -f ${ADIR}/_hsock _fifo _r1 _r2 _r3 _b1
+
+rm -f _seg _cgi _cgib _c1 _c2 _h1 _h2
@@ -0,0 +1,466 @@
+#!/bin/sh
+#
+# Parallel compression
+
+set -e
+
+. test.rc
+
+new_aardwarc
+
+sed 's/15k/3M/' ${ADIR}/aardwarc.conf > ${ADIR}/_c
+(
+	cat ${ADIR}/_c
+	echo "compression.threads:"
+	echo "		3"
+	echo ""
+) > ${ADIR}/aardwarc.conf
+rm -f ${ADIR}/_c
+
+# Incompressible, so it takes several segments
+${AXEC} _testbytes -n 10000000 > _p1
+
+# Compressible, so it fits in one
+rm -f _p2
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16
+do
+	cat ../*.c >> _p2
+done
+
+for i in _p1 _p2
+do
+	echo "#### $0 $i"
+	${AXEC} store -t resource -m application/octet-stream $i > _2
+	${AXEC} get -o _3 `cat _2` > /dev/null
+	cmp $i _3
+	${AXEC} get -z -o _5 `cat _2` > /dev/null
+	zcat _5 | cmp - $i
+done
+
+# Known content is found before compression
+echo "#### $0 dedup"
+s1=`sha256 < _p1`
+fail 0 'already in archive' \
+	${AXEC} store -t resource -m application/octet-stream _p1
+cat _p1 | fail 0 'already in archive' \
+	${AXEC} store -t resource -m application/octet-stream -d $s1 -
+# Stdin already some way into a file
+(
+	dd bs=100 count=1 of=/dev/null 2> /dev/null
+	${AXEC} store -t resource -m application/octet-stream -
+) < _p1 > _2
+${AXEC} get -o _3 `cat _2` > /dev/null
+tail -c +101 _p1 | cmp - _3
+s0=0000000000000000000000000000000000000000000000000000000000000000
+fail 1 'Input does not match digest' \
+	${AXEC} store -t resource -m application/octet-stream -d $s0 ../README.md
+
+# Many small objects in one go
+echo "#### $0 batch"
+ls ../*.c ../*.h > _l1
+echo ../vas.c >> _l1
+${AXEC} store -t resource -m application/octet-stream -b _l1 > _2
+test `wc -l < _2` -eq `wc -l < _l1`
+while read id fn
+do
+	${AXEC} get -o _3 $id > /dev/null
+	cmp $fn _3
+done < _2
+sort -u _2 > _4
+${AXEC} store -t resource -m application/octet-stream -b - < _l1 | sort -u | \
+	cmp - _4
+rm -f _l1
+
+# Store daemon, small objects go in batches, big ones on their own
+echo "#### $0 stored"
+rm -f ${ADIR}/_sock
+${AXEC} stored -a ${ADIR}/_sock -n 3 &
+sd=$!
+while [ ! -S ${ADIR}/_sock ]
+do
+	sleep 0.1
+done
+pids=""
+for w in 1 2 3 4
+do
+	(
+		for f in ../*.h
+		do
+			(cat $f ; echo stored $w) | \
+			    ${AXEC} store -S ${ADIR}/_sock -
+		done > _w$w
+	) &
+	pids="$pids $!"
+done
+(cat _p2 ; echo stored) | ${AXEC} store -S ${ADIR}/_sock -m text/plain > _2
+wait $pids
+# The same object to all the workers at once, stored only once
+pids=""
+for w in 1 2 3 4 5 6
+do
+	(cat ../*.h ; echo stored dup) | \
+	    ${AXEC} store -S ${ADIR}/_sock - > _d$w &
+	pids="$pids $!"
+done
+wait $pids
+for w in 2 3 4 5 6
+do
+	cmp _d1 _d$w
+done
+id=`sed 's,.*/,,' _d1`
+test `${AXEC} dumpindex $id | wc -l` -eq 1
+rm -f _d?
+fail 1 'Illegal mime-type' \
+	${AXEC} store -S ${ADIR}/_sock -m text/weird test.rc
+fail 1 'Input empty' \
+	${AXEC} store -S ${ADIR}/_sock /dev/null
+kill $sd
+for w in 1 2 3 4
+do
+	test `wc -l < _w$w` -eq `ls ../*.h | wc -l`
+	for f in ../*.h
+	do
+		echo $f
+	done | paste -d ' ' _w$w - | while read id fn
+	do
+		${AXEC} get -o _3 $id > /dev/null
+		(cat $fn ; echo stored $w) | cmp - _3
+	done
+done
+${AXEC} get -o _3 `cat _2` > /dev/null
+(cat _p2 ; echo stored) | cmp - _3
+rm -f _w? ${ADIR}/_sock
+
+# A client sending its object in pieces does not hold up the (only)
+# worker, nor does it get a reply before the rest arrives
+echo "#### $0 stored slow client"
+rm -f _fifo
+${AXEC} stored -a ${ADIR}/_sock -n 1 &
+sd=$!
+while [ ! -S ${ADIR}/_sock ]
+do
+	sleep 0.1
+done
+mkfifo _fifo
+nc -N -U ${ADIR}/_sock < _fifo > _3 &
+slow=$!
+exec 3> _fifo
+printf '\202\013stored' >&3
+sleep 0.5
+echo stored fast | ${AXEC} store -S ${ADIR}/_sock - > _2
+test ! -s _3
+printf ' slow\002' >&3
+exec 3>&-
+wait $slow
+kill $sd
+${AXEC} get -o _4 `cat _2` > /dev/null
+echo stored fast | cmp - _4
+${AXEC} get -o _4 `tail -c +3 _3` > /dev/null
+printf 'stored slow' | cmp - _4
+rm -f _fifo _3 _4 ${ADIR}/_sock
+
+# Group commit
+(
+	echo "commit.window:"
+	echo "		10000	4"
+	echo ""
+) >> ${ADIR}/aardwarc.conf
+echo "#### $0 group commit"
+rm -f _l1
+for i in 1 2 3 4 5 6 7 8 9 10
+do
+	echo "group commit $i" > _b$i
+	echo _b$i >> _l1
+done
+${AXEC} store -v -t resource -m application/octet-stream -b _l1 > _2 2> _4
+grep -q 'Commits: .* in .* syncs' _4
+test `wc -l < _2` -eq 10
+while read id fn
+do
+	${AXEC} get -o _3 $id > /dev/null
+	cmp $fn _3
+done < _2
+rm -f _l1 _b*
+
+# Parallel writers each get their own silo
+echo "#### $0 parallel writers"
+for w in 1 2 3 4
+do
+	(
+		for f in ../*.h
+		do
+			(cat $f ; echo $w) | \
+			    ${AXEC} store -t resource -m application/octet-stream -
+		done > _w$w
+	) &
+done
+wait
+test `cat _w? | wc -l` -eq $((4 * `ls ../*.h | wc -l`))
+for id in `cat _w?`
+do
+	${AXEC} get -o _3 $id > /dev/null
+done
+rm -f _w?
+
+# Stored blocks for everything
+(
+	echo "compression.level:"
+	echo "		*	0"
+	echo ""
+) >> ${ADIR}/aardwarc.conf
+echo "#### $0 level 0"
+cat ../*.h > _p3
+${AXEC} store -t resource -m application/octet-stream _p3 > _2
+${AXEC} get -o _3 `cat _2` > /dev/null
+cmp _p3 _3
+${AXEC} get -z -o _5 `cat _2` > /dev/null
+test `wc -c < _5` -gt `wc -c < _p3`
+
+# Preallocated holds must be trimmed when they become silos
+for m in hold silo
+do
+	(
+		echo "silo.preallocate:"
+		echo "		$m"
+		echo ""
+	) > ${ADIR}/_c
+	cat ${ADIR}/_c >> ${ADIR}/aardwarc.conf
+	echo "#### $0 preallocate $m"
+	if ${AXEC} info > _4 2>&1 ; then
+		(cat _p2 ; echo $m) > _p3
+		${AXEC} store -t resource -m application/octet-stream _p3 > _2
+		${AXEC} get -o _3 `cat _2` > /dev/null
+		cmp _p3 _3
+	else
+		# Only where FALLOC_FL_KEEP_SIZE is
+		grep -q 'not supported on this platform' _4
+	fi
+	sed '/^silo.preallocate:/,/^$/d' ${ADIR}/aardwarc.conf > ${ADIR}/_c
+	mv ${ADIR}/_c ${ADIR}/aardwarc.conf
+done
+${AXEC} info -f > _4
+grep -q 'silos, .* bytes' _4
+fail 0 'Cannot open /nonexistent' ${AXEC} info -f /nonexistent
+
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+
+# Silos striped over two directories
+echo "#### $0 silo.placement"
+new_aardwarc
+sed '/^silo.directory:/,/^$/d' ${ADIR}/aardwarc.conf > ${ADIR}/_c
+(
+	cat ${ADIR}/_c
+	echo "silo.directory:"
+	echo "		${ADIR}/"
+	echo "		${ADIR}/d2/"
+	echo ""
+	echo "silo.placement:"
+	echo "		round-robin"
+	echo ""
+) > ${ADIR}/aardwarc.conf
+rm -f ${ADIR}/_c
+for f in ../*.c
+do
+	${AXEC} store -t resource -m application/octet-stream $f
+done > _2
+test -f ${ADIR}/0/00000000.warc.gz
+test -f ${ADIR}/d2/0/00000001.warc.gz
+test ! -f ${ADIR}/0/00000001.warc.gz
+for f in ../*.c
+do
+	echo $f
+done | paste -d ' ' _2 - | while read id fn
+do
+	${AXEC} get -o _3 $id > /dev/null
+	cmp $fn _3
+done
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+
+# Holds in a staging directory
+echo "#### $0 silo.staging"
+mkdir -p ${ADIR}/stage
+(
+	echo "silo.staging:"
+	echo "		${ADIR}/stage/"
+	echo ""
+) >> ${ADIR}/aardwarc.conf
+for f in ../*.h
+do
+	${AXEC} store -t resource -m application/octet-stream $f
+done > _2
+for f in ../*.h
+do
+	echo $f
+done | paste -d ' ' _2 - | while read id fn
+do
+	${AXEC} get -o _3 $id > /dev/null
+	cmp $fn _3
+done
+test -z "`ls ${ADIR}/stage`"
+test -z "`find ${ADIR}/0 ${ADIR}/d2 -name '*.hold'`"
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+
+# Mime-type validators
+echo "#### $0 validators"
+awk '
+{ print }
+/^resource.mime-types:/ {
+	print "\t\ttext/x-magic\tgrep -q magic"
+	print "\t\ttext/x-first\thead -c 1 > /dev/null"
+	print "\t\ttext/x-never\tcat > /dev/null ; exit 3"
+}
+' ${ADIR}/aardwarc.conf > _4
+mv _4 ${ADIR}/aardwarc.conf
+(cat test.rc ; echo magic) > _4
+(cat test.rc ; echo tragic) > _5
+id=`${AXEC} store -t resource -m text/x-magic _4`
+${AXEC} get -o _3 $id > /dev/null
+cmp _4 _3
+fail 1 'Validator .grep -q magic. rejected the input .exit status 1.' \
+	${AXEC} store -t resource -m text/x-magic _5
+# Validators may stop reading once they know
+id=`${AXEC} store -t resource -m text/x-first _p2`
+${AXEC} get -o _3 $id > /dev/null
+cmp _p2 _3
+echo _5 > _l1
+fail 1 'Skipping _5: Validator .grep -q magic. rejected' \
+	${AXEC} store -t resource -m text/x-magic -b _l1
+# A rejected object must not upset the rest of the batch
+(cat test.rc ; echo magic batch) > _l1
+if printf '_5\n_l1\n' | \
+    ${AXEC} store -t resource -m text/x-magic -b - > _2 2> /dev/null ; then
+	exit 1
+fi
+test "`awk '{print $2}' _2`" = "_l1"
+${AXEC} get -o _3 `awk '{print $1}' _2` > /dev/null
+cmp _l1 _3
+rm -f _l1
+rm -f ${ADIR}/_sock
+${AXEC} stored -a ${ADIR}/_sock -n 2 &
+sd=$!
+while [ ! -S ${ADIR}/_sock ]
+do
+	sleep 0.1
+done
+fail 1 'rejected the input' \
+	${AXEC} store -S ${ADIR}/_sock -m text/x-magic _5
+fail 1 'rejected the input .exit status 3.' \
+	${AXEC} store -S ${ADIR}/_sock -m text/x-never _p2
+(cat _p2 ; echo magic) | ${AXEC} store -S ${ADIR}/_sock -m text/x-magic > _2
+kill $sd
+${AXEC} get -o _3 `cat _2` > /dev/null
+(cat _p2 ; echo magic) | cmp - _3
+rm -f ${ADIR}/_sock
+test -z "`find ${ADIR} -name '*.hold'`"
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+
+# Archive streams
+echo "#### $0 ingest-tar"
+(cd .. && tar chf - *.h *.c) | ${AXEC} ingest-tar -M > _2
+test `wc -l < _2` -eq `ls ../*.h ../*.c | wc -l`
+while read id mid fn
+do
+	${AXEC} get -o _3 $id > /dev/null
+	cmp ../$fn _3
+	${AXEC} get $mid | grep -q "\"path\": \"$fn\""
+done < _2
+if tar --format newc -cf - test.rc > /dev/null 2>&1 ; then
+	for f in newc odc
+	do
+		tar --format $f -chf - test.rc ../vas.h | ${AXEC} ingest-tar > _2
+		test `wc -l < _2` -eq 2
+	done
+fi
+(cd .. && tar chf - *.c) | head -c 200000 > _4
+fail 1 'Input truncated' ${AXEC} ingest-tar < _4
+fail 1 'Bad tar header checksum' ${AXEC} ingest-tar < _p1
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+
+# Foreign WARC files, we use our own
+echo "#### $0 import-warc"
+rm -rf _imp
+mkdir _imp
+cp `find ${ADIR} -name '*.warc.gz' | sort | head -12` _imp
+new_aardwarc
+# Our warcinfo records must not be the same as those we import
+sed '/^resource.mime-types:/,/^$/d;/^warcinfo.body:/,/^$/d' \
+    ${ADIR}/aardwarc.conf > ${ADIR}/_c
+(
+	cat ${ADIR}/_c
+	echo "warcinfo.body:"
+	echo "	description:	import-warc testrun"
+	echo ""
+	echo "resource.mime-types:"
+	echo "		*"
+	echo ""
+) > ${ADIR}/aardwarc.conf
+rm -f ${ADIR}/_c
+fail 1 "Config doesn't allow application/warc-fields" \
+	${AXEC} import-warc -M _imp/00000000.warc.gz
+sed '/^metadata.mime-types:/,/^$/d' ${ADIR}/aardwarc.conf > ${ADIR}/_c
+(
+	cat ${ADIR}/_c
+	echo "metadata.mime-types:"
+	echo "		application/warc-fields"
+	echo ""
+) > ${ADIR}/aardwarc.conf
+rm -f ${ADIR}/_c
+${AXEC} import-warc -M -n 3 _imp/*.warc.gz > _2
+test `wc -l < _2` -eq `zcat _imp/*.warc.gz | grep -ac '^WARC/1'`
+while read id mid fid
+do
+	${AXEC} get -o _3 $id > /dev/null
+	${AXEC} get $mid | grep -q "^WARC-Record-ID: <$fid>"
+done < _2
+# Again, plain, nothing new
+zcat _imp/*.warc.gz > _4
+${AXEC} import-warc -M -v - < _4 > _5 2> _3
+grep -q 'already had' _3
+sort _2 > _3
+sort _5 | cmp - _3
+head -c 20000 _4 > _5
+fail 1 'Truncated' ${AXEC} import-warc _5
+fail 1 'Not a WARC record' ${AXEC} import-warc test.rc
+${AXEC} audit > _4
+if grep -q ERROR _4 ; then
+	cat _4
+	exit 1
+fi
+rm -rf _imp
+
+echo "#### $0 filter"
+# Small -b makes the candidates spill to sorted runs
+awk '{
+	print $1
+	print $2
+	i = length($1) - 31
+	print substr($1, 1, i - 1) "00000000" substr($1, i + 8)
+}' _2 > _3
+${AXEC} filter -r _3 > _4
+awk '{print $1 ; print $2}' _2 | cmp - _4
+${AXEC} filter -r -b 4k - < _3 > _5
+cmp _4 _5
+test `${AXEC} filter -v -b 4k _3 | grep -c '^0 '` -eq `wc -l < _2`
+
+echo "## $0 DONE"
+rm -f _p1 _p2 _p3 _[2-5]
@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2016 Poul-Henning Kamp
+ * All rights reserved.
+ *
+ * Author: Poul-Henning Kamp <phk@phk.freebsd.dk>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Mime-type validators
+ * --------------------
+ *
+ * The mime-type sections of the config can name a validator command
+ * for each type:
+ *
+ *	resource.mime-types:
+ *		application/json	/usr/local/bin/jsonlint -q
+ *
+ * The command is run with sh(1) and gets the object on stdin while we
+ * compress it, so big objects are not read twice.  It must exit with
+ * status zero before the object is committed.  A validator can exit
+ * as soon as it knows, we stop feeding it when the pipe breaks.
+ *
+ * A thread writes the pipe, so a slow validator only holds up the
+ * compression once VALIDATE_BUFS buffers are queued for it.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vdef.h"
+
+#include "vas.h"
+#include "vsb.h"
+#include "miniobj.h"
+
+#include "aardwarc.h"
+
+#define VALIDATE_BUFS		8
+#define VALIDATE_BUFSIZE	(128 * 1024)
+
+struct validator {
+	unsigned		magic;
+#define VALIDATOR_MAGIC		0x4e1d93a7
+	const char		*cmd;
+	pid_t			pid;
+	int			fd;
+	pthread_t		thr;
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	char			*buf[VALIDATE_BUFS];
+	size_t			len[VALIDATE_BUFS];
+	unsigned		head;
+	unsigned		tail;
+	int			eof;
+	int			broken;
+};
+
+static void *
+validator_thread(void *priv)
+{
+	struct validator *vl;
+	const char *p;
+	size_t l;
+	ssize_t i;
+	unsigned n;
+
+	CAST_OBJ_NOTNULL(vl, priv, VALIDATOR_MAGIC);
+	while (1) {
+		AZ(pthread_mutex_lock(&vl->mtx));
+		while (vl->tail == vl->head && !vl->eof)
+			AZ(pthread_cond_wait(&vl->cond, &vl->mtx));
+		if (vl->tail == vl->head) {
+			AZ(pthread_mutex_unlock(&vl->mtx));
+			break;
+		}
+		n = vl->tail % VALIDATE_BUFS;
+		AZ(pthread_mutex_unlock(&vl->mtx));
+
+		p = vl->buf[n];
+		l = vl->len[n];
+		while (!vl->broken && l > 0) {
+			i = write(vl->fd, p, l);
+			if (i < 0 && errno == EINTR)
+				continue;
+			if (i <= 0) {
+				/* It made up its mind, or died */
+				vl->broken = 1;
+				break;
+			}
+			p += i;
+			l -= (size_t)i;
+		}
+
+		AZ(pthread_mutex_lock(&vl->mtx));
+		vl->tail++;
+		AZ(pthread_cond_broadcast(&vl->cond));
+		AZ(pthread_mutex_unlock(&vl->mtx));
+	}
+	return (NULL);
+}
+
+struct validator *
+Validator_New(const char *cmd)
+{
+	struct validator *vl;
+	int fds[2];
+	unsigned u;
+
+	AN(cmd);
+
+	/* Find out about validators which exit early from write(2) */
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	ALLOC_OBJ(vl, VALIDATOR_MAGIC);
+	AN(vl);
+	vl->cmd = cmd;
+	AZ(pipe(fds));
+	vl->pid = fork();
+	if (!vl->pid) {
+		assert(dup2(fds[0], 0) == 0);
+		/* Any complaints go to our stderr */
+		assert(dup2(2, 1) == 1);
+		closefrom(3);
+		(void)execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+	assert(vl->pid > 0);
+	AZ(close(fds[0]));
+	vl->fd = fds[1];
+	for (u = 0; u < VALIDATE_BUFS; u++) {
+		vl->buf[u] = malloc(VALIDATE_BUFSIZE);
+		AN(vl->buf[u]);
+	}
+	AZ(pthread_mutex_init(&vl->mtx, NULL));
+	AZ(pthread_cond_init(&vl->cond, NULL));
+	AZ(pthread_create(&vl->thr, NULL, validator_thread, vl));
+	return (vl);
+}
+
+void
+Validator_Feed(struct validator *vl, const void *ptr, size_t len)
+{
+	const char *p = ptr;
+	size_t l;
+	unsigned n;
+
+	CHECK_OBJ_NOTNULL(vl, VALIDATOR_MAGIC);
+	while (len > 0 && !vl->broken) {
+		AZ(pthread_mutex_lock(&vl->mtx));
+		while (vl->head - vl->tail == VALIDATE_BUFS)
+			AZ(pthread_cond_wait(&vl->cond, &vl->mtx));
+		n = vl->head % VALIDATE_BUFS;
+		AZ(pthread_mutex_unlock(&vl->mtx));
+
+		l = len < VALIDATE_BUFSIZE ? len : VALIDATE_BUFSIZE;
+		memcpy(vl->buf[n], p, l);
+		vl->len[n] = l;
+		p += l;
+		len -= l;
+
+		AZ(pthread_mutex_lock(&vl->mtx));
+		vl->head++;
+		AZ(pthread_cond_broadcast(&vl->cond));
+		AZ(pthread_mutex_unlock(&vl->mtx));
+	}
+}
+
+/* Wait for the verdict, non-zero and an explanation in 'err' if bad */
+
+int
+Validator_Finish(struct validator **vlp, struct vsb *err)
+{
+	struct validator *vl;
+	unsigned u;
+	pid_t p;
+	int st, retval = 0;
+
+	TAKE_OBJ_NOTNULL(vl, vlp, VALIDATOR_MAGIC);
+	AN(err);
+
+	AZ(pthread_mutex_lock(&vl->mtx));
+	vl->eof = 1;
+	AZ(pthread_cond_broadcast(&vl->cond));
+	AZ(pthread_mutex_unlock(&vl->mtx));
+	AZ(pthread_join(vl->thr, NULL));
+	AZ(close(vl->fd));
+
+	do
+		p = waitpid(vl->pid, &st, 0);
+	while (p < 0 && errno == EINTR);
+	assert(p == vl->pid);
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+		VSB_printf(err, "Validator '%s' rejected the input", vl->cmd);
+		if (WIFEXITED(st))
+			VSB_printf(err, " (exit status %d)",
+			    WEXITSTATUS(st));
+		else if (WIFSIGNALED(st))
+			VSB_printf(err, " (signal %d)", WTERMSIG(st));
+		retval = -1;
+	}
+
+	AZ(pthread_cond_destroy(&vl->cond));
+	AZ(pthread_mutex_destroy(&vl->mtx));
+	for (u = 0; u < VALIDATE_BUFS; u++)
+		free(vl->buf[u]);
+	FREE_OBJ(vl);
+	return (retval);
+}
+
+/* The same, for a validator which may be NULL, returns why if bad */
+
+struct vsb *
+Validator_Verdict(struct validator **vlp)
+{
+	struct vsb *vsb;
+
+	AN(vlp);
+	if (*vlp == NULL)
+		return (NULL);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	if (!Validator_Finish(vlp, vsb)) {
+		VSB_destroy(&vsb);
+		return (NULL);
+	}
+	AZ(VSB_finish(vsb));
+	return (vsb);
+}
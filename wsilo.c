@@ -29,6 +29,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,12 +45,38 @@
 #include "miniobj.h"
 
 #include <sys/param.h>
+#include <sys/endian.h>
 #include <sys/mman.h>
 
 #include "aardwarc.h"
 
 #define PADDING_HEADER "z"
 
+/*
+ * Holds are kept in memory until they grow past WSILO_MEM_MAX, so that
+ * small objects which are appended to a previous silo only ever get
+ * written once, see wsilo_copy().
+ */
+
+#define WSILO_MEM_MIN	(2 * 1024 * 1024)
+#define WSILO_MEM_MAX	(16 * 1024 * 1024)
+
+/*
+ * Once spilled, with 'silo.write_buffers' > 1, a thread writes the
+ * buffers behind our back, while we compress into the next free one.
+ */
+
+struct wbuf {
+	unsigned		magic;
+#define WBUF_MAGIC		0x3f0b6a2d
+	VTAILQ_ENTRY(wbuf)	list;
+	char			*ptr;
+	ssize_t			len;
+	off_t			off;
+};
+
+VTAILQ_HEAD(wbuf_head, wbuf);
+
 struct wsilo {
 	unsigned		magic;
 #define WSILO_MAGIC		0x4a454db2
@@ -62,6 +89,8 @@ struct wsilo {
 
 	struct vsb		*hold_fn;
 	int			hold_fd;
+	int			leased;
+	int			prealloc_eof;
 
 	off_t			hold_len;
 
@@ -72,7 +101,30 @@ struct wsilo {
 	char			*buf_ptr;
 	ssize_t			buf_len;
 
+	char			*mem;
+	size_t			mem_space;
+
+	/* Write behind */
+	pthread_t		wb_thr;
+	pthread_mutex_t		wb_mtx;
+	pthread_cond_t		wb_cond;
+	struct wbuf_head	wb_free;
+	struct wbuf_head	wb_busy;
+	struct wbuf		*wb_cur;
+	int			wb_running;
+	int			wb_stop;
+
 	char			*warcinfo_id;
+
+	/* Batch of objects, see Wsilo_Batch() */
+	int			batch;
+	off_t			batch_start;
+	uint8_t			*batch_rec;
+	char			**batch_id;
+	size_t			batch_n;
+	size_t			batch_space;
+	size_t			*batch_hash;
+	size_t			batch_nhash;
 };
 
 /*---------------------------------------------------------------------*/
@@ -131,8 +183,16 @@ Wsilo_New(struct aardwarc *aa, uint32_t silono)
 		return (NULL);
 	}
 
-	vsb2 = Silo_Filename(aa, silono, 1);
-	AN(vsb2);
+	if (aa->staging_dirname != NULL) {
+		vsb2 = Silo_Filename(aa, silono, 1);
+		AN(vsb2);
+	} else {
+		/* The hold must be next to the silo, see Silo_Filename() */
+		vsb2 = VSB_new_auto();
+		AN(vsb2);
+		VSB_printf(vsb2, "%s.hold", VSB_data(vsb));
+		AZ(VSB_finish(vsb2));
+	}
 
 	j = silo_mkparentdir(VSB_data(vsb));
 	if (j) {
@@ -184,6 +244,10 @@ Wsilo_New(struct aardwarc *aa, uint32_t silono)
 	sl->buf_ptr = malloc(sl->buf_len);
 	AN(sl->buf_ptr);
 
+	sl->mem_space = WSILO_MEM_MIN;
+	sl->mem = malloc(sl->mem_space);
+	AN(sl->mem);
+
 	sl->aa = aa;
 
 	sl->warcinfo_id = Warcinfo_New(sl->aa, sl, sl->silo_no);
@@ -194,33 +258,175 @@ Wsilo_New(struct aardwarc *aa, uint32_t silono)
 struct wsilo *
 Wsilo_Next(struct aardwarc *aa)
 {
-	uint32_t silono, high;
+	uint32_t silono;
 	struct wsilo *sl;
 
 	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
 
-	AardWARC_ReadCache(aa);
-	high = aa->cache_first_non_silo;
-	for (silono = high; ; silono++) {
+	while (1) {
+		silono = AardWARC_LeaseSilo(aa);
 		sl = Wsilo_New(aa, silono);
 		if (sl != NULL)
 			break;
+		/* Somebody not taking leases got there first */
+		AardWARC_ReleaseSilo(aa, silono);
 	}
+	sl->leased = 1;
 	return (sl);
 }
 
 
+/* Write behind ------------------------------------------------------*/
+
+static void *
+wsilo_wb_thread(void *priv)
+{
+	struct wsilo *sl;
+	struct wbuf *wb;
+	ssize_t s;
+
+	CAST_OBJ_NOTNULL(sl, priv, WSILO_MAGIC);
+	AZ(pthread_mutex_lock(&sl->wb_mtx));
+	while (1) {
+		wb = VTAILQ_FIRST(&sl->wb_busy);
+		if (wb == NULL && sl->wb_stop)
+			break;
+		if (wb == NULL) {
+			AZ(pthread_cond_wait(&sl->wb_cond, &sl->wb_mtx));
+			continue;
+		}
+		AZ(pthread_mutex_unlock(&sl->wb_mtx));
+		s = pwrite(sl->hold_fd, wb->ptr, wb->len, wb->off);
+		assert(s == wb->len);
+		AZ(pthread_mutex_lock(&sl->wb_mtx));
+		VTAILQ_REMOVE(&sl->wb_busy, wb, list);
+		VTAILQ_INSERT_TAIL(&sl->wb_free, wb, list);
+		AZ(pthread_cond_broadcast(&sl->wb_cond));
+	}
+	AZ(pthread_mutex_unlock(&sl->wb_mtx));
+	return (NULL);
+}
+
+static void
+wsilo_wb_start(struct wsilo *sl)
+{
+	struct wbuf *wb;
+	unsigned u;
+
+	if (sl->aa->write_buffers < 2)
+		return;
+	AZ(pthread_mutex_init(&sl->wb_mtx, NULL));
+	AZ(pthread_cond_init(&sl->wb_cond, NULL));
+	VTAILQ_INIT(&sl->wb_free);
+	VTAILQ_INIT(&sl->wb_busy);
+	for (u = 0; u < sl->aa->write_buffers; u++) {
+		ALLOC_OBJ(wb, WBUF_MAGIC);
+		AN(wb);
+		wb->ptr = malloc(sl->buf_len);
+		AN(wb->ptr);
+		VTAILQ_INSERT_TAIL(&sl->wb_free, wb, list);
+	}
+	sl->wb_running = 1;
+	AZ(pthread_create(&sl->wb_thr, NULL, wsilo_wb_thread, sl));
+}
+
+/* Wait for all buffers to hit the disk */
+
+static void
+wsilo_wb_drain(struct wsilo *sl)
+{
+
+	if (!sl->wb_running)
+		return;
+	AZ(pthread_mutex_lock(&sl->wb_mtx));
+	if (sl->wb_cur != NULL) {
+		/* Got from Wsilo_GetSpace() but never stored */
+		VTAILQ_INSERT_HEAD(&sl->wb_free, sl->wb_cur, list);
+		sl->wb_cur = NULL;
+	}
+	while (!VTAILQ_EMPTY(&sl->wb_busy))
+		AZ(pthread_cond_wait(&sl->wb_cond, &sl->wb_mtx));
+	AZ(pthread_mutex_unlock(&sl->wb_mtx));
+}
+
+static void
+wsilo_wb_stop(struct wsilo *sl)
+{
+	struct wbuf *wb;
+
+	if (!sl->wb_running)
+		return;
+	wsilo_wb_drain(sl);
+	AZ(pthread_mutex_lock(&sl->wb_mtx));
+	sl->wb_stop = 1;
+	AZ(pthread_cond_broadcast(&sl->wb_cond));
+	AZ(pthread_mutex_unlock(&sl->wb_mtx));
+	AZ(pthread_join(sl->wb_thr, NULL));
+	sl->wb_running = 0;
+	AZ(sl->wb_cur);
+	while (!VTAILQ_EMPTY(&sl->wb_free)) {
+		wb = VTAILQ_FIRST(&sl->wb_free);
+		VTAILQ_REMOVE(&sl->wb_free, wb, list);
+		free(wb->ptr);
+		FREE_OBJ(wb);
+	}
+	AZ(pthread_cond_destroy(&sl->wb_cond));
+	AZ(pthread_mutex_destroy(&sl->wb_mtx));
+}
+
+/* Get a free buffer, waiting for the writer if necessary */
+
+static char *
+wsilo_wb_get(struct wsilo *sl)
+{
+
+	if (sl->wb_cur == NULL) {
+		AZ(pthread_mutex_lock(&sl->wb_mtx));
+		while (VTAILQ_EMPTY(&sl->wb_free))
+			AZ(pthread_cond_wait(&sl->wb_cond, &sl->wb_mtx));
+		sl->wb_cur = VTAILQ_FIRST(&sl->wb_free);
+		VTAILQ_REMOVE(&sl->wb_free, sl->wb_cur, list);
+		AZ(pthread_mutex_unlock(&sl->wb_mtx));
+	}
+	CHECK_OBJ_NOTNULL(sl->wb_cur, WBUF_MAGIC);
+	return (sl->wb_cur->ptr);
+}
+
+static void
+wsilo_wb_put(struct wsilo *sl, ssize_t len)
+{
+	struct wbuf *wb;
+
+	TAKE_OBJ_NOTNULL(wb, &sl->wb_cur, WBUF_MAGIC);
+	wb->len = len;
+	wb->off = sl->hold_len;
+	AZ(pthread_mutex_lock(&sl->wb_mtx));
+	VTAILQ_INSERT_TAIL(&sl->wb_busy, wb, list);
+	AZ(pthread_cond_broadcast(&sl->wb_cond));
+	AZ(pthread_mutex_unlock(&sl->wb_mtx));
+}
+
 static void
 wsilo_delete(struct wsilo *sl)
 {
+	size_t u;
 
 	/* We don't own ->hd, so don't free that */
+	wsilo_wb_stop(sl);
+	for (u = 0; u < sl->batch_n; u++)
+		free(sl->batch_id[u]);
+	free(sl->batch_id);
+	free(sl->batch_rec);
+	free(sl->batch_hash);
 	AZ(unlink(VSB_data(sl->hold_fn)));
+	if (sl->leased)
+		AardWARC_ReleaseSilo(sl->aa, sl->silo_no);
 	VSB_delete(sl->hold_fn);
 	AZ(close(sl->hold_fd));
 	VSB_delete(sl->silo_fn);
 	REPLACE(sl->warcinfo_id, NULL);
 	REPLACE(sl->buf_ptr, NULL);
+	REPLACE(sl->mem, NULL);
 	FREE_OBJ(sl);
 }
 
@@ -270,22 +476,106 @@ Wsilo_Header(struct wsilo *sl, struct header *hd, int pad)
 	VSB_delete(v2);
 }
 
+/*
+ * Preallocation
+ * -------------
+ *
+ * Holds grow one buffer at a time, and silos get appended to over weeks
+ * so on most filesystems they end up in thousands of extents, which
+ * makes every later sequential read of them slow.
+ *
+ * With 'silo.preallocate' set to 'hold' we allocate silo.max_size for
+ * the hold when it goes to disk.  posix_fallocate(2) moves EOF, so we
+ * trim it back in Wsilo_Install(), which also releases what we did not
+ * use.
+ *
+ * With 'silo' we reserve the space past EOF instead, so the silo keeps
+ * the reservation and the objects appended to it later land in the same
+ * extents.  That takes Linux' FALLOC_FL_KEEP_SIZE, elsewhere the config
+ * is refused.
+ *
+ * Filesystems which cannot (ZFS) just fail, and we carry on without.
+ */
+
+static void
+wsilo_prealloc(struct wsilo *sl)
+{
+	off_t len;
+
+	len = sl->aa->silo_maxsize;
+	switch (sl->aa->silo_prealloc) {
+	case PREALLOC_NONE:
+		return;
+#ifdef FALLOC_FL_KEEP_SIZE
+	case PREALLOC_SILO:
+		if (!fallocate(sl->hold_fd, FALLOC_FL_KEEP_SIZE, 0, len))
+			return;
+		break;
+#endif
+	default:
+		break;
+	}
+	if (!posix_fallocate(sl->hold_fd, 0, len))
+		sl->prealloc_eof = 1;
+}
+
 /* Buffered Write functions -------------------------------------------*/
 
+static void
+wsilo_spill(struct wsilo *sl)
+{
+	ssize_t s;
+	off_t a;
+
+	if (sl->mem == NULL)
+		return;
+	wsilo_prealloc(sl);
+	s = pwrite(sl->hold_fd, sl->mem, sl->hold_len, 0);
+	assert(s == sl->hold_len);
+	a = lseek(sl->hold_fd, sl->hold_len, SEEK_SET);
+	assert(a == sl->hold_len);
+	REPLACE(sl->mem, NULL);
+	sl->mem_space = 0;
+	wsilo_wb_start(sl);
+}
+
 void
-Wsilo_GetSpace(const struct wsilo *sl, void **ptr, ssize_t *len)
+Wsilo_GetSpace(struct wsilo *sl, void **ptr, ssize_t *len)
 {
 	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
 	AN(ptr);
 	AN(len);
 
-	*ptr = sl->buf_ptr;
+	if (sl->mem != NULL &&
+	    sl->hold_len + sl->buf_len > (off_t)sl->mem_space) {
+		if (sl->mem_space * 2 <= WSILO_MEM_MAX) {
+			sl->mem_space *= 2;
+			sl->mem = realloc(sl->mem, sl->mem_space);
+			AN(sl->mem);
+		} else
+			wsilo_spill(sl);
+	}
+
+	if (sl->mem != NULL)
+		*ptr = sl->mem + sl->hold_len;
+	else if (sl->wb_running)
+		*ptr = wsilo_wb_get(sl);
+	else
+		*ptr = sl->buf_ptr;
 	if (sl->aa->silo_maxsize - sl->hold_len > sl->buf_len)
 		*len = sl->buf_len;
 	else
 		*len = sl->aa->silo_maxsize - sl->hold_len;
 }
 
+off_t
+Wsilo_Left(const struct wsilo *sl)
+{
+	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
+
+	return (sl->aa->silo_maxsize - sl->hold_len);
+}
+
 int
 Wsilo_Store(struct wsilo *sl, ssize_t len)
 {
@@ -296,6 +586,16 @@ Wsilo_Store(struct wsilo *sl, ssize_t len)
 	assert(len > 0);
 	assert(len <= sl->buf_len);
 
+	if (sl->mem != NULL) {
+		assert(sl->hold_len + len <= (off_t)sl->mem_space);
+		sl->hold_len += len;
+		return (0);
+	}
+	if (sl->wb_running) {
+		wsilo_wb_put(sl, len);
+		sl->hold_len += len;
+		return (0);
+	}
 	s = write(sl->hold_fd, sl->buf_ptr, len);
 	assert(s == len);
 	sl->hold_len += len;
@@ -312,41 +612,341 @@ Wsilo_Finish(struct wsilo *sl)
 	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
 	AN(sl->buf_ptr);
 
+	wsilo_wb_drain(sl);
+
 	/* Write the gzip'ed length to the 'Aa' extra header */
-	a = lseek(sl->hold_fd, sl->hd_start + sl->hd_len, SEEK_SET);
-	assert(a == sl->hd_start + sl->hd_len);
-	Gzip_WriteAa(sl->hold_fd,
-	    sl->hold_len - (sl->hd_start + sl->hd_len + (off_t)sizeof Gzip_crnlcrnl));
+	a = sl->hd_start + sl->hd_len;
+	if (sl->mem != NULL) {
+		Gzip_SetAa(sl->mem + a, sl->hold_len - a,
+		    sl->hold_len - (a + (off_t)sizeof Gzip_crnlcrnl));
+	} else {
+		assert(lseek(sl->hold_fd, a, SEEK_SET) == a);
+		Gzip_WriteAa(sl->hold_fd,
+		    sl->hold_len - (a + (off_t)sizeof Gzip_crnlcrnl));
+	}
 
+	if (sl->batch) {
+		/* More objects will follow, keep the buffer */
+		a = lseek(sl->hold_fd, sl->hold_len, SEEK_SET);
+		assert(a == sl->hold_len);
+		return;
+	}
 	REPLACE(sl->buf_ptr, NULL);
 	sl->buf_len = 0;
 }
 
 /* Committing silos ---------------------------------------------------*/
 
+/*
+ * Free-space map
+ * --------------
+ *
+ * To avoid probing silo after silo for room to append an object, we
+ * keep the number of free bytes in each silo in the '_.space' file in
+ * the silo directory.  Entry N is eight bytes big-endian at offset
+ * N * 8, holding the free space plus one, so that zero (the hole you
+ * get past the end of the file) means "unknown, go look".  Silos which
+ * are write-protected or otherwise unusable are recorded as one.
+ *
+ * Each entry is updated with a single pwrite(2) while we hold the silo,
+ * so the map is never more than a hint: silo_attempt_append() still
+ * checks the actual size, and we correct the map when it is wrong.
+ *
+ * Each process keeps a copy of the map, which is only read again when
+ * the file has been changed by somebody else, and an array of the silos
+ * with room, sorted by how much, so the best fit is a binary search.
+ */
+
+#define SPACE_SEALED	1
+
+struct space_ent {
+	uint64_t		v;
+	uint32_t		sn;
+};
+
+struct silospace {
+	unsigned		magic;
+#define SILOSPACE_MAGIC		0x7c2e05b9
+	int			fd;
+	struct stat		st;		// Last seen
+
+	uint64_t		*map;
+	uint32_t		nmap;
+	uint32_t		lmap;
+	uint32_t		probed;		// No unknowns below
+
+	struct space_ent	*ent;		// By v, then sn
+	size_t			nent;
+	size_t			lent;
+};
+
+static pthread_mutex_t space_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+wsilo_space_open(const struct aardwarc *aa)
+{
+	struct vsb *vsb;
+	int fd;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "%s/_.space", aa->silo_dirname);
+	AZ(VSB_finish(vsb));
+	fd = open(VSB_data(vsb), O_RDWR | O_CREAT, 0644);
+	VSB_delete(vsb);
+	return (fd);
+}
+
+/* First entry which is not less than (v, sn) */
+
+static size_t
+wsilo_space_find(const struct silospace *sp, uint64_t v, uint32_t sn)
+{
+	size_t lo = 0, hi = sp->nent, m;
+
+	while (lo < hi) {
+		m = (lo + hi) / 2;
+		if (sp->ent[m].v < v || (sp->ent[m].v == v && sp->ent[m].sn < sn))
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	return (lo);
+}
+
+/* Update our copy of the map, called with space_mtx held */
+
+static void
+wsilo_space_update(struct silospace *sp, uint32_t silono, uint64_t v)
+{
+	uint64_t ov;
+	size_t u;
+
+	if (silono >= sp->lmap) {
+		sp->lmap = silono + 1024;
+		sp->map = realloc(sp->map, sp->lmap * sizeof *sp->map);
+		AN(sp->map);
+	}
+	while (sp->nmap <= silono)
+		sp->map[sp->nmap++] = 0;
+	ov = sp->map[silono];
+	sp->map[silono] = v;
+	if (ov > SPACE_SEALED) {
+		u = wsilo_space_find(sp, ov, silono);
+		assert(u < sp->nent && sp->ent[u].sn == silono);
+		memmove(sp->ent + u, sp->ent + u + 1,
+		    (sp->nent - (u + 1)) * sizeof *sp->ent);
+		sp->nent--;
+	}
+	if (v > SPACE_SEALED) {
+		if (sp->nent == sp->lent) {
+			sp->lent += 1024;
+			sp->ent = realloc(sp->ent, sp->lent * sizeof *sp->ent);
+			AN(sp->ent);
+		}
+		u = wsilo_space_find(sp, v, silono);
+		memmove(sp->ent + u + 1, sp->ent + u,
+		    (sp->nent - u) * sizeof *sp->ent);
+		sp->ent[u].v = v;
+		sp->ent[u].sn = silono;
+		sp->nent++;
+	}
+}
+
+static int
+wsilo_space_changed(const struct silospace *sp, const struct stat *st)
+{
+
+	return (st->st_size != sp->st.st_size ||
+	    st->st_mtim.tv_sec != sp->st.st_mtim.tv_sec ||
+	    st->st_mtim.tv_nsec != sp->st.st_mtim.tv_nsec);
+}
+
+/* Get our copy of the map up to date, called with space_mtx held */
+
+static struct silospace *
+wsilo_space_get(struct aardwarc *aa)
+{
+	struct silospace *sp;
+	struct stat st;
+	uint8_t *buf;
+	ssize_t i;
+	uint32_t u;
+
+	sp = aa->silospace;
+	if (sp == NULL) {
+		ALLOC_OBJ(sp, SILOSPACE_MAGIC);
+		AN(sp);
+		sp->fd = wsilo_space_open(aa);
+		aa->silospace = sp;
+	}
+	CHECK_OBJ_NOTNULL(sp, SILOSPACE_MAGIC);
+	if (sp->fd < 0 || fstat(sp->fd, &st) || !wsilo_space_changed(sp, &st))
+		return (sp);
+
+	sp->nmap = 0;
+	sp->nent = 0;
+	sp->probed = 0;
+	sp->st = st;
+	if (st.st_size < 8)
+		return (sp);
+	buf = malloc(st.st_size);
+	AN(buf);
+	i = pread(sp->fd, buf, st.st_size, 0);
+	assert(i >= 0);
+	for (u = 0; u < i / 8; u++)
+		wsilo_space_update(sp, u, be64dec(buf + u * 8));
+	free(buf);
+	return (sp);
+}
+
+static void
+wsilo_space_set(struct silospace *sp, uint32_t silono, uint64_t v)
+{
+	uint8_t buf[8];
+
+	CHECK_OBJ_NOTNULL(sp, SILOSPACE_MAGIC);
+	wsilo_space_update(sp, silono, v);
+	if (sp->fd < 0)
+		return;
+	be64enc(buf, v);
+	(void)pwrite(sp->fd, buf, sizeof buf, (off_t)silono * sizeof buf);
+	/* Our own write does not call for reading it all back */
+	(void)fstat(sp->fd, &sp->st);
+}
+
+static uint64_t
+wsilo_space_probe(const struct aardwarc *aa, struct silospace *sp,
+    uint32_t silono)
+{
+	struct vsb *fn;
+	struct stat st;
+	uint64_t v = SPACE_SEALED;
+
+	fn = Silo_Filename(aa, silono, 0);
+	AN(fn);
+	if (!stat(VSB_data(fn), &st) && S_ISREG(st.st_mode) &&
+	    (st.st_mode & S_IWUSR) && st.st_size < aa->silo_maxsize)
+		v = (aa->silo_maxsize - st.st_size) + 1;
+	VSB_delete(fn);
+	wsilo_space_set(sp, silono, v);
+	return (v);
+}
+
+static void
+wsilo_space_install(const struct wsilo *sl)
+{
+	struct silospace *sp;
+
+	AZ(pthread_mutex_lock(&space_mtx));
+	sp = wsilo_space_get(sl->aa);
+	wsilo_space_set(sp, sl->silo_no, sl->aa->silo_maxsize > sl->hold_len ?
+	    (sl->aa->silo_maxsize - sl->hold_len) + 1 : SPACE_SEALED);
+	AZ(pthread_mutex_unlock(&space_mtx));
+}
+
+/*
+ * Copy the hold from 'start' to the end, preceeded by the 'v2' header if
+ * any, to the end of 'fds', and return where it went, or -1.
+ *
+ * If the hold is still in memory, that takes just a single writev(2).
+ * Otherwise we ask the kernel to copy_file_range(2), which saves passing
+ * the bytes through userland, or even copying them at all on filesystems
+ * which can share blocks between files, and fall back to mmap(2).
+ */
+
+static off_t
+wsilo_copy(const struct wsilo *sl, int fds, const struct vsb *v2, off_t start,
+    off_t need)
+{
+	struct iovec iov[2];
+	off_t before, after, inoff, outoff;
+	ssize_t s;
+	size_t wlen = 0;
+	int ps = getpagesize();
+	char *p = NULL;
+	int i = 0;
+
+	before = lseek(fds, 0, SEEK_END);
+	assert(before >= 0);
+	if (v2 != NULL) {
+		iov[i].iov_base = VSB_data(v2);
+		iov[i++].iov_len = VSB_len(v2);
+		wlen += VSB_len(v2);
+	}
+	inoff = start;
+	outoff = before;
+	if (sl->mem == NULL) {
+		if (i > 0) {
+			s = writev(fds, iov, i);
+			assert(s >= 0);
+			assert((size_t)s == wlen);
+			outoff += wlen;
+			i = 0;
+			wlen = 0;
+		}
+		while (inoff < sl->hold_len) {
+			s = copy_file_range(sl->hold_fd, &inoff,
+			    fds, &outoff, sl->hold_len - inoff, 0);
+			if (s <= 0)
+				break;
+		}
+		if (inoff < sl->hold_len) {
+			p = mmap(
+			    NULL,
+			    roundup(sl->hold_len, ps),
+			    PROT_READ,
+			    MAP_PRIVATE | MAP_NOCORE ,
+			    sl->hold_fd,
+			    0);
+			if (p == MAP_FAILED) {
+				AZ(ftruncate(fds, before));
+				return (-1);
+			}
+			iov[i].iov_base = p + inoff;
+			iov[i++].iov_len = sl->hold_len - inoff;
+			wlen += sl->hold_len - inoff;
+		}
+	} else {
+		iov[i].iov_base = sl->mem + start;
+		iov[i++].iov_len = sl->hold_len - start;
+		wlen += sl->hold_len - start;
+	}
+	if (i > 0) {
+		assert(lseek(fds, outoff, SEEK_SET) == outoff);
+		s = writev(fds, iov, i);
+		assert(s >= 0);
+		assert((size_t)s == wlen);
+	}
+	if (p != NULL)
+		AZ(munmap(p, roundup(sl->hold_len, ps)));
+	after = lseek(fds, 0, SEEK_END);
+	assert(after - before == need);
+	return (before);
+}
+
+/*
+ * Append the hold from 'start' to the end, optionally preceeded by the
+ * 'v2' header, to silo 'silono'.  On success the offset of the first
+ * byte written is returned in '*where'.
+ */
+
 static int
 silo_attempt_append(const struct wsilo *sl, uint32_t silono,
-    const struct vsb *v2, const char *id)
+    const struct vsb *v2, off_t start, off_t *where)
 {
 	struct stat st;
 	struct aardwarc *aa;
 	struct vsb *fn, *fnh = NULL;
 	off_t need;
 	int fdh = -1, fds = -1;
-	char *p;
-	struct iovec iov[2];
-	ssize_t s;
-	size_t wlen;
-	off_t before, after;
-	int ps = getpagesize();
 	int retval = 0;
-	off_t ax;
-	off_t bx;
 
 	aa = sl->aa;
 
-	need = VSB_len(v2);
-	need += sl->hold_len - (sl->hd_start + sl->hd_len);
+	AN(where);
+	need = v2 != NULL ? VSB_len(v2) : 0;
+	need += sl->hold_len - start;
 
 	fn = Silo_Filename(aa, silono, 0);
 	AN(fn);
@@ -361,32 +961,11 @@ silo_attempt_append(const struct wsilo *sl, uint32_t silono,
 			AardWARC_WriteCache(aa);
 		}
 		if (!(st.st_mode & S_IWUSR)) {
-			/*
-			 * Permanently stored silos should be writeprotected.
-			 * Assume this happen bottom up order, and stop
-			 * once we hit the first of them.
-			 */
+			/* Permanently stored silos should be writeprotected. */
 			retval = -1;
 			break;
 		}
 
-		/*
-		 * The follwing weird heuristic autotunes how full we try
-		 * to load the silos, vs. how many silos we have to examine
-		 * duing a store operation.
-		 *
-		 * XXX: A scaling factor, roughly the smallest object size
-		 * XXX: in the kilobytes may be necessary.
-		 */
-
-		ax = aa->silo_maxsize - st.st_size;
-		bx = aa->cache_first_non_silo - aa->cache_first_space_silo;
-
-		if (silono == aa->cache_first_space_silo && ax < bx) {
-			aa->cache_first_space_silo++;
-			AardWARC_WriteCache(aa);
-		}
-
 		if (st.st_size + need > aa->silo_maxsize)
 			break;
 
@@ -397,7 +976,8 @@ silo_attempt_append(const struct wsilo *sl, uint32_t silono,
 		if (fdh < 0)
 			break;
 
-		fds = open(VSB_data(fn), O_WRONLY | O_APPEND);
+		/* No O_APPEND, copy_file_range(2) will not have it */
+		fds = open(VSB_data(fn), O_WRONLY);
 		if (fds < 0)
 			break;
 
@@ -410,38 +990,11 @@ silo_attempt_append(const struct wsilo *sl, uint32_t silono,
 		if (st.st_size + need > aa->silo_maxsize)
 			break;
 
-		p = mmap(
-		    NULL,
-		    roundup(sl->hold_len, ps),
-		    PROT_READ,
-		    MAP_PRIVATE | MAP_NOCORE ,
-		    sl->hold_fd,
-		    0);
-
-		if (p == MAP_FAILED)
+		*where = wsilo_copy(sl, fds, v2, start, need);
+		if (*where < 0)
 			break;
-
-		iov[0].iov_base = VSB_data(v2);
-		iov[0].iov_len = VSB_len(v2);
-		iov[1].iov_base = p + sl->hd_start + sl->hd_len;
-		iov[1].iov_len = sl->hold_len - (sl->hd_start + sl->hd_len);
-
-		wlen = iov[0].iov_len + iov[1].iov_len;
-
-		before = lseek(fds, 0, SEEK_END);
-		s = writev(fds, iov, 2);
-		after = lseek(fds, 0, SEEK_END);
-		assert(s >= 0);
-		assert((size_t)s == wlen);
-		assert((off_t)s == (after - before));
-
-		AZ(munmap(p, roundup(sl->hold_len, ps)));
 		// fprintf(stderr, "DEBUG: Wsilo_Append(%u) %ju\n", silono, need);
 
-		need = lseek(fds, 0, SEEK_CUR);
-		assert(need > s);
-		IDX_Insert(aa, id, sl->idx, silono, need - s, NULL);
-
 		retval = 1;
 
 	} while (0);
@@ -459,47 +1012,257 @@ silo_attempt_append(const struct wsilo *sl, uint32_t silono,
 	return (retval);
 }
 
+/*
+ * Append the hold from 'start' to the end to the previous silo which
+ * fits it best, according to the free-space map.
+ */
+
+#define SPACE_TRIES	8	/* Silos busy or full after all */
+
+static int
+wsilo_append(const struct wsilo *sl, const struct vsb *v2, off_t start,
+    uint32_t *snp, off_t *where)
+{
+	struct aardwarc *aa;
+	struct silospace *sp;
+	uint32_t tried[SPACE_TRIES];
+	unsigned ntried = 0, t;
+	uint32_t sn, first, best = 0;
+	uint64_t v, need;
+	size_t u;
+	int i, retval = 0;
+
+	aa = sl->aa;
+	AN(snp);
+	AN(where);
+	if (sl->silo_no <= aa->cache_first_space_silo)
+		return (0);
+
+	need = v2 != NULL ? VSB_len(v2) : 0;
+	need += sl->hold_len - start;
+
+	AZ(pthread_mutex_lock(&space_mtx));
+	sp = wsilo_space_get(aa);
+
+	/* Fill in what the map does not know, once */
+	sn = sp->probed;
+	if (sn < aa->cache_first_space_silo)
+		sn = aa->cache_first_space_silo;
+	for (; sn < sl->silo_no; sn++)
+		if (sn >= sp->nmap || sp->map[sn] == 0)
+			(void)wsilo_space_probe(aa, sp, sn);
+	if (sp->probed < sl->silo_no)
+		sp->probed = sl->silo_no;
+
+	/* Skip over the leading sealed silos for next time */
+	first = aa->cache_first_space_silo;
+	while (first < sl->silo_no && sp->map[first] == SPACE_SEALED)
+		first++;
+	if (first != aa->cache_first_space_silo) {
+		aa->cache_first_space_silo = first;
+		AardWARC_WriteCache(aa);
+	}
+
+	while (ntried < SPACE_TRIES) {
+		/* The smallest room which is big enough */
+		for (u = wsilo_space_find(sp, need + 1, 0); u < sp->nent; u++) {
+			best = sp->ent[u].sn;
+			if (best < first || best >= sl->silo_no)
+				continue;
+			for (t = 0; t < ntried; t++)
+				if (tried[t] == best)
+					break;
+			if (t == ntried)
+				break;
+		}
+		if (u == sp->nent)
+			break;
+		tried[ntried++] = best;
+
+		AZ(pthread_mutex_unlock(&space_mtx));
+		i = silo_attempt_append(sl, best, v2, start, where);
+		AZ(pthread_mutex_lock(&space_mtx));
+		sp = wsilo_space_get(aa);
+
+		if (i == 1) {
+			v = *where + need;
+			wsilo_space_set(sp, best, aa->silo_maxsize > (off_t)v ?
+			    (aa->silo_maxsize - v) + 1 : SPACE_SEALED);
+			*snp = best;
+			retval = 1;
+			break;
+		}
+		/* The map was wrong, or somebody else holds the silo */
+		if (i == -1)
+			wsilo_space_set(sp, best, SPACE_SEALED);
+		else
+			(void)wsilo_space_probe(aa, sp, best);
+	}
+	AZ(pthread_mutex_unlock(&space_mtx));
+	return (retval);
+}
+
 /* Commit a silo ------------------------------------------------------*/
 
+/*
+ * The hold is in the staging directory, copy it next to the silo
+ * under a temporary name, in one go, and link(2) it into place.
+ *
+ * We own the silo number through the hold in the staging directory,
+ * so whatever is under the temporary name is left over from a crash.
+ */
+
+static void
+wsilo_migrate(const struct wsilo *sl)
+{
+	struct vsb *vsb;
+	int fd, i;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "%s.hold", VSB_data(sl->silo_fn));
+	AZ(VSB_finish(vsb));
+	fd = open(VSB_data(vsb), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	assert(fd >= 0);
+#ifdef FALLOC_FL_KEEP_SIZE
+	/* wsilo_copy() appends, so EOF must stay put, see wsilo_prealloc() */
+	if (sl->aa->silo_prealloc != PREALLOC_NONE)
+		(void)fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+		    sl->aa->silo_prealloc == PREALLOC_SILO ?
+		    sl->aa->silo_maxsize : sl->hold_len);
+#endif
+	assert(wsilo_copy(sl, fd, NULL, 0, sl->hold_len) == 0);
+	AZ(close(fd));
+	i = link(VSB_data(vsb), VSB_data(sl->silo_fn));
+	AZ(unlink(VSB_data(vsb)));
+	AZ(i);
+	VSB_delete(vsb);
+}
+
+static void
+wsilo_index(const struct aardwarc *aa, const char *id, uint32_t flags,
+    uint32_t silono, int new, uint64_t offset, const char *rid)
+{
+	uint8_t rec[IDX_RECSIZE];
+
+	IDX_Record(aa, rec, id, flags, silono, offset, rid);
+	Commit_Index(aa, silono, new, rec, 1);
+}
+
 void
 Wsilo_Install(struct wsilo **slp)
 {
 	struct wsilo *sl;
+	size_t u;
 
 	TAKE_OBJ_NOTNULL(sl, slp, WSILO_MAGIC);
 
-	IDX_Insert(sl->aa,
-	    sl->warcinfo_id, IDX_F_WARCINFO, sl->silo_no, 0, NULL);
+	if (sl->aa->staging_dirname != NULL) {
+		wsilo_migrate(sl);
+	} else {
+		wsilo_spill(sl);
+		if (sl->prealloc_eof)
+			AZ(ftruncate(sl->hold_fd, sl->hold_len));
+		/*
+		 * We don't use rename(2) because it wouldn't fail if the
+		 * destination silo already exists.
+		 */
+		AZ(link(VSB_data(sl->hold_fn), VSB_data(sl->silo_fn)));
+	}
+
 	/*
-	 * We don't use rename(2) because it wouldn't fail if the
-	 * destination silo already exists.
+	 * Not before the silo is in place, other threads can find the
+	 * records through Commit_Iter() right away.
 	 */
-	AZ(link(VSB_data(sl->hold_fn), VSB_data(sl->silo_fn)));
-	if (sl->silo_no == sl->aa->cache_first_non_silo) {
+	if (sl->batch) {
+		/* The batch has room for the warcinfo record at the end */
+		for (u = 0; u < sl->batch_n; u++)
+			be32enc(sl->batch_rec + u * IDX_RECSIZE + 16,
+			    sl->silo_no);
+		IDX_Record(sl->aa, sl->batch_rec + u * IDX_RECSIZE,
+		    sl->warcinfo_id, IDX_F_WARCINFO, sl->silo_no, 0, NULL);
+		Commit_Index(sl->aa, sl->silo_no, 1,
+		    sl->batch_rec, sl->batch_n + 1);
+	} else {
+		wsilo_index(sl->aa,
+		    sl->warcinfo_id, IDX_F_WARCINFO, sl->silo_no, 1, 0, NULL);
+	}
+	wsilo_space_install(sl);
+	if (!sl->leased && sl->silo_no == sl->aa->cache_first_non_silo) {
 		sl->aa->cache_first_non_silo++;
 		AardWARC_WriteCache(sl->aa);
 	}
 	wsilo_delete(sl);
 }
 
+/* Write the final, padded, header of the current object into the hold */
+
+static void
+wsilo_write_header(struct wsilo *sl)
+{
+	struct vsb *vsb;
+	ssize_t s;
+	int i;
+
+	vsb = Header_Serialize(sl->hd, 0);
+	i = sl->hd_len - VSB_len(vsb);
+
+	if (i > 0) {
+		/* Add padding header */
+		assert(i >= 5);
+		char *p = malloc(i);
+		AN(p);
+		memset(p, '_', i - 1);
+		p[i - 1] = '\0';
+		Header_Set(sl->hd, PADDING_HEADER, "%s", p + 4);
+		REPLACE(p, NULL);
+
+		VSB_delete(vsb);
+		vsb = Header_Serialize(sl->hd, 0);
+	}
+	assert(VSB_len(vsb) == sl->hd_len);
+
+	if (sl->mem != NULL) {
+		memcpy(sl->mem + sl->hd_start, VSB_data(vsb), sl->hd_len);
+	} else {
+		s = pwrite(sl->hold_fd, VSB_data(vsb),
+		    sl->hd_len, sl->hd_start);
+		assert(s == sl->hd_len);
+	}
+
+	VSB_delete(vsb);
+}
+
+static void wsilo_batch_add(struct wsilo *sl, const char *id);
+
 void
 Wsilo_Commit(struct wsilo **slp, int segd, const char *id, const char *rid)
 {
 	struct wsilo *sl;
 	struct vsb *vsb;
-	ssize_t s;
-	int i, done = 0;
+	int i;
 	uint32_t sn;
 	struct aardwarc *aa;
 	const char *t;
+	off_t where;
+	uint8_t rec[IDX_RECSIZE];
 
 	AN(slp);
 	AN(id);
 	TAKE_OBJ_NOTNULL(sl, slp, WSILO_MAGIC);
 	AN(sl->hd);
-	AZ(sl->buf_ptr);
+	assert(sl->batch || sl->buf_ptr == NULL);
 	aa = sl->aa;
 
+	if (sl->batch) {
+		/* Park the object in the batch, Wsilo_BatchCommit() does the rest */
+		AZ(segd);
+		AZ(rid);
+		wsilo_write_header(sl);
+		wsilo_batch_add(sl, id);
+		return;
+	}
+
 	if (!segd && sl->silo_no > 0) {
 		AZ(rid);
 		/*
@@ -507,18 +1270,11 @@ Wsilo_Commit(struct wsilo **slp, int segd, const char *id, const char *rid)
 		 * Attempt to append the object to a previous silo.
 		 */
 		vsb = Header_Serialize(sl->hd, AA_COMPRESSION);
-		for (sn = aa->cache_first_space_silo; sn < sl->silo_no;sn++) {
-			i = silo_attempt_append(sl, sn, vsb, id);
-			if (i == 1) {
-				/* Success */
-				done = 1;
-				break;
-			} else if (i == -1)
-				/* Impossible */
-				break;
-		}
+		i = wsilo_append(sl, vsb, sl->hd_start + sl->hd_len,
+		    &sn, &where);
 		VSB_delete(vsb);
-		if (done) {
+		if (i) {
+			wsilo_index(aa, id, sl->idx, sn, 0, where, NULL);
 			wsilo_delete(sl);
 			return;
 		}
@@ -528,29 +1284,7 @@ Wsilo_Commit(struct wsilo **slp, int segd, const char *id, const char *rid)
 	 * Segmented, or simply too big to be appended
 	 * Pad & write the header, rename the hold to silo.
 	 */
-	vsb = Header_Serialize(sl->hd, 0);
-	i = sl->hd_len - VSB_len(vsb);
-
-	if (i > 0) {
-		/* Add padding header */
-		assert(i >= 5);
-		char *p = malloc(i);
-		AN(p);
-		memset(p, '_', i - 1);
-		p[i - 1] = '\0';
-		Header_Set(sl->hd, PADDING_HEADER, "%s", p + 4);
-		REPLACE(p, NULL);
-
-		VSB_delete(vsb);
-		vsb = Header_Serialize(sl->hd, 0);
-	}
-	assert(VSB_len(vsb) == sl->hd_len);
-
-	s = pwrite(sl->hold_fd, VSB_data(vsb),
-	    sl->hd_len, sl->hd_start);
-	assert(s == sl->hd_len);
-
-	VSB_delete(vsb);
+	wsilo_write_header(sl);
 
 	if (segd) {
 		sl->idx |= IDX_F_SEGMENTED;
@@ -561,7 +1295,286 @@ Wsilo_Commit(struct wsilo **slp, int segd, const char *id, const char *rid)
 		if (rid == NULL)
 			sl->idx |= IDX_F_LASTSEG;
 	}
-	IDX_Insert(aa, id, sl->idx, sl->silo_no, sl->hd_start, rid);
+	sn = sl->silo_no;
+	IDX_Record(aa, rec, id, sl->idx, sn, sl->hd_start, rid);
+	Wsilo_Install(&sl);
+	Commit_Index(aa, sn, 1, rec, 1);
+}
+
+/*
+ * Batches
+ * -------
+ *
+ * When storing many small objects, giving each of them a hold of their
+ * own, with a warcinfo record, and trying to append them to previous
+ * silos one by one, costs far more in filesystem metadata operations
+ * than the actual compression does.
+ *
+ * A batch silo collects any number of non-segmented objects in a
+ * single hold, one after the other.  The caller must make sure each
+ * object fits with Wsilo_BatchRoom(), and commits each of them into
+ * the batch with Wsilo_Commit() as usual.  Wsilo_BatchCommit() then
+ * appends all of them to a previous silo in one write(2), or installs
+ * the hold as a new silo, and writes all the index records in one go.
+ */
+
+struct wsilo *
+Wsilo_Batch(struct aardwarc *aa)
+{
+	struct wsilo *sl;
+
+	sl = Wsilo_Next(aa);
+	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
+	sl->batch = 1;
+	sl->batch_start = sl->hold_len;
+	return (sl);
+}
+
+/*
+ * Worst case is stored blocks, five bytes per 64K, plus the headers,
+ * so this is more than enough to never segment.
+ */
+
+static off_t
+wsilo_batch_need(off_t len)
+{
+
+	return (len + len / 1024 + 64 * 1024);
+}
+
+/* Objects bigger than this are better off in silos of their own */
+
+int
+Wsilo_BatchFits(const struct aardwarc *aa, off_t len)
+{
+
+	CHECK_OBJ_NOTNULL(aa, AARDWARC_MAGIC);
+	return (wsilo_batch_need(len) * 4 < aa->silo_maxsize);
+}
+
+/* Is there room for this object in the batch */
+
+int
+Wsilo_BatchRoom(const struct wsilo *sl, off_t len)
+{
+
+	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
+	AN(sl->batch);
+	return (wsilo_batch_need(len) <= Wsilo_Left(sl));
+}
+
+/* Do we have this ID, in the archive or in the batch, if any */
+
+int
+Wsilo_Have(struct aardwarc *aa, const struct wsilo *sl, const char *id)
+{
+	struct getjob *gj;
+	struct vsb *vsb;
+
+	if (sl != NULL && Wsilo_Batched(sl, id))
+		return (1);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	gj = GetJob_New(aa, id, vsb);
+	VSB_destroy(&vsb);
+	if (gj == NULL)
+		return (0);
+	GetJob_Delete(&gj);
+	return (1);
+}
+
+/* A new resource or metadata record, dated now */
+
+struct header *
+Wsilo_NewHeader(const struct aardwarc *aa, const char *wt, const char *mt)
+{
+	struct header *hdr;
+
+	hdr = Header_New(aa);
+	AN(hdr);
+	Header_Set_Date(hdr);
+	Header_Set(hdr, "Content-Type", "%s", mt);
+	Header_Set(hdr, "WARC-Type", "%s", wt);
+	return (hdr);
+}
+
+/*
+ * The list of what a bulk ingest stored, one line per object, is only
+ * printed once it is safely stored.
+ */
+
+void
+Wsilo_Print(struct vsb *out)
+{
+
+	AZ(VSB_finish(out));
+	(void)fputs(VSB_data(out), stdout);
+	(void)fflush(stdout);
+	VSB_clear(out);
+}
+
+void
+Wsilo_Done(const struct aardwarc *aa, struct vsb *out)
+{
+
+	if (Commit_Done(aa) == 0)
+		Wsilo_Print(out);
+}
+
+/* Commit the batch, if any, and print what is durable */
+
+void
+Wsilo_BatchDone(const struct aardwarc *aa, struct wsilo **slp, struct vsb *out)
+{
+
+	AN(slp);
+	if (*slp != NULL) {
+		Wsilo_BatchCommit(slp);
+		Wsilo_Done(aa, out);
+	}
+}
+
+static size_t
+wsilo_batch_hash(const char *id)
+{
+	size_t h = 5381;
+
+	for (; *id != '\0'; id++)
+		h = h * 33 + (unsigned char)*id;
+	return (h);
+}
+
+static void
+wsilo_batch_hashin(const struct wsilo *sl, size_t u)
+{
+	size_t h;
+
+	h = wsilo_batch_hash(sl->batch_id[u]);
+	while (sl->batch_hash[h & (sl->batch_nhash - 1)] != 0)
+		h++;
+	sl->batch_hash[h & (sl->batch_nhash - 1)] = u + 1;
+}
+
+static void
+wsilo_batch_rehash(struct wsilo *sl)
+{
+	size_t u;
+
+	free(sl->batch_hash);
+	sl->batch_nhash = sl->batch_nhash ? sl->batch_nhash * 2 : 1024;
+	sl->batch_hash = calloc(sl->batch_nhash, sizeof *sl->batch_hash);
+	AN(sl->batch_hash);
+	for (u = 0; u < sl->batch_n; u++)
+		wsilo_batch_hashin(sl, u);
+}
+
+int
+Wsilo_Batched(const struct wsilo *sl, const char *id)
+{
+	size_t h, u;
+
+	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
+	AN(id);
+	if (sl->batch_nhash == 0)
+		return (0);
+	for (h = wsilo_batch_hash(id); ; h++) {
+		u = sl->batch_hash[h & (sl->batch_nhash - 1)];
+		if (u == 0)
+			return (0);
+		if (!strcmp(sl->batch_id[u - 1], id))
+			return (1);
+	}
+}
+
+static void
+wsilo_batch_next(struct wsilo *sl)
+{
+	off_t a;
+
+	sl->hd = NULL;
+	sl->hd_start = 0;
+	sl->hd_len = 0;
+	sl->idx = 0;
+	a = lseek(sl->hold_fd, sl->hold_len, SEEK_SET);
+	assert(a == sl->hold_len);
+}
+
+static void
+wsilo_batch_add(struct wsilo *sl, const char *id)
+{
+
+	AZ(Wsilo_Batched(sl, id));
+	if (sl->batch_n + 1 >= sl->batch_space) {
+		/* Always leave a slot for the warcinfo record */
+		sl->batch_space = sl->batch_space ? sl->batch_space * 2 : 256;
+		sl->batch_rec = realloc(sl->batch_rec,
+		    sl->batch_space * IDX_RECSIZE);
+		AN(sl->batch_rec);
+		sl->batch_id = realloc(sl->batch_id,
+		    sl->batch_space * sizeof *sl->batch_id);
+		AN(sl->batch_id);
+	}
+	/* The silo number is not known until Wsilo_BatchCommit() */
+	IDX_Record(sl->aa, sl->batch_rec + sl->batch_n * IDX_RECSIZE,
+	    id, sl->idx, 0, sl->hd_start, NULL);
+	sl->batch_id[sl->batch_n] = strdup(id);
+	AN(sl->batch_id[sl->batch_n]);
+	sl->batch_n++;
+	if (sl->batch_n * 2 >= sl->batch_nhash)
+		wsilo_batch_rehash(sl);
+	else
+		wsilo_batch_hashin(sl, sl->batch_n - 1);
+	wsilo_batch_next(sl);
+}
+
+/* Forget about the current, uncommitted, object in a batch */
+
+void
+Wsilo_Rewind(struct wsilo *sl)
+{
+
+	CHECK_OBJ_NOTNULL(sl, WSILO_MAGIC);
+	assert(sl->batch);
+	wsilo_wb_drain(sl);
+	if (sl->hd_start > 0) {
+		if (sl->mem == NULL)
+			AZ(ftruncate(sl->hold_fd, sl->hd_start));
+		sl->hold_len = sl->hd_start;
+	}
+	wsilo_batch_next(sl);
+}
+
+void
+Wsilo_BatchCommit(struct wsilo **slp)
+{
+	struct wsilo *sl;
+	struct aardwarc *aa;
+	uint32_t sn;
+	uint8_t *r;
+	off_t where;
+	size_t u;
+
+	TAKE_OBJ_NOTNULL(sl, slp, WSILO_MAGIC);
+	assert(sl->batch);
+	AZ(sl->hd);
+	aa = sl->aa;
+
+	if (sl->batch_n == 0) {
+		wsilo_delete(sl);
+		return;
+	}
+
+	if (wsilo_append(sl, NULL, sl->batch_start, &sn, &where)) {
+		for (u = 0; u < sl->batch_n; u++) {
+			r = sl->batch_rec + u * IDX_RECSIZE;
+			be32enc(r + 16, sn);
+			be64enc(r + 20,
+			    where + (be64dec(r + 20) - sl->batch_start));
+		}
+		Commit_Index(aa, sn, 0, sl->batch_rec, sl->batch_n);
+		wsilo_delete(sl);
+		return;
+	}
 	Wsilo_Install(&sl);
 }
 